@@ -8,15 +8,28 @@
 #include "arena_types.h"
 
 // Returns a copy of the arena for the thread with id `thread_id`, creating an
-// arena if no such arena exists
+// arena if no such arena exists. Returns a zeroed arena if none can be created
 arena_t get_arena(pid_t thread_id);
 
+// Returns a pointer to the arena for the thread with id `thread_id`. If no such
+// arena exists, one deleted before is adopted, with everything it holds, and
+// otherwise an arena is created. Arenas never move, so the pointer stays valid
+// until the arena is deleted, and callers can work on the arena in place.
+// Returns NULL if no arena can be created
+arena_t *get_arena_pointer(pid_t thread_id);
+
 // Update the arena for the thread with id `thread_id` to the contents of
 // `new_value`. Returns 0 on success
 int set_arena(pid_t thread_id, arena_t *new_value);
 
-// Deletes the arena owned by the thread with id `thread_id`, if any. Does
-// nothing if no such arena exists
+// Calls `callback` with every arena created so far and `arg`, including those
+// of threads that have exited. Arenas created meanwhile may be left out
+void for_each_arena(void (*callback)(arena_t *arena, void *arg), void *arg);
+
+// Deletes the arena owned by the thread with id `thread_id`, if any, once the
+// thread is done with it. The arena is kept, with its contents, for the next
+// thread that needs one to adopt, and its slot is reused. Does nothing if no
+// such arena exists
 void delete_arena(pid_t thread_id);
 
 #endif
\ No newline at end of file
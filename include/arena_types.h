@@ -1,32 +1,51 @@
 #ifndef ARENA_TYPES_H
 #define ARENA_TYPES_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 
+// Sizes are grouped into this many size classes. Classes 0-3 are 16, 32, 48
+// and 64 bytes. After that every power of two is split into 4 quarter steps
+// (80, 96, 112, 128, 160, ...), so class 63 is 2 MB. Must fit in the bits of a
+// uint64_t
+#define NUM_SIZE_CLASSES 64
+// The first this many size classes, up to 512 bytes, are served from slabs
+#define NUM_SLAB_CLASSES 16
+// Size of the huge pages regions and the slab zone are backed by with
+// M_HUGE_PAGES, the size of a transparent huge page on x86-64 and on arm64
+// with 4 KB pages
+#define HUGE_PAGE_SIZE ((size_t)1 << 21)
+
 typedef struct malloc_chunk malloc_chunk_t;
 typedef struct mmap_region mmap_region_t;
+typedef struct slab slab_t;
 typedef struct arena arena_t;
 typedef struct arena_meta arena_meta_t;
+typedef struct free_tree_node free_tree_node_t;
 
+// The header in front of every chunk's data. The region a chunk resides in is
+// found through the page map (see page_map.h), and a free chunk keeps its bin
+// links in its data, so an occupied chunk costs only these two words
 struct malloc_chunk {
+  // The size of the chunk physically before this one if that chunk is free, its
+  // boundary tag. Unused otherwise
+  size_t prev_size;
+
   // The size of memory the user can use from this chunk. Resides right after
-  // this struct in memory
+  // this struct in memory. The low bits hold CHUNK_FREE and PREV_CHUNK_FREE
   size_t chunk_size;
-  // Previous chunk in the chunk list this chunk belongs to
-  // Next chunk in the chunk list this chunk belongs to
-  malloc_chunk_t *next;
+};
 
-  // Previous free chunk in the free list. NULL if no prev free chunk or if this
-  // chunk is not free
+// Links of a free chunk in the list of its bin, at the start of its data
+typedef struct free_links {
+  // Previous free chunk in the list. NULL if this chunk is the head
   malloc_chunk_t *prev_free;
-  // Next free chunk in the free list. NULL if no next free chunk or if this
-  // chunk is not free
+  // Next free chunk in the list. NULL if this chunk is the tail
   malloc_chunk_t *next_free;
-
-  // The region this chunk resides in
-  mmap_region_t *region;
-};
+} free_links_t;
 
 struct mmap_region {
   // Size of mapped region, including this header
@@ -37,13 +56,6 @@ struct mmap_region {
   // Tail of chunks linked list for this region
   malloc_chunk_t *chunks_tail;
 
-  // Free chunks in the global free list belonging to the same region are
-  // contiguous in the free list. This is the start of this region's section in
-  // the free list
-  malloc_chunk_t *local_free_head;
-  // The end of this region's section in the free list
-  malloc_chunk_t *local_free_tail;
-
   // Pointer to prev region if any
   mmap_region_t *prev_region;
 
@@ -52,15 +64,151 @@ struct mmap_region {
 
   // Number of occupied malloc chunks in this region
   size_t occupied_chunks;
+
+  // The arena this region belongs to
+  arena_t *arena;
+
+  // Chunks freed by threads other than the arena's, linked through the
+  // `next_free` of their free_links_t. They still count as occupied until the
+  // owner moves them into its bins
+  _Atomic(malloc_chunk_t *) remote_frees;
+
+  // Bytes from the start of the region that may hold data from before it was
+  // last emptied. Everything after is zero
+  size_t dirty_size;
+  // While in its arena's region cache: when it was emptied, in milliseconds,
+  // and whether its pages have been given back to the OS already
+  uint64_t cached_at;
+  bool purged;
+  // How the region's pages are backed, one of the HUGE_PAGES_* values of
+  // mallopt's M_HUGE_PAGES
+  uint8_t huge_pages;
 };
 
-// Every thread has its own arena. Thus no need for locks once arena is found.
+// A SLAB_SIZE aligned block holding objects of one size class, with no header
+// per object. The slab an object belongs to is found by masking its address
+struct slab {
+  // The arena this slab belongs to
+  arena_t *arena;
+
+  // Neighbours in the arena's list of slabs of this class with free slots
+  slab_t *prev_slab;
+  slab_t *next_slab;
+
+  // Objects freed by threads other than the arena's, linked through their first
+  // word. They stay marked occupied until the arena takes them back. The low
+  // bit is set while the slab is in its arena's list of slabs with remote
+  // frees, or is about to be put there by the thread that set it
+  _Atomic(uintptr_t) remote_frees;
+  // Next slab in that list
+  slab_t *next_remote;
+
+  // Size of each object, and the size class it belongs to
+  uint32_t object_size;
+  uint32_t size_class;
+  // Number of slots and how many of them are free
+  uint32_t num_slots;
+  uint32_t free_slots;
+  // Offset of the first slot from the start of the slab
+  uint32_t slots_offset;
+  // Words of `free_map` before this one have no free slots
+  uint32_t first_free_word;
+
+  // Bit i is set iff slot i is free
+  uint64_t free_map[];
+};
+
+// Counters of what an arena and its thread have done, merged over every arena
+// when read. Only the arena's own thread updates them, see stat_add. Gauges
+// such as `mmap_chunk_bytes` may wrap below zero in one arena, as threads
+// free each other's mapped chunks, but their sum over all arenas is exact
+typedef struct arena_stats {
+  // Calls returning and taking objects, by the size class of their usable size
+  _Atomic size_t mallocs[NUM_SIZE_CLASSES];
+  _Atomic size_t frees[NUM_SIZE_CLASSES];
+  // Usable bytes of the objects those calls returned and took
+  _Atomic size_t malloc_bytes;
+  _Atomic size_t free_bytes;
+
+  // Bytes of slabs and regions in use by the arena, and of empty regions in
+  // its region cache
+  _Atomic size_t slab_bytes;
+  _Atomic size_t region_bytes;
+  _Atomic size_t cached_region_bytes;
+  // The part of region bytes backed by huge pages
+  _Atomic size_t huge_region_bytes;
+  // Number and usable bytes of chunks with a mapping of their own
+  _Atomic size_t mmap_chunks;
+  _Atomic size_t mmap_chunk_bytes;
+  // Regions in use, and chunks in the arena's bins
+  _Atomic size_t regions;
+  _Atomic size_t free_chunks;
+
+  _Atomic size_t mmap_calls;
+  _Atomic size_t munmap_calls;
+  _Atomic size_t mremap_calls;
+  // Bin lookups for a free chunk, and the chunks looked at in total
+  _Atomic size_t free_list_searches;
+  _Atomic size_t free_list_search_steps;
+} arena_stats_t;
+
+// Add `delta` to `counter` of an arena the calling thread owns. No other
+// thread writes it, so a relaxed load and store are enough, which cost no more
+// than a plain add. They are atomic only so other threads can read counters
+// while they are updated. Subtract by passing `-delta`
+static inline void stat_add(_Atomic size_t *counter, size_t delta) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + delta,
+      memory_order_relaxed);
+}
+
+// Every thread has its own arena. Thus no need for locks once arena is found,
+// unless arenas are shared between threads, see M_ARENAS_PER_CPU.
 struct arena {
+  // The owning thread, or 0 while the arena waits to be adopted after its
+  // thread exited. It is then linked to the next such arena through
+  // `next_orphan`, see delete_arena
   pid_t thread_id;
+  arena_t *next_orphan;
   mmap_region_t *regions_start;
   mmap_region_t *regions_end;
-  malloc_chunk_t *free_head;
-  malloc_chunk_t *free_tail;
+
+  // Free chunks by size class. Chunks smaller than a page are kept in doubly
+  // linked lists, larger ones in trees by size and address, see free_tree.h
+  malloc_chunk_t *bins[NUM_SIZE_CLASSES];
+  free_tree_node_t *tree_bins[NUM_SIZE_CLASSES];
+  // Bit i is set iff bins[i] or tree_bins[i] is non-empty
+  uint64_t nonempty_bins;
+
+  // Lists of slabs with free slots, one per slab size class
+  slab_t *slabs[NUM_SLAB_CLASSES];
+  // Slabs other threads have freed objects into, linked through `next_remote`
+  _Atomic(slab_t *) remote_slabs;
+
+  // Empty regions kept for reuse, most recently emptied first, linked through
+  // `next_region` and `prev_region`. Shared with the background reclaim
+  // thread, so the cache fields below are only used with this lock held
+  atomic_flag region_cache_lock;
+  mmap_region_t *cached_regions;
+  size_t num_cached_regions;
+  // Regions taken from the cache, regions that had to be mapped, and bytes of
+  // cached regions given back to the OS
+  size_t region_cache_hits;
+  size_t region_cache_misses;
+  size_t region_cache_purged_bytes;
+
+  // Size of the next region to map before decay, 0 until the first, and when
+  // the last one was mapped, see grow_region_size
+  size_t next_region_size;
+  uint64_t region_mapped_at;
+
+  // Only for arenas shared between threads: held by the thread working on the
+  // arena, and the number of threads using it, changed under the lock of the
+  // whole pool of shared arenas
+  atomic_flag lock;
+  size_t num_threads;
+
+  arena_stats_t stats;
 };
 
-#endif
\ No newline at end of file
+#endif
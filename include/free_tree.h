@@ -0,0 +1,37 @@
+// Red-black tree of free chunks, ordered by size and then by address. Nodes
+// live in the data of the free chunks themselves, so the tree needs no memory
+// of its own. Finding the best fit for a request is a single descent, and among
+// chunks of the best size it picks the lowest address, which keeps allocations
+// packed towards the start of regions
+
+#ifndef FREE_TREE_H
+#define FREE_TREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena_types.h"
+
+struct free_tree_node {
+  free_tree_node_t *left;
+  free_tree_node_t *right;
+  free_tree_node_t *parent;
+  // The key, with the node's own address breaking ties
+  size_t size;
+  bool red;
+};
+
+// Insert `node`, whose chunk has `size` bytes, into the tree at `root`
+void free_tree_insert(free_tree_node_t **root, free_tree_node_t *node,
+                      size_t size);
+
+// Remove `node` from the tree at `root`
+void free_tree_remove(free_tree_node_t **root, free_tree_node_t *node);
+
+// Returns the node of the smallest size of at least `size`, the lowest
+// addressed of those, or NULL if every node is smaller. Adds the number of
+// nodes looked at to `steps`
+free_tree_node_t *free_tree_best_fit(free_tree_node_t *root, size_t size,
+                                     size_t *steps);
+
+#endif
@@ -0,0 +1,38 @@
+// Sampling heap profiler. The allocator picks which allocations to sample, and
+// hands them here with their size. Each sample records the calling stack, and
+// is tracked until freed. Samples are aggregated per stack, and written in the
+// legacy heap profile format pprof reads
+
+#ifndef HEAP_PROFILE_H
+#define HEAP_PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Get ready to take samples every `mean_bytes` bytes on average. Call before
+// the first sample, outside of any allocation
+void profile_enable(size_t mean_bytes);
+
+// Returns the number of bytes to allocate until the next sample: a random
+// draw from an exponential distribution with mean `mean_bytes`, which makes
+// every byte allocated equally likely to be sampled
+size_t profile_next_sample(size_t mean_bytes);
+
+// Record a sample of the `size` bytes just allocated at `ptr`, with the stack
+// of the calling thread. Returns false if it wasn't recorded, as the tables are
+// full or the profiler is itself allocating
+bool profile_record(void *ptr, size_t size);
+
+// Stop tracking the sampled `ptr`, which is being freed
+void profile_forget(void *ptr);
+
+// Write the profile to `path`. Returns 0, or -1 with errno set if it couldn't
+// be written
+int profile_write(const char *path);
+
+// Write the profile to the profile file for the next dump whenever signal
+// `signo` is received. 0 removes the handler. Returns false if `signo` is not
+// a valid signal
+bool profile_set_signal(int signo);
+
+#endif
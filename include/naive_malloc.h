@@ -1,9 +1,282 @@
 #ifndef NAIVE_MALLOC_H
 #define NAIVE_MALLOC_H
 
+#include <malloc.h>  // struct mallinfo2
 #include <unistd.h>
 
-void *malloc(size_t sz);
-void free(void *ptr);
+// Marks the functions libmymalloc.so exports. The rest of the library is built
+// with -fvisibility=hidden, so its internals can't be called or interposed
+#define NAIVE_MALLOC_API __attribute__((visibility("default")))
 
-#endif
\ No newline at end of file
+// Parameters for mallopt. Requests of at least this many bytes get a mapping of
+// their own, which is unmapped on free and resized with mremap on realloc. At
+// most 2 MB. Defaults to 128 KB. Same value as glibc's
+#define M_MMAP_THRESHOLD -3
+// Most chunks the per-thread cache holds per size
+// class. 0 disables the cache. Defaults to 32
+#define M_TCACHE_COUNT -101
+// Largest request served from the per-thread cache, at most 4096. Defaults to
+// 1024
+#define M_TCACHE_MAX_SIZE -102
+// Chunks moved between the per-thread cache and the arena at once, when the
+// cache runs empty or a full cache is flushed. Defaults to 16
+#define M_TCACHE_BATCH -103
+// Most empty regions each arena keeps for reuse instead of unmapping them. 0
+// unmaps empty regions right away. Defaults to 8
+#define M_REGION_CACHE_COUNT -104
+// Milliseconds an empty region stays cached before its pages are given back to
+// the OS with madvise. It is unmapped once cached for twice as long. Decay is
+// only checked when the cache is used. 0 unmaps empty regions right away.
+// Defaults to 1000
+#define M_REGION_DECAY_MS -105
+// Mean bytes allocated between heap profile samples. Sampled objects are
+// tracked with the stack that allocated them until freed, see
+// malloc_profile_write. 0 turns profiling off. Defaults to 0
+#define M_PROFILE_SAMPLE_BYTES -106
+// Signal on which the heap profile is written to naive_malloc.<pid>.<n>.heap in
+// the working directory, numbering dumps from 0. 0 removes the handler.
+// Defaults to 0
+#define M_PROFILE_SIGNAL -107
+// Whether regions and slabs are backed by 2 MB huge pages, which cover a large
+// heap with far fewer TLB entries. HUGE_PAGES_TRANSPARENT maps regions of at
+// least 2 MB at 2 MB alignment and advises them and the slab zone with
+// MADV_HUGEPAGE, and keeps the pages of emptied slabs so huge pages aren't
+// split. HUGE_PAGES_EXPLICIT first maps regions with MAP_HUGETLB, from the
+// pages reserved in /proc/sys/vm/nr_hugepages. Either falls back to the next
+// mode down for any mapping the kernel can't back that way. Only affects
+// regions mapped afterwards. Defaults to HUGE_PAGES_OFF
+#define M_HUGE_PAGES -108
+#define HUGE_PAGES_OFF 0
+#define HUGE_PAGES_TRANSPARENT 1
+#define HUGE_PAGES_EXPLICIT 2
+// Each region an arena maps is twice the size of the one before, from the
+// minimum up to the maximum region size, and only larger when a single request
+// doesn't fit. Every M_REGION_SIZE_DECAY_MS the arena goes without mapping a
+// region halves the size again. Sizes are rounded up to a power of two, and
+// regions are at least a page, or 2 MB with huge pages. The minimum defaults to
+// 64 KB, the maximum to 32 MB, and neither may exceed 1 GB. The decay defaults
+// to 1000, and 0 keeps every region at the minimum. All three can also be set
+// before the first region is mapped with the NAIVE_MALLOC_REGION_SIZE
+// environment variable, e.g. "min=256K,max=64M,decay_ms=500"
+#define M_REGION_MIN_SIZE -109
+#define M_REGION_MAX_SIZE -110
+#define M_REGION_SIZE_DECAY_MS -111
+// Milliseconds between passes of a background thread that returns freed memory
+// to the OS, so that free makes no munmap or madvise calls. While it runs,
+// emptied regions always go to the region cache, and the thread unmaps or
+// purges them as M_REGION_CACHE_COUNT and M_REGION_DECAY_MS say. Emptied slabs
+// and freed mapped chunks wait for its next pass. 0 stops the thread and
+// returns whatever is waiting right away. Defaults to 0
+#define M_BACKGROUND_RECLAIM -112
+// Most arenas threads allocate from, per CPU the process may run on. Rather
+// than one arena each, threads then share at most this many times the CPU
+// count, up to 256 arenas. A thread joins the arena fewest threads use, a new
+// one while under the limit, and moves to a less used one if it keeps finding
+// its arena held by another thread. Bounds the memory held by free chunks and
+// cached regions of many threads, at the cost of a lock per arena. Objects
+// from before a thread joins stay in its own arena. Threads that have joined
+// an arena keep sharing after setting it back to 0, the default, which gives
+// every thread its own arena again. Only with thread arenas
+#define M_ARENAS_PER_CPU -113
+
+NAIVE_MALLOC_API void *malloc(size_t sz);
+NAIVE_MALLOC_API void free(void *ptr);
+NAIVE_MALLOC_API void *calloc(size_t nmemb, size_t size);
+NAIVE_MALLOC_API void *realloc(void *ptr, size_t size);
+// realloc for an array of `nmemb` elements of `size` bytes. Returns NULL and
+// leaves `ptr` untouched if the total size overflows
+NAIVE_MALLOC_API void *reallocarray(void *ptr, size_t nmemb, size_t size);
+
+// free for callers that know the size `ptr` was last allocated or reallocated
+// with, as C++ sized delete does. Saves looking the size up for small objects
+NAIVE_MALLOC_API void free_sized(void *ptr, size_t size);
+
+// Allocate `count` objects of `size` bytes into `ptrs`, as `count` calls to
+// malloc would, but taking as many objects from each slab or region at once as
+// it has room for. Objects don't go through the per-thread cache. Returns the
+// number allocated, fewer than `count` only if memory ran out
+NAIVE_MALLOC_API size_t malloc_batch(size_t size, size_t count, void **ptrs);
+
+// Free the `count` objects at `ptrs`, as `count` calls to free would. Runs of
+// objects from the same slab or region are freed together: a slab's bitmap and
+// counts are updated once per run, a region's occupied count once per run of
+// adjacent chunks, which are merged into one free chunk, and objects of other
+// threads' slabs and regions are handed over all at once. NULLs are skipped
+NAIVE_MALLOC_API void free_batch(void **ptrs, size_t count);
+
+// Get a whole region of at least `size` bytes, at most 1 GB, for the caller to
+// carve up itself, as a bump allocator does. Taken from the calling thread's
+// region cache if one fits, and otherwise mapped as the arena's regions are,
+// so it is usually larger. Sets `*capacity` to its usable bytes, which start
+// at the address returned and are aligned to 16 bytes. Returns NULL on
+// failure. Nothing in it may be passed to free
+NAIVE_MALLOC_API void *malloc_region_alloc(size_t size, size_t *capacity);
+
+// Give back a region from malloc_region_alloc, from any thread. It goes to the
+// calling thread's region cache
+NAIVE_MALLOC_API void malloc_region_free(void *ptr);
+
+// A scoped arena, for objects that all die together, such as those of one
+// request. Objects are bump-allocated from regions taken with
+// malloc_region_alloc, with no header per object, and freed all at once by a
+// reset, which keeps the regions for reuse, or by destroying the arena. Not
+// thread safe, but it may be destroyed on any thread
+typedef struct scoped_arena scoped_arena_t;
+
+// Create an arena with room for `size` bytes up front, as the first region
+// goes. Returns NULL on failure
+NAIVE_MALLOC_API scoped_arena_t *arena_create(size_t size);
+// Returns `size` bytes aligned to `alignment`, a power of two or 0 for 16
+// bytes, or NULL if memory ran out or `alignment` is invalid. The bytes are
+// not zeroed, and are never passed to free
+NAIVE_MALLOC_API void *arena_alloc(scoped_arena_t *arena, size_t size,
+                                   size_t alignment);
+// Free everything allocated from `arena`, keeping its regions to allocate
+// from again
+NAIVE_MALLOC_API void arena_reset(scoped_arena_t *arena);
+// Free everything allocated from `arena`, and `arena` itself, giving its
+// regions back to the calling thread's region cache
+NAIVE_MALLOC_API void arena_destroy(scoped_arena_t *arena);
+// Get the bytes of `arena` allocated, or skipped over for alignment or at the
+// end of a region, since the last reset, and the bytes and number of regions
+// it holds
+NAIVE_MALLOC_API void arena_get_stats(scoped_arena_t *arena, size_t *used_bytes,
+                                      size_t *region_bytes, size_t *regions);
+
+// A pool of objects of one size, such as the nodes of a hash table or queue.
+// Objects come from blocks of at least 64 KB mapped for the pool alone, with
+// no header per object, and freed objects are kept in a free list per block,
+// linked through their first word, so allocating and freeing one takes a few
+// instructions. A block is unmapped once all its objects are freed, except
+// for one kept for reuse. Not thread safe
+typedef struct object_pool object_pool_t;
+
+// Statistics of a pool
+typedef struct pool_stats {
+  // Size of each object as created, of the slot holding it, rounded up to the
+  // alignment, and of the blocks slots are carved from
+  size_t object_size;
+  size_t slot_size;
+  size_t block_size;
+  // Objects in use, and calls to pool_alloc and pool_free
+  size_t objects;
+  size_t allocs;
+  size_t frees;
+  // Blocks mapped, their bytes, and how many hold no objects
+  size_t blocks;
+  size_t block_bytes;
+  size_t empty_blocks;
+  // System calls made for blocks
+  size_t mmap_calls;
+  size_t munmap_calls;
+} pool_stats_t;
+
+// Create a pool of objects of `size` bytes, at most 1 MB, aligned to
+// `alignment`, a power of two up to a page or 0 for 16 bytes. Returns NULL on
+// invalid arguments or failure
+NAIVE_MALLOC_API object_pool_t *pool_create(size_t size, size_t alignment);
+// Returns an object from `pool`, or NULL if memory ran out. Not zeroed
+NAIVE_MALLOC_API void *pool_alloc(object_pool_t *pool);
+// Give an object back to the pool it came from. NULL is ignored
+NAIVE_MALLOC_API void pool_free(object_pool_t *pool, void *ptr);
+// Free `pool` and every object in it, unmapping all its blocks
+NAIVE_MALLOC_API void pool_destroy(object_pool_t *pool);
+NAIVE_MALLOC_API void pool_get_stats(object_pool_t *pool, pool_stats_t *stats);
+
+// Allocation with an alignment beyond the default 16 bytes. `alignment` must be
+// a power of two, and for posix_memalign also a multiple of sizeof(void *)
+NAIVE_MALLOC_API int posix_memalign(void **memptr, size_t alignment,
+                                    size_t size);
+NAIVE_MALLOC_API void *aligned_alloc(size_t alignment, size_t size);
+NAIVE_MALLOC_API void *memalign(size_t alignment, size_t size);
+// Page aligned, and for pvalloc also rounded up to a whole number of pages
+NAIVE_MALLOC_API void *valloc(size_t size);
+NAIVE_MALLOC_API void *pvalloc(size_t size);
+
+// Returns the number of bytes usable at `ptr`, at least what was asked for
+NAIVE_MALLOC_API size_t malloc_usable_size(void *ptr);
+
+// Set the tunable `param` to `value`. Meant to be called before other threads
+// start allocating. Returns 1 on success and 0 on an invalid param or value
+NAIVE_MALLOC_API int mallopt(int param, int value);
+
+// Get the number of allocations the calling thread served from its cache, and
+// the number of cacheable allocations it had to get from its arena instead
+NAIVE_MALLOC_API void malloc_tcache_stats(size_t *hits, size_t *misses);
+
+// Get the number of regions the calling thread's arena reused from its empty
+// region cache, the number it had to map instead, and the number of bytes of
+// cached regions it has given back to the OS
+NAIVE_MALLOC_API void malloc_region_cache_stats(size_t *hits, size_t *misses,
+                                                size_t *purged_bytes);
+
+// Number of size classes statistics are kept for. Objects are counted in the
+// largest class no larger than their usable size
+#define MALLOC_STATS_CLASSES 64
+
+// Allocator statistics, merged over the arenas of every thread that has
+// allocated, including threads that have exited
+typedef struct malloc_stats {
+  // Usable bytes of the allocations the program holds
+  size_t allocated_bytes;
+  // Bytes of slabs, regions and mapped chunks in use. Besides allocations,
+  // they hold per-thread caches, free chunks and metadata
+  size_t active_bytes;
+  // Active bytes plus empty regions kept for reuse
+  size_t mapped_bytes;
+  // The parts of those
+  size_t slab_bytes;
+  size_t region_bytes;
+  size_t cached_region_bytes;
+  size_t mmap_chunk_bytes;
+  // The part of region bytes backed by huge pages, transparent or explicit
+  size_t huge_region_bytes;
+
+  // Regions in use, chunks with a mapping of their own, and free chunks in bins
+  size_t regions;
+  size_t mmap_chunks;
+  size_t free_chunks;
+
+  // System calls made for regions and mapped chunks
+  size_t mmap_calls;
+  size_t munmap_calls;
+  size_t mremap_calls;
+
+  // Bin lookups for a free chunk, and the chunks looked at in total
+  size_t free_list_searches;
+  size_t free_list_search_steps;
+
+  // Arenas shared between threads, see M_ARENAS_PER_CPU, the times a thread
+  // found its arena held by another, and the times one moved to another arena
+  size_t shared_arenas;
+  size_t arena_contentions;
+  size_t arena_migrations;
+
+  // Smallest usable size of each class, and how many objects of it were handed
+  // out and given back
+  size_t class_sizes[MALLOC_STATS_CLASSES];
+  size_t mallocs[MALLOC_STATS_CLASSES];
+  size_t frees[MALLOC_STATS_CLASSES];
+} malloc_stats_t;
+
+// Fill in `stats`. Counters are kept per thread and only merged here, so
+// keeping them costs the allocator no shared writes. A thread updating its
+// counters meanwhile may be seen halfway through an operation
+NAIVE_MALLOC_API void malloc_get_stats(malloc_stats_t *stats);
+
+// The statistics as glibc reports them. `arena` is the slab and region bytes,
+// `uordblks` and `fordblks` the bytes allocated and not allocated in them,
+// `ordblks` the free chunks, `hblks` and `hblkhd` the mapped chunks and their
+// bytes and `keepcost` the bytes of cached empty regions
+NAIVE_MALLOC_API struct mallinfo2 mallinfo2(void);
+
+// Print the statistics to stderr, without allocating
+NAIVE_MALLOC_API void malloc_stats(void);
+
+// Write the heap profile to `path`, in the legacy heap format pprof reads:
+// sampled objects still in use and all sampled so far, grouped by stack. Run
+// `pprof <binary> <path>` to view it. Returns 0, or -1 with errno set if the
+// file couldn't be written
+NAIVE_MALLOC_API int malloc_profile_write(const char *path);
+
+#endif
@@ -0,0 +1,237 @@
+// C++ memory resources and an allocator over mmap_malloc, for containers that
+// should allocate from it without going through new and delete
+
+#ifndef NAIVE_PMR_H
+#define NAIVE_PMR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory_resource>
+#include <new>
+
+// From naive_malloc.h, whose declarations of the rest of the malloc family
+// would clash with those of <cstdlib>
+extern "C" {
+void free_sized(void *ptr, std::size_t size) noexcept;
+void *malloc_region_alloc(std::size_t size, std::size_t *capacity) noexcept;
+void malloc_region_free(void *ptr) noexcept;
+}
+
+namespace naive_malloc {
+
+// Alignment of everything malloc hands out
+constexpr std::size_t MALLOC_ALIGNMENT = 16;
+
+// Allocate `size` bytes aligned to `alignment`, a power of two, from the
+// calling thread's arena. Throws std::bad_alloc on failure
+inline void *allocate_bytes(std::size_t size, std::size_t alignment) {
+  // Zero bytes must still give a unique pointer
+  if (size == 0) size = 1;
+  void *ptr = nullptr;
+  if (alignment <= MALLOC_ALIGNMENT) {
+    ptr = std::malloc(size);
+  } else if (posix_memalign(&ptr, alignment, size) != 0) {
+    ptr = nullptr;
+  }
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+// Free what allocate_bytes returned for `size` and `alignment`. With the
+// default alignment the size is passed on to free_sized, which then needn't
+// look it up
+inline void deallocate_bytes(void *ptr, std::size_t size,
+                             std::size_t alignment) noexcept {
+  if (size == 0) size = 1;
+  if (alignment <= MALLOC_ALIGNMENT) {
+    free_sized(ptr, size);
+  } else {
+    std::free(ptr);
+  }
+}
+
+// A memory resource over the calling thread's arena: objects of up to 512
+// bytes come from slabs, with no header per object, and larger ones from
+// chunks. Memory may be deallocated on any thread, and by any instance
+class arena_resource : public std::pmr::memory_resource {
+ protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+    return allocate_bytes(bytes, alignment);
+  }
+
+  void do_deallocate(void *ptr, std::size_t bytes,
+                     std::size_t alignment) override {
+    deallocate_bytes(ptr, bytes, alignment);
+  }
+
+  bool do_is_equal(
+      const std::pmr::memory_resource &other) const noexcept override {
+    return dynamic_cast<const arena_resource *>(&other) != nullptr;
+  }
+};
+
+// Returns an arena_resource that lives as long as the program, as
+// std::pmr::new_delete_resource does
+inline arena_resource *get_arena_resource() noexcept {
+  static arena_resource resource;
+  return &resource;
+}
+
+// A memory resource that bump-allocates from whole regions of the calling
+// thread's arena, see malloc_region_alloc, and gives them all back at once on
+// release or destruction. Deallocation does nothing, so objects carry no
+// header and are never searched for or binned, but their memory is only
+// reused after release. Regions grow as the arena's do, so a resource that
+// takes many gets large ones. Requests too large for any region get an
+// allocation of their own from the arena, freed on release too. Not thread
+// safe, like std::pmr::monotonic_buffer_resource
+class monotonic_region_resource : public std::pmr::memory_resource {
+ public:
+  monotonic_region_resource() = default;
+  monotonic_region_resource(const monotonic_region_resource &) = delete;
+  monotonic_region_resource &operator=(const monotonic_region_resource &) =
+      delete;
+  ~monotonic_region_resource() override { release(); }
+
+  // Give every region back to the arena's region cache, and free every large
+  // allocation, which frees everything allocated from the resource
+  void release() noexcept {
+    while (regions_ != nullptr) {
+      region_link *next = regions_->next;
+      malloc_region_free(regions_);
+      regions_ = next;
+    }
+    while (large_ != nullptr) {
+      large_link *next = large_->next;
+      deallocate_bytes(large_, large_->size, large_->alignment);
+      large_ = next;
+    }
+    next_ = nullptr;
+    end_ = nullptr;
+    region_bytes_ = 0;
+  }
+
+  // Returns the usable bytes of the regions held, not counting large
+  // allocations
+  std::size_t region_bytes() const noexcept { return region_bytes_; }
+
+ protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+    if (alignment > MAX_REGION_SIZE / 2 ||
+        bytes > MAX_REGION_SIZE - sizeof(region_link) - alignment) {
+      return allocate_large(bytes, alignment);
+    }
+    char *ptr = align_up(next_, alignment);
+    if (next_ == nullptr || ptr > end_ ||
+        bytes > static_cast<std::size_t>(end_ - ptr)) {
+      add_region(bytes, alignment);
+      ptr = align_up(next_, alignment);
+    }
+    next_ = ptr + bytes;
+    return ptr;
+  }
+
+  void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+  bool do_is_equal(
+      const std::pmr::memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+
+ private:
+  // Largest region malloc_region_alloc hands out, see naive_malloc.h
+  static constexpr std::size_t MAX_REGION_SIZE = std::size_t{1} << 30;
+
+  // Held regions are linked through their first bytes
+  struct region_link {
+    region_link *next;
+  };
+
+  // Large allocations are linked through a header in front of the bytes
+  // handed out, with what allocate_bytes was given for them
+  struct large_link {
+    large_link *next;
+    std::size_t size;
+    std::size_t alignment;
+  };
+
+  static char *align_up(char *ptr, std::size_t alignment) {
+    std::uintptr_t address = reinterpret_cast<std::uintptr_t>(ptr);
+    return reinterpret_cast<char *>((address + alignment - 1) &
+                                    ~(std::uintptr_t)(alignment - 1));
+  }
+
+  // Make a new region with room for `bytes` aligned to `alignment` the one to
+  // allocate from. What is left of the previous one is wasted
+  void add_region(std::size_t bytes, std::size_t alignment) {
+    std::size_t overhead = sizeof(region_link) + alignment;
+    if (bytes > SIZE_MAX - overhead) throw std::bad_alloc();
+    std::size_t capacity;
+    void *start = malloc_region_alloc(bytes + overhead, &capacity);
+    if (start == nullptr) throw std::bad_alloc();
+
+    regions_ = new (start) region_link{regions_};
+    next_ = static_cast<char *>(start) + sizeof(region_link);
+    end_ = static_cast<char *>(start) + capacity;
+    region_bytes_ += capacity;
+  }
+
+  // Allocate `bytes` aligned to `alignment` with allocate_bytes, for a
+  // request too large for a region. The current region is kept
+  void *allocate_large(std::size_t bytes, std::size_t alignment) {
+    if (alignment < alignof(large_link)) alignment = alignof(large_link);
+    std::size_t header =
+        (sizeof(large_link) + alignment - 1) & ~(alignment - 1);
+    if (bytes > SIZE_MAX - header) throw std::bad_alloc();
+    void *start = allocate_bytes(bytes + header, alignment);
+    large_ = new (start) large_link{large_, bytes + header, alignment};
+    return static_cast<char *>(start) + header;
+  }
+
+  region_link *regions_ = nullptr;
+  large_link *large_ = nullptr;
+  // The unused bytes of the newest region
+  char *next_ = nullptr;
+  char *end_ = nullptr;
+  std::size_t region_bytes_ = 0;
+};
+
+// An allocator for standard containers over the calling thread's arena, like
+// arena_resource but with no virtual call, and with no state, so every
+// instance compares equal. The container passes the size of what it frees on
+// to free_sized
+template <typename T>
+class sized_allocator {
+ public:
+  using value_type = T;
+
+  sized_allocator() noexcept = default;
+  template <typename U>
+  sized_allocator(const sized_allocator<U> &) noexcept {}
+
+  T *allocate(std::size_t n) {
+    if (n > SIZE_MAX / sizeof(T)) throw std::bad_array_new_length();
+    return static_cast<T *>(allocate_bytes(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T *ptr, std::size_t n) noexcept {
+    deallocate_bytes(ptr, n * sizeof(T), alignof(T));
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const sized_allocator<T> &,
+                const sized_allocator<U> &) noexcept {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const sized_allocator<T> &,
+                const sized_allocator<U> &) noexcept {
+  return false;
+}
+
+}  // namespace naive_malloc
+
+#endif
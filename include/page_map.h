@@ -0,0 +1,50 @@
+// Page map from every page of a region to the region, so the region holding a
+// chunk is found from the chunk's address alone, and chunk headers need no
+// pointer to it. A two level radix tree over the page number of an address: a
+// static root, only backed where it is touched, and leaves mapping 1 GB of
+// address space each, mapped when a region first lands in their range.
+// Leaves are never freed, and entries of unmapped regions are left behind, as
+// nothing looks up an address that isn't in a live region
+
+#ifndef PAGE_MAP_H
+#define PAGE_MAP_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena_types.h"
+
+// Regions are made of whole pages of this many bytes
+#define PAGE_MAP_PAGE_SHIFT 12
+// Bits of a user space address on x86-64 and arm64 without 5 level paging
+#define PAGE_MAP_ADDRESS_BITS 48
+// Bits of the page number each level resolves
+#define PAGE_MAP_LEAF_BITS 18
+#define PAGE_MAP_ROOT_BITS \
+  (PAGE_MAP_ADDRESS_BITS - PAGE_MAP_PAGE_SHIFT - PAGE_MAP_LEAF_BITS)
+
+typedef struct page_map_leaf {
+  mmap_region_t *regions[(size_t)1 << PAGE_MAP_LEAF_BITS];
+} page_map_leaf_t;
+
+// Leaves by the high bits of the page number, NULL until first needed
+extern _Atomic(page_map_leaf_t *)
+    page_map_root[(size_t)1 << PAGE_MAP_ROOT_BITS];
+
+// Map every page from `start` up to `start` + `size` to `region`. Returns false
+// if a leaf couldn't be mapped, or the range is beyond PAGE_MAP_ADDRESS_BITS
+bool page_map_set(void *start, size_t size, mmap_region_t *region);
+
+// Returns the region the page of `ptr` was last mapped to. Requires `ptr` to be
+// in a region. Any thread may look up any region, as a pointer into a region is
+// only passed to another thread after the region was mapped
+static inline mmap_region_t *page_map_get(const void *ptr) {
+  uintptr_t page = (uintptr_t)ptr >> PAGE_MAP_PAGE_SHIFT;
+  page_map_leaf_t *leaf = atomic_load_explicit(
+      &page_map_root[page >> PAGE_MAP_LEAF_BITS], memory_order_acquire);
+  return leaf->regions[page & (((uintptr_t)1 << PAGE_MAP_LEAF_BITS) - 1)];
+}
+
+#endif
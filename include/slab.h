@@ -0,0 +1,75 @@
+// Slabs for small objects. Each slab is a SLAB_SIZE aligned block of equally
+// sized slots with a bitmap of free slots in front, so objects carry no header
+// of their own, and the slab owning an object is found by masking its address.
+// Slabs are carved out of one reserved range of address space, so telling a
+// slab object from any other pointer is a single range check
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena_types.h"
+
+#define SLAB_SIZE ((size_t)1 << 16)
+// Largest object served from slabs. The last slab size class
+#define MAX_SLAB_OBJECT_SIZE 512
+
+// Bounds of the slab zone. Written once, before any slab is handed out. The
+// size is zero until the start is valid
+extern char *slab_zone_start;
+extern _Atomic size_t slab_zone_size;
+
+// Returns true iff `ptr` points into a slab
+static inline bool is_slab_pointer(void *ptr) {
+  size_t size = atomic_load_explicit(&slab_zone_size, memory_order_acquire);
+  return (uintptr_t)ptr - (uintptr_t)slab_zone_start < size;
+}
+
+// Returns the slab holding `ptr`. Requires is_slab_pointer(ptr)
+static inline slab_t *get_slab(void *ptr) {
+  return (slab_t *)((uintptr_t)ptr & ~(SLAB_SIZE - 1));
+}
+
+// Advise the whole slab zone to be backed by transparent huge pages, or stop
+// doing so. While they are on, emptied slabs keep their pages. Returns false
+// if the zone couldn't be reserved or the kernel has no transparent huge pages
+bool slab_zone_set_huge_pages(bool enabled);
+
+// While `enabled`, slabs emptied by slab_free wait for slab_reclaim to return
+// their pages and make them available again, so freeing makes no system call.
+// Turning it off reclaims the waiting slabs
+void slab_defer_release(bool enabled);
+
+// Return the pages of the slabs emptied while release was deferred, and make
+// them available to every arena. Safe to call from any thread. Returns the
+// number of slabs reclaimed
+size_t slab_reclaim();
+
+// Allocate an object of `object_size` bytes, the size of slab size class
+// `size_class`, from one of `arena`'s slabs. Returns NULL if no new slab can be
+// made
+void *slab_malloc(arena_t *arena, size_t size_class, size_t object_size);
+
+// Allocate up to `count` objects like slab_malloc into `ptrs`, taking as many
+// from each slab at once as it has free. Returns the number allocated, fewer
+// than `count` only if no new slab can be made
+size_t slab_malloc_batch(arena_t *arena, size_t size_class,
+                         size_t object_size, void **ptrs, size_t count);
+
+// Free `ptr`, which points into a slab, on behalf of the thread owning `arena`.
+// Objects of other arenas' slabs are handed to their owners
+void slab_free(arena_t *arena, void *ptr);
+
+// Free the `count` objects at `ptrs`, which all point into the same slab, like
+// slab_free, updating the slab once for all of them. Requires `count` > 0
+void slab_free_batch(arena_t *arena, void **ptrs, size_t count);
+
+// Take back every object other threads have freed into `arena`'s slabs, on
+// behalf of the thread owning it. Slabs this empties are released
+void slab_collect_remote_frees(arena_t *arena);
+
+#endif
@@ -1,67 +1,187 @@
+#include <malloc.h>  // M_TRIM_THRESHOLD, M_TOP_PAD
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 
+// Chunk data sizes are multiples of this, so chunks can be split anywhere
+#define ALIGNMENT 16
+#define ALIGN_UP(x, a) (((x) + (a)-1) & ~((size_t)(a)-1))
+
+// A free chunk is only split if the remainder can hold a header and this much
+// data
+#define MIN_SPLIT_SIZE ALIGNMENT
+// A chunk other than the top one is only split if at least this much, and at
+// least what is handed out, would be left. Smaller leftovers would pile up in
+// the free list for every later malloc to scan past
+#define MIN_LEFTOVER_SIZE 1024
+
 // Must have fixed compile time size, so we store a pointer to the allocated
-// heap memory instead of storing it in the chunk itself
-typedef struct malloc_chunk {
+// heap memory instead of storing it in the chunk itself. Padded to ALIGNMENT,
+// so data stays aligned when chunks are split
+typedef struct __attribute__((aligned(ALIGNMENT))) malloc_chunk {
   size_t chunk_size;
+  // The chunk physically before this one, NULL for the first chunk
   struct malloc_chunk *prev;
+  // Neighbours in the free list. Only valid while the chunk is free
+  struct malloc_chunk *prev_free;
   struct malloc_chunk *next_free;
   bool occupied;
 } malloc_chunk_t;
 
 static malloc_chunk_t *chunks_head = NULL;
 static malloc_chunk_t *chunks_tail = NULL;
+// Free chunks, in the order they were freed. Adjacent free chunks are always
+// merged, so all free memory at the end of the heap is in one chunk, the last
+// one, called the top chunk. Trimming only has to look at `chunks_tail`
 static malloc_chunk_t *free_head = NULL;
 static malloc_chunk_t *free_tail = NULL;
 
-static void free_list_delete_gte(void *cutoff_address) {
-  // Prune head until we are certain at least one element remains
-  while (free_head != NULL && (void *)free_head >= cutoff_address) {
-    free_head = free_head->next_free;
+// Tunables, see mallopt. The program break is only lowered once the top chunk
+// holds more than `trim_threshold` bytes, and then down to `top_pad` bytes.
+// The heap grows by `top_pad` bytes beyond what a request needs, so a stack of
+// allocations and frees at the top of the heap doesn't move the break
+static size_t trim_threshold = 128 * 1024;
+static size_t top_pad = 64 * 1024;
+
+static void *get_chunk_data(malloc_chunk_t *chunk) {
+  return (char *)chunk + sizeof(malloc_chunk_t);
+}
+
+// Returns the chunk physically after `chunk`, or NULL if it is the last one
+static malloc_chunk_t *get_next_chunk(malloc_chunk_t *chunk) {
+  if (chunk == chunks_tail) return NULL;
+  return (malloc_chunk_t *)((char *)get_chunk_data(chunk) + chunk->chunk_size);
+}
+
+static void free_list_append(malloc_chunk_t *chunk) {
+  chunk->prev_free = free_tail;
+  chunk->next_free = NULL;
+  if (free_tail == NULL) {
+    free_head = chunk;
+  } else {
+    free_tail->next_free = chunk;
   }
+  free_tail = chunk;
+}
 
-  if (free_head == NULL) {
-    // List is empty, set tail NULL and return
-    free_tail = NULL;
-    return;
+static void free_list_delete(malloc_chunk_t *chunk) {
+  if (chunk->prev_free == NULL) {
+    free_head = chunk->next_free;
+  } else {
+    chunk->prev_free->next_free = chunk->next_free;
   }
+  if (chunk->next_free == NULL) {
+    free_tail = chunk->prev_free;
+  } else {
+    chunk->next_free->prev_free = chunk->prev_free;
+  }
+}
 
-  // List is not empty. Maintain 2 pointers to prune elements. The above
-  // conditions ensure that free_head != NULL, and free_head < cutoff_address.
-  malloc_chunk_t *prev = free_head;
-  malloc_chunk_t *ptr = free_head->next_free;
-  while (ptr != NULL) {
-    if ((void *)ptr >= cutoff_address) {
-      // Delete this node from linked list, do not increment prev
-      prev->next_free = ptr->next_free;
+// Put the free `replacement` in the free list where `chunk` is
+static void free_list_replace(malloc_chunk_t *chunk,
+                              malloc_chunk_t *replacement) {
+  replacement->prev_free = chunk->prev_free;
+  replacement->next_free = chunk->next_free;
+  if (chunk->prev_free == NULL) {
+    free_head = replacement;
+  } else {
+    chunk->prev_free->next_free = replacement;
+  }
+  if (chunk->next_free == NULL) {
+    free_tail = replacement;
+  } else {
+    chunk->next_free->prev_free = replacement;
+  }
+}
 
-      if (ptr == free_tail) {
-        free_tail = prev;
-      }
+// Merge `next`, the chunk physically after `chunk`, into `chunk`. Neither free
+// list position is touched
+static void absorb_next_chunk(malloc_chunk_t *chunk, malloc_chunk_t *next) {
+  chunk->chunk_size += sizeof(malloc_chunk_t) + next->chunk_size;
+  if (next == chunks_tail) {
+    chunks_tail = chunk;
+  } else {
+    get_next_chunk(chunk)->prev = chunk;
+  }
+}
 
-      ptr = ptr->next_free;
-    } else {
-      prev = prev->next_free;
-      ptr = ptr->next_free;
-    }
+// Shrink `chunk` to `sz` bytes if the rest is large enough to be a chunk of its
+// own. If `chunk` is free, the rest takes its place in the free list, and
+// otherwise the rest must be merged or added by the caller. Returns the rest,
+// or NULL if it wasn't split
+static malloc_chunk_t *split_chunk(malloc_chunk_t *chunk, size_t sz) {
+  if (chunk->chunk_size < sz + sizeof(malloc_chunk_t) + MIN_SPLIT_SIZE) {
+    return NULL;
   }
+
+  malloc_chunk_t *rest = (malloc_chunk_t *)((char *)get_chunk_data(chunk) + sz);
+  rest->chunk_size = chunk->chunk_size - sz - sizeof(malloc_chunk_t);
+  rest->prev = chunk;
+  rest->occupied = false;
+  if (chunk == chunks_tail) {
+    chunks_tail = rest;
+  } else {
+    get_next_chunk(chunk)->prev = rest;
+  }
+  chunk->chunk_size = sz;
+
+  if (!chunk->occupied) free_list_replace(chunk, rest);
+  return rest;
 }
 
-// Creates a new chunk and places it at the end of the chunks list
-static void *create_new_chunk(size_t sz) {
-  // Make space for the metadata and actual data
-  char *program_break = sbrk(sz + sizeof(malloc_chunk_t));
+// Hand out `sz` bytes of the free `chunk`, splitting off the rest if it is the
+// top chunk or the rest is large enough, see MIN_LEFTOVER_SIZE
+static void *take_free_chunk(malloc_chunk_t *chunk, size_t sz) {
+  size_t leftover = chunk->chunk_size - sz;
+  bool split = chunk == chunks_tail ||
+               (leftover >= sz && leftover >= MIN_LEFTOVER_SIZE);
+  if (!split || split_chunk(chunk, sz) == NULL) free_list_delete(chunk);
+  chunk->occupied = true;
+  return get_chunk_data(chunk);
+}
+
+// Move the program break up by `increment` bytes plus `top_pad` if that can be
+// had, or by only `increment` otherwise. Returns the old break and sets `*got`
+// to the bytes added, or returns NULL if the heap can't grow
+static char *grow_heap(size_t increment, size_t *got) {
+  char *program_break = (void *)-1;
+  if (increment <= SIZE_MAX - top_pad) {
+    *got = increment + top_pad;
+    program_break = sbrk(*got);
+  }
   if (program_break == (void *)-1) {
-    // Failed to alloc
-    return NULL;
+    *got = increment;
+    program_break = sbrk(*got);
   }
-  void *data_ptr = program_break + sizeof(malloc_chunk_t);
+  return program_break == (void *)-1 ? NULL : program_break;
+}
+
+// Grows the heap to fit `sz` bytes after all the free chunks were too small.
+// A free top chunk is extended rather than left behind, otherwise a new chunk
+// is placed at the end of the chunks list. Either way what the heap grew by
+// beyond `sz` is split off as the new free top chunk
+static void *create_new_chunk(size_t sz) {
+  size_t got;
+  malloc_chunk_t *top = chunks_tail;
+  if (top != NULL && !top->occupied) {
+    if (grow_heap(sz - top->chunk_size, &got) == NULL) return NULL;
+    top->chunk_size += got;
+    return take_free_chunk(top, sz);
+  }
+
+  if (chunks_head == NULL) {
+    // Start the first chunk on an ALIGNMENT boundary, so every chunk is
+    uintptr_t skew = (uintptr_t)sbrk(0) % ALIGNMENT;
+    if (skew != 0 && sbrk(ALIGNMENT - skew) == (void *)-1) return NULL;
+  }
+
+  // Make space for the metadata and actual data
+  char *program_break = grow_heap(sizeof(malloc_chunk_t) + sz, &got);
+  if (program_break == NULL) return NULL;
   malloc_chunk_t *metadata_ptr = (malloc_chunk_t *)program_break;
 
-  metadata_ptr->chunk_size = sz;
+  metadata_ptr->chunk_size = got - sizeof(malloc_chunk_t);
   metadata_ptr->prev = chunks_tail;
-  metadata_ptr->next_free = NULL;
   metadata_ptr->occupied = true;
 
   if (chunks_head == NULL) {
@@ -71,100 +191,97 @@ static void *create_new_chunk(size_t sz) {
 
   // Either way, this will be the new tail
   chunks_tail = metadata_ptr;
-  return data_ptr;
+  malloc_chunk_t *rest = split_chunk(metadata_ptr, sz);
+  if (rest != NULL) free_list_append(rest);
+  return get_chunk_data(metadata_ptr);
 }
 
-void *malloc(size_t sz) {
-  if (sz == 0) return NULL;
-
-  if (free_head == NULL) return create_new_chunk(sz);
-
-  // First, scan allocated blocks for any gaps we can slot into
-  malloc_chunk_t *prev = free_head;
-  malloc_chunk_t *ptr = free_head->next_free;
-
-  // Check if head can be reused
-  if (free_head->chunk_size >= sz) {
-    free_head->occupied = true;
-
-    // Update the free list
-    free_head = free_head->next_free;
-    // Previous free list head resides in `prev`. Set its next_free to NULL
-    prev->next_free = NULL;
+// Lower the program break to leave `pad` bytes in the free top chunk, or drop
+// the top chunk altogether if `pad` is 0
+static void trim_top(size_t pad) {
+  malloc_chunk_t *top = chunks_tail;
+  pad = ALIGN_UP(pad, ALIGNMENT);
+  if (top == NULL || top->occupied || top->chunk_size <= pad) return;
 
-    // If head is NULL, free list is empty. Set tail NULL.
-    if (free_head == NULL) {
-      free_tail = NULL;
-    }
-
-    // prev still points to the old free_head
-    return (char *)prev + sizeof(malloc_chunk_t);
+  if (pad == 0) {
+    free_list_delete(top);
+    chunks_tail = top->prev;
+    if (chunks_tail == NULL) chunks_head = NULL;
+    brk(top);
+    return;
   }
 
-  // Try reusing any other element of the free list
-  while (ptr != NULL) {
-    if (ptr->chunk_size >= sz) {
-      // We will return `ptr`'s data_ptr. Mark this chunk as occupied.
-      ptr->occupied = true;
-
-      // Remove ptr from the list by making its prev point past it.
-      prev->next_free = ptr->next_free;
-      // If prev points to NULL, it's the new tail.
-      if (prev->next_free == NULL) {
-        free_tail = prev;
-      }
-
-      // Delete the newly occupied chunk's next_free
-      ptr->next_free = NULL;
+  top->chunk_size = pad;
+  brk((char *)get_chunk_data(top) + pad);
+}
 
-      return (char *)ptr + sizeof(malloc_chunk_t);
-    }
+void *malloc(size_t sz) {
+  if (sz == 0 || sz > SIZE_MAX - sizeof(malloc_chunk_t) - ALIGNMENT) {
+    return NULL;
+  }
+  sz = ALIGN_UP(sz, ALIGNMENT);
 
-    ptr = ptr->next_free;
-    prev = prev->next_free;
+  // First, scan the free list for any gaps we can slot into
+  for (malloc_chunk_t *ptr = free_head; ptr != NULL; ptr = ptr->next_free) {
+    if (ptr->chunk_size >= sz) return take_free_chunk(ptr, sz);
   }
 
-  // No eligible gaps. Create new chunk at put at end of list.
+  // No eligible gaps. Grow the heap
   return create_new_chunk(sz);
 }
 
 void free(void *addr) {
-  malloc_chunk_t *chunk_to_free =
+  if (addr == NULL) return;
+
+  malloc_chunk_t *chunk =
       (malloc_chunk_t *)((char *)addr - sizeof(malloc_chunk_t));
   // Mark chunk unoccupied
-  chunk_to_free->occupied = false;
-  // Append to free list. Set head if list empty
-  if (free_head == NULL) {
-    free_head = chunk_to_free;
-  } else {
-    free_tail->next_free = chunk_to_free;
-  }
-  free_tail = chunk_to_free;
+  chunk->occupied = false;
 
-  // We're freeing the last chunk. Scan backwards for all contiguous free'd
-  // chunks
-  if (chunk_to_free == chunks_tail) {
-    while (chunk_to_free->prev != NULL && !chunk_to_free->prev->occupied) {
-      chunk_to_free = chunk_to_free->prev;
+  // Merge with whichever neighbours are free, in O(1) as the chunk list and
+  // the free list are both doubly linked. Merging into the chunk after it, the
+  // chunk takes that one's place in the free list
+  malloc_chunk_t *prev = chunk->prev;
+  malloc_chunk_t *next = get_next_chunk(chunk);
+  bool prev_free = prev != NULL && !prev->occupied;
+  if (next != NULL && !next->occupied) {
+    if (prev_free) {
+      free_list_delete(next);
+    } else {
+      free_list_replace(next, chunk);
     }
+    absorb_next_chunk(chunk, next);
+  }
+  if (prev_free) {
+    absorb_next_chunk(prev, chunk);
+    chunk = prev;
+  } else if (next == NULL || next->occupied) {
+    free_list_append(chunk);
+  }
 
-    // chunk_to_free == chunks_head and it's not occupied.
-    if (chunk_to_free->prev == NULL) {
-      malloc_chunk_t *new_program_break = chunks_head;
-      chunks_head = NULL;
-      chunks_tail = NULL;
+  // Only give memory back to the OS once enough of it is free at the top
+  if (chunk == chunks_tail && chunk->chunk_size > trim_threshold) {
+    trim_top(top_pad);
+  }
+}
 
-      free_head = NULL;
-      free_tail = NULL;
-      brk(new_program_break);
-      return;
-    }
+int mallopt(int param, int value) {
+  if (value < 0) return 0;
 
-    // We know that at least one chunk remains and that chunk_to_free is the
-    // earliest address we can free
-    malloc_chunk_t *new_program_break = chunk_to_free;
-    chunks_tail = chunk_to_free->prev;
-    free_list_delete_gte(new_program_break);
-    brk(new_program_break);
+  switch (param) {
+    case M_TRIM_THRESHOLD:
+      trim_threshold = value;
+      return 1;
+    case M_TOP_PAD:
+      top_pad = ALIGN_UP((size_t)value, ALIGNMENT);
+      return 1;
+    default:
+      return 0;
   }
 }
+
+int malloc_trim(size_t pad) {
+  void *old_program_break = sbrk(0);
+  trim_top(pad);
+  return sbrk(0) != old_program_break;
+}
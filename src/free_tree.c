@@ -0,0 +1,215 @@
+#include <stdint.h>
+
+#include "free_tree.h"
+
+// Missing children are black leaves
+static bool is_red(free_tree_node_t *node) { return node != NULL && node->red; }
+
+// Returns true iff `a` goes before `b`
+static bool node_before(free_tree_node_t *a, free_tree_node_t *b) {
+  return a->size < b->size ||
+         (a->size == b->size && (uintptr_t)a < (uintptr_t)b);
+}
+
+// Put `new_node` where `old` hangs in the tree at `root`. Leaves the children
+// of both alone
+static void replace_child(free_tree_node_t **root, free_tree_node_t *old,
+                          free_tree_node_t *new_node) {
+  free_tree_node_t *parent = old->parent;
+  if (parent == NULL) {
+    *root = new_node;
+  } else if (parent->left == old) {
+    parent->left = new_node;
+  } else {
+    parent->right = new_node;
+  }
+  if (new_node != NULL) new_node->parent = parent;
+}
+
+// Make the right child of `node` its parent
+static void rotate_left(free_tree_node_t **root, free_tree_node_t *node) {
+  free_tree_node_t *child = node->right;
+  node->right = child->left;
+  if (child->left != NULL) child->left->parent = node;
+  replace_child(root, node, child);
+  child->left = node;
+  node->parent = child;
+}
+
+// Make the left child of `node` its parent
+static void rotate_right(free_tree_node_t **root, free_tree_node_t *node) {
+  free_tree_node_t *child = node->left;
+  node->left = child->right;
+  if (child->right != NULL) child->right->parent = node;
+  replace_child(root, node, child);
+  child->right = node;
+  node->parent = child;
+}
+
+void free_tree_insert(free_tree_node_t **root, free_tree_node_t *node,
+                      size_t size) {
+  node->size = size;
+  node->left = NULL;
+  node->right = NULL;
+  node->red = true;
+
+  free_tree_node_t *parent = NULL;
+  free_tree_node_t **link = root;
+  while (*link != NULL) {
+    parent = *link;
+    link = node_before(node, parent) ? &parent->left : &parent->right;
+  }
+  node->parent = parent;
+  *link = node;
+
+  // Fix up red nodes with red parents, moving up the tree. The root is black,
+  // so a red parent always has a parent of its own
+  while (is_red(node->parent)) {
+    parent = node->parent;
+    free_tree_node_t *grandparent = parent->parent;
+    if (parent == grandparent->left) {
+      free_tree_node_t *uncle = grandparent->right;
+      if (is_red(uncle)) {
+        parent->red = false;
+        uncle->red = false;
+        grandparent->red = true;
+        node = grandparent;
+        continue;
+      }
+      if (node == parent->right) {
+        rotate_left(root, parent);
+        node = parent;
+        parent = node->parent;
+      }
+      parent->red = false;
+      grandparent->red = true;
+      rotate_right(root, grandparent);
+    } else {
+      free_tree_node_t *uncle = grandparent->left;
+      if (is_red(uncle)) {
+        parent->red = false;
+        uncle->red = false;
+        grandparent->red = true;
+        node = grandparent;
+        continue;
+      }
+      if (node == parent->left) {
+        rotate_right(root, parent);
+        node = parent;
+        parent = node->parent;
+      }
+      parent->red = false;
+      grandparent->red = true;
+      rotate_left(root, grandparent);
+    }
+  }
+  (*root)->red = false;
+}
+
+// Restore the black heights after a black node was removed from above `node`,
+// a child of `parent`. `node` may be NULL, hence the separate parent
+static void remove_fixup(free_tree_node_t **root, free_tree_node_t *node,
+                         free_tree_node_t *parent) {
+  while (node != *root && !is_red(node)) {
+    if (node == parent->left) {
+      free_tree_node_t *sibling = parent->right;
+      if (is_red(sibling)) {
+        sibling->red = false;
+        parent->red = true;
+        rotate_left(root, parent);
+        sibling = parent->right;
+      }
+      if (!is_red(sibling->left) && !is_red(sibling->right)) {
+        sibling->red = true;
+        node = parent;
+        parent = node->parent;
+        continue;
+      }
+      if (!is_red(sibling->right)) {
+        sibling->left->red = false;
+        sibling->red = true;
+        rotate_right(root, sibling);
+        sibling = parent->right;
+      }
+      sibling->red = parent->red;
+      parent->red = false;
+      sibling->right->red = false;
+      rotate_left(root, parent);
+    } else {
+      free_tree_node_t *sibling = parent->left;
+      if (is_red(sibling)) {
+        sibling->red = false;
+        parent->red = true;
+        rotate_right(root, parent);
+        sibling = parent->left;
+      }
+      if (!is_red(sibling->left) && !is_red(sibling->right)) {
+        sibling->red = true;
+        node = parent;
+        parent = node->parent;
+        continue;
+      }
+      if (!is_red(sibling->left)) {
+        sibling->right->red = false;
+        sibling->red = true;
+        rotate_left(root, sibling);
+        sibling = parent->left;
+      }
+      sibling->red = parent->red;
+      parent->red = false;
+      sibling->left->red = false;
+      rotate_right(root, parent);
+    }
+    node = *root;
+  }
+  if (node != NULL) node->red = false;
+}
+
+void free_tree_remove(free_tree_node_t **root, free_tree_node_t *node) {
+  free_tree_node_t *child;
+  free_tree_node_t *parent;
+  bool removed_red;
+
+  if (node->left == NULL || node->right == NULL) {
+    child = node->left != NULL ? node->left : node->right;
+    parent = node->parent;
+    removed_red = node->red;
+    replace_child(root, node, child);
+  } else {
+    // Put the node's successor, which has no left child, in its place
+    free_tree_node_t *successor = node->right;
+    while (successor->left != NULL) successor = successor->left;
+    child = successor->right;
+    removed_red = successor->red;
+
+    if (successor->parent == node) {
+      parent = successor;
+    } else {
+      parent = successor->parent;
+      replace_child(root, successor, child);
+      successor->right = node->right;
+      successor->right->parent = successor;
+    }
+    replace_child(root, node, successor);
+    successor->left = node->left;
+    successor->left->parent = successor;
+    successor->red = node->red;
+  }
+
+  if (!removed_red) remove_fixup(root, child, parent);
+}
+
+free_tree_node_t *free_tree_best_fit(free_tree_node_t *root, size_t size,
+                                     size_t *steps) {
+  free_tree_node_t *best = NULL;
+  while (root != NULL) {
+    (*steps)++;
+    if (root->size >= size) {
+      best = root;
+      root = root->left;
+    } else {
+      root = root->right;
+    }
+  }
+  return best;
+}
@@ -0,0 +1,435 @@
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heap_profile.h"
+
+// Frames kept per stack, beyond the profiler's own
+#define MAX_DEPTH 32
+// Distinct stacks that can be told apart, and slots indexing them by hash
+#define MAX_BUCKETS (1 << 14)
+#define BUCKET_SLOTS (2 * MAX_BUCKETS)
+// Slots for sampled objects not yet freed. At most three quarters are used
+#define SAMPLE_SLOTS (1 << 17)
+#define MAX_SAMPLES (SAMPLE_SLOTS / 4 * 3)
+
+#define LN2 0.6931471805599453
+#define UNLIKELY(x) __builtin_expect(x, 0)
+
+// Samples taken with the same stack
+typedef struct bucket {
+  size_t alloc_count;
+  size_t alloc_bytes;
+  size_t free_count;
+  size_t free_bytes;
+  uint64_t hash;
+  size_t depth;
+  void *stack[MAX_DEPTH];
+} bucket_t;
+
+// A sampled object that hasn't been freed yet. NULL `ptr` marks a free slot
+typedef struct sample {
+  void *ptr;
+  size_t size;
+  bucket_t *bucket;
+} sample_t;
+
+// All tables live in mappings of their own, so the profiler never allocates
+// from the heap it profiles. Buckets are handed out in order from
+// `bucket_storage` and never freed. `bucket_slots` maps stack hashes to them
+// with linear probing, holding indices plus one so zero is a free slot.
+// `samples` is keyed by pointer, also with linear probing
+static bucket_t *bucket_storage = NULL;
+static uint32_t *bucket_slots = NULL;
+static size_t num_buckets = 0;
+static sample_t *samples = NULL;
+static size_t num_samples = 0;
+
+// Mean bytes between samples, as written in the profile header
+static size_t sample_mean = 0;
+
+// Guards every table. A spinlock rather than a mutex, so a signal handler can
+// try to take it. A dump signal arriving while it is held sets `dump_pending`,
+// and whoever releases it writes the dump
+static atomic_flag tables_lock = ATOMIC_FLAG_INIT;
+static atomic_bool dump_pending = false;
+// Dumps on signal written so far, numbering the files
+static atomic_uint num_dumps = 0;
+static int dump_signal = 0;
+
+static pthread_once_t profile_once = PTHREAD_ONCE_INIT;
+// Set while the calling thread is in the profiler, so the allocations that
+// backtrace may make are never sampled themselves
+static __thread bool in_profiler = false;
+static __thread uint64_t rng_state = 0;
+
+static void lock_tables() {
+  while (
+      atomic_flag_test_and_set_explicit(&tables_lock, memory_order_acquire)) {
+    sched_yield();
+  }
+}
+
+static bool try_lock_tables() {
+  return !atomic_flag_test_and_set_explicit(&tables_lock,
+                                            memory_order_acquire);
+}
+
+static void dump_to_next_file();
+
+static void unlock_tables() {
+  atomic_flag_clear_explicit(&tables_lock, memory_order_release);
+
+  // A dump signal arrived while the tables were locked
+  if (UNLIKELY(atomic_exchange(&dump_pending, false))) {
+    lock_tables();
+    dump_to_next_file();
+    unlock_tables();
+  }
+}
+
+// Keep the tables consistent across fork by holding the lock over it. No
+// sample may be taken in between, or the forking thread would wait on itself
+static void before_fork() {
+  in_profiler = true;
+  lock_tables();
+}
+
+static void after_fork() {
+  atomic_flag_clear_explicit(&tables_lock, memory_order_release);
+  in_profiler = false;
+}
+
+static void init_profile() {
+  bucket_storage = mmap(NULL, MAX_BUCKETS * sizeof(bucket_t),
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  bucket_slots = mmap(NULL, BUCKET_SLOTS * sizeof(uint32_t),
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  samples = mmap(NULL, SAMPLE_SLOTS * sizeof(sample_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (bucket_storage == MAP_FAILED || bucket_slots == MAP_FAILED ||
+      samples == MAP_FAILED) {
+    samples = NULL;
+    return;
+  }
+
+  pthread_atfork(before_fork, after_fork, after_fork);
+
+  // The first backtrace loads the unwinder, which allocates. Get that over
+  // with here rather than in the middle of a sample
+  void *frame;
+  in_profiler = true;
+  backtrace(&frame, 1);
+  in_profiler = false;
+}
+
+void profile_enable(size_t mean_bytes) {
+  pthread_once(&profile_once, init_profile);
+  sample_mean = mean_bytes;
+}
+
+// xorshift, seeded per thread
+static uint64_t next_random() {
+  if (UNLIKELY(rng_state == 0)) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rng_state = ((uintptr_t)&rng_state ^ (uint64_t)ts.tv_nsec) | 1;
+  }
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+size_t profile_next_sample(size_t mean_bytes) {
+  // -ln(u) for u uniform in (0, 1], as u = x / 2^53. Splitting x into m * 2^e
+  // with m in [1, 2) leaves ln(m), whose series in t = (m - 1) / (m + 1)
+  // converges quickly as t <= 1/3. Saves depending on libm
+  uint64_t x = (next_random() >> 11) | 1;
+  int e = 63 - __builtin_clzl(x);
+  double m = (double)x / (double)((uint64_t)1 << e);
+  double t = (m - 1) / (m + 1);
+  double t2 = t * t;
+  double ln_m = 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 / 7)));
+  double bytes = ((53 - e) * LN2 - ln_m) * mean_bytes;
+  return bytes < 1 ? 1 : (size_t)bytes;
+}
+
+static uint64_t hash_stack(void **stack, size_t depth) {
+  // FNV-1a over the return addresses. Never 0, which marks an unused bucket
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < depth; i++) {
+    hash = (hash ^ (uintptr_t)stack[i]) * 1099511628211ull;
+  }
+  return hash | 1;
+}
+
+static size_t hash_pointer(void *ptr) {
+  return (size_t)(((uintptr_t)ptr >> 4) * 11400714819323198485ull >> 32);
+}
+
+// Returns the bucket for `stack`, creating it if needed, or NULL if every
+// bucket is taken. Requires the lock
+static bucket_t *get_bucket(void **stack, size_t depth) {
+  uint64_t hash = hash_stack(stack, depth);
+  size_t slot = hash % BUCKET_SLOTS;
+  while (bucket_slots[slot] != 0) {
+    bucket_t *bucket = &bucket_storage[bucket_slots[slot] - 1];
+    if (bucket->hash == hash && bucket->depth == depth &&
+        memcmp(bucket->stack, stack, depth * sizeof(void *)) == 0) {
+      return bucket;
+    }
+    slot = (slot + 1) % BUCKET_SLOTS;
+  }
+
+  if (num_buckets == MAX_BUCKETS) return NULL;
+  bucket_t *bucket = &bucket_storage[num_buckets++];
+  bucket->hash = hash;
+  bucket->depth = depth;
+  memcpy(bucket->stack, stack, depth * sizeof(void *));
+  bucket_slots[slot] = num_buckets;
+  return bucket;
+}
+
+// Returns the slot of the sample at `ptr`, or of the free slot where it would
+// go. Requires the lock
+static size_t find_sample(void *ptr) {
+  size_t slot = hash_pointer(ptr) % SAMPLE_SLOTS;
+  while (samples[slot].ptr != NULL && samples[slot].ptr != ptr) {
+    slot = (slot + 1) % SAMPLE_SLOTS;
+  }
+  return slot;
+}
+
+// Empty the sample slot `slot`, moving later samples of the same probe run
+// back so lookups never stop early at the hole. Requires the lock
+static void delete_sample(size_t slot) {
+  size_t next = slot;
+  while (true) {
+    next = (next + 1) % SAMPLE_SLOTS;
+    if (samples[next].ptr == NULL) break;
+
+    // The sample at `next` can fill the hole unless its probe starts after the
+    // hole, cyclically
+    size_t home = hash_pointer(samples[next].ptr) % SAMPLE_SLOTS;
+    bool after_hole = slot <= next ? slot < home && home <= next
+                                   : slot < home || home <= next;
+    if (!after_hole) {
+      samples[slot] = samples[next];
+      slot = next;
+    }
+  }
+
+  samples[slot].ptr = NULL;
+  num_samples--;
+}
+
+bool profile_record(void *ptr, size_t size) {
+  if (in_profiler || samples == NULL) return false;
+  in_profiler = true;
+
+  // The first frame is this function
+  void *stack[MAX_DEPTH + 1];
+  int depth = backtrace(stack, MAX_DEPTH + 1);
+
+  bool recorded = false;
+  if (depth > 1) {
+    lock_tables();
+    bucket_t *bucket = num_samples < MAX_SAMPLES
+                           ? get_bucket(stack + 1, depth - 1)
+                           : NULL;
+    if (bucket != NULL) {
+      sample_t *sample = &samples[find_sample(ptr)];
+      sample->ptr = ptr;
+      sample->size = size;
+      sample->bucket = bucket;
+      num_samples++;
+
+      bucket->alloc_count++;
+      bucket->alloc_bytes += size;
+      recorded = true;
+    }
+    unlock_tables();
+  }
+
+  in_profiler = false;
+  return recorded;
+}
+
+void profile_forget(void *ptr) {
+  lock_tables();
+  size_t slot = find_sample(ptr);
+  if (samples[slot].ptr != NULL) {
+    bucket_t *bucket = samples[slot].bucket;
+    bucket->free_count++;
+    bucket->free_bytes += samples[slot].size;
+    delete_sample(slot);
+  }
+  unlock_tables();
+}
+
+// Formats into a buffer on the stack and writes it out when full. Dumps may be
+// written from a signal handler, so no stdio
+typedef struct writer {
+  int fd;
+  size_t length;
+  char buffer[4096];
+} writer_t;
+
+static void flush(writer_t *writer) {
+  size_t done = 0;
+  while (done < writer->length) {
+    ssize_t written =
+        write(writer->fd, writer->buffer + done, writer->length - done);
+    if (written <= 0 && errno != EINTR) break;
+    if (written > 0) done += written;
+  }
+  writer->length = 0;
+}
+
+static void append(writer_t *writer, const char *str) {
+  for (; *str != '\0'; str++) {
+    if (writer->length == sizeof(writer->buffer)) flush(writer);
+    writer->buffer[writer->length++] = *str;
+  }
+}
+
+static void append_number(writer_t *writer, uint64_t value, unsigned base) {
+  char digits[24];
+  size_t i = sizeof(digits) - 1;
+  digits[i] = '\0';
+  do {
+    digits[--i] = "0123456789abcdef"[value % base];
+    value /= base;
+  } while (value != 0);
+  append(writer, digits + i);
+}
+
+// Write "<in use count>: <in use bytes> [<allocated count>: <allocated bytes>]"
+static void append_counts(writer_t *writer, size_t alloc_count,
+                          size_t alloc_bytes, size_t free_count,
+                          size_t free_bytes) {
+  append_number(writer, alloc_count - free_count, 10);
+  append(writer, ": ");
+  append_number(writer, alloc_bytes - free_bytes, 10);
+  append(writer, " [");
+  append_number(writer, alloc_count, 10);
+  append(writer, ": ");
+  append_number(writer, alloc_bytes, 10);
+  append(writer, "]");
+}
+
+// Write the profile to `fd`: a header with the totals and the sampling rate,
+// a line per stack and the process's mappings, so pprof can symbolize the
+// addresses. Counts are of samples, which pprof scales up by the rate.
+// Requires the lock
+static void write_profile(int fd) {
+  writer_t writer;
+  writer.fd = fd;
+  writer.length = 0;
+
+  size_t totals[4] = {0, 0, 0, 0};
+  for (size_t i = 0; i < num_buckets; i++) {
+    totals[0] += bucket_storage[i].alloc_count;
+    totals[1] += bucket_storage[i].alloc_bytes;
+    totals[2] += bucket_storage[i].free_count;
+    totals[3] += bucket_storage[i].free_bytes;
+  }
+  append(&writer, "heap profile: ");
+  append_counts(&writer, totals[0], totals[1], totals[2], totals[3]);
+  append(&writer, " @ heap_v2/");
+  append_number(&writer, sample_mean, 10);
+  append(&writer, "\n");
+
+  for (size_t i = 0; i < num_buckets; i++) {
+    bucket_t *bucket = &bucket_storage[i];
+    append_counts(&writer, bucket->alloc_count, bucket->alloc_bytes,
+                  bucket->free_count, bucket->free_bytes);
+    append(&writer, " @");
+    for (size_t j = 0; j < bucket->depth; j++) {
+      append(&writer, " 0x");
+      append_number(&writer, (uintptr_t)bucket->stack[j], 16);
+    }
+    append(&writer, "\n");
+  }
+
+  append(&writer, "\nMAPPED_LIBRARIES:\n");
+  flush(&writer);
+  int maps = open("/proc/self/maps", O_RDONLY);
+  if (maps < 0) return;
+  ssize_t length;
+  while ((length = read(maps, writer.buffer, sizeof(writer.buffer))) > 0) {
+    writer.length = length;
+    flush(&writer);
+  }
+  close(maps);
+}
+
+int profile_write(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return -1;
+
+  lock_tables();
+  write_profile(fd);
+  unlock_tables();
+
+  return close(fd);
+}
+
+// Write the profile to naive_malloc.<pid>.<n>.heap in the current directory,
+// numbering dumps from 0. Requires the lock
+static void dump_to_next_file() {
+  writer_t path;
+  path.length = 0;
+  append(&path, "naive_malloc.");
+  append_number(&path, getpid(), 10);
+  append(&path, ".");
+  append_number(&path, atomic_fetch_add(&num_dumps, 1), 10);
+  append(&path, ".heap");
+  path.buffer[path.length] = '\0';
+
+  int fd = open(path.buffer, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return;
+  write_profile(fd);
+  close(fd);
+}
+
+static void handle_dump_signal(int signo) {
+  int saved_errno = errno;
+  if (try_lock_tables()) {
+    dump_to_next_file();
+    unlock_tables();
+  } else {
+    atomic_store(&dump_pending, true);
+  }
+  errno = saved_errno;
+}
+
+bool profile_set_signal(int signo) {
+  if (signo < 0 || signo >= NSIG) return false;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  action.sa_handler = signo == 0 ? SIG_DFL : handle_dump_signal;
+
+  if (signo == 0) {
+    if (dump_signal != 0) sigaction(dump_signal, &action, NULL);
+  } else if (sigaction(signo, &action, NULL) != 0) {
+    return false;
+  }
+  dump_signal = signo;
+  return true;
+}
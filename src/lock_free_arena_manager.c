@@ -0,0 +1,214 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arena_manager.h"
+
+// Map thread ids to arenas with a two level radix table indexed by the bits of
+// the thread id. Lookups never take a lock: leaves are mmap-ed on demand and
+// installed with a CAS, and so are arenas within a leaf. Arenas are carved out
+// of one reserved array with an atomic bump, and never move. A deleted arena
+// goes onto a lock-free stack, which new threads pop before carving out
+// another, so the array only grows with the number of threads alive at once.
+// On top of that, each thread caches the last arena it looked up in
+// thread-local storage, so the common case of a thread looking up its own arena
+// touches no shared memory at all.
+
+// Linux thread ids are below PID_MAX_LIMIT, which is 2^22 on 64 bit systems
+#define TID_BITS 22
+#define LEAF_BITS 12
+#define NUM_LEAVES (1 << (TID_BITS - LEAF_BITS))
+#define LEAF_SIZE (1 << LEAF_BITS)
+// Address space reserved for arenas. Pages are only backed once used. Tests
+// may set a lower limit to run out of arenas
+#ifndef MAX_ARENAS
+#define MAX_ARENAS (1 << 16)
+#endif
+#define UNLIKELY(x) __builtin_expect(x, 0)
+
+typedef struct arena_leaf {
+  _Atomic(arena_t *) arenas[LEAF_SIZE];
+} arena_leaf_t;
+
+static _Atomic(arena_leaf_t *) leaves[NUM_LEAVES];
+
+static arena_t *arena_storage = NULL;
+static atomic_size_t num_arenas = 0;
+static pthread_once_t storage_once = PTHREAD_ONCE_INIT;
+
+// Deleted arenas waiting to be adopted, linked through `next_orphan`. The low
+// bits of the head hold the index of the top arena in `arena_storage` plus
+// one, or 0 if there is none, and the high bits a counter that changes on
+// every update, which keeps a pop from succeeding on a head that was popped
+// and pushed back in the meantime
+static _Atomic uint64_t orphans = 0;
+#define ORPHAN_INDEX_MASK ((uint64_t)UINT32_MAX)
+#define ORPHAN_TAG_ONE (ORPHAN_INDEX_MASK + 1)
+
+// The thread id and arena of this thread's last lookup
+static __thread pid_t cached_thread_id = 0;
+static __thread arena_t *cached_arena = NULL;
+
+static void init_arena_storage() {
+  void *ptr = mmap(NULL, sizeof(arena_t) * MAX_ARENAS, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ptr != MAP_FAILED) arena_storage = ptr;
+}
+
+static uint64_t get_orphan_index(arena_t *arena) {
+  return arena == NULL ? 0 : arena - arena_storage + 1;
+}
+
+static void push_orphan(arena_t *arena) {
+  uint64_t head = atomic_load_explicit(&orphans, memory_order_relaxed);
+  uint64_t new_head;
+  do {
+    size_t top = head & ORPHAN_INDEX_MASK;
+    arena->next_orphan = top == 0 ? NULL : arena_storage + top - 1;
+    uint64_t tag = (head & ~ORPHAN_INDEX_MASK) + ORPHAN_TAG_ONE;
+    new_head = get_orphan_index(arena) | tag;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &orphans, &head, new_head, memory_order_release, memory_order_relaxed));
+}
+
+// Returns a deleted arena, or NULL if there is none
+static arena_t *pop_orphan() {
+  uint64_t head = atomic_load_explicit(&orphans, memory_order_acquire);
+  while ((head & ORPHAN_INDEX_MASK) != 0) {
+    // `arena` may be popped and pushed back meanwhile, making its
+    // `next_orphan` stale, but then the counter has changed and the exchange
+    // fails. Storage is never unmapped, so the read itself is safe
+    arena_t *arena = arena_storage + (head & ORPHAN_INDEX_MASK) - 1;
+    uint64_t new_head = get_orphan_index(arena->next_orphan) |
+                        ((head & ~ORPHAN_INDEX_MASK) + ORPHAN_TAG_ONE);
+    if (atomic_compare_exchange_weak_explicit(&orphans, &head, new_head,
+                                              memory_order_acquire,
+                                              memory_order_acquire)) {
+      return arena;
+    }
+  }
+  return NULL;
+}
+
+// Returns an arena for `thread_id`: a deleted one, adopted with everything it
+// holds, or else a new zeroed one. Returns NULL if none can be created
+static arena_t *create_arena(pid_t thread_id) {
+  pthread_once(&storage_once, init_arena_storage);
+  if (UNLIKELY(arena_storage == NULL)) return NULL;
+
+  arena_t *orphan = pop_orphan();
+  if (orphan != NULL) {
+    orphan->thread_id = thread_id;
+    return orphan;
+  }
+
+  size_t idx = atomic_fetch_add_explicit(&num_arenas, 1, memory_order_relaxed);
+  if (UNLIKELY(idx >= MAX_ARENAS)) return NULL;
+
+  // Fresh from mmap, so all bins are already empty
+  arena_t *arena = arena_storage + idx;
+  arena->thread_id = thread_id;
+  return arena;
+}
+
+// Returns the slot in the table for `thread_id`, creating its leaf if needed.
+// Returns NULL if `thread_id` is out of range or a leaf can't be mapped
+static _Atomic(arena_t *) *get_slot(pid_t thread_id) {
+  if (UNLIKELY(thread_id < 0 || thread_id >= (1 << TID_BITS))) return NULL;
+
+  _Atomic(arena_leaf_t *) *leaf_ptr = &leaves[thread_id >> LEAF_BITS];
+  arena_leaf_t *leaf = atomic_load_explicit(leaf_ptr, memory_order_acquire);
+  if (UNLIKELY(leaf == NULL)) {
+    arena_leaf_t *new_leaf =
+        mmap(NULL, sizeof(arena_leaf_t), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (new_leaf == MAP_FAILED) return NULL;
+
+    if (atomic_compare_exchange_strong_explicit(leaf_ptr, &leaf, new_leaf,
+                                                memory_order_acq_rel,
+                                                memory_order_acquire)) {
+      leaf = new_leaf;
+    } else {
+      // Another thread installed this leaf first. `leaf` now holds theirs
+      munmap(new_leaf, sizeof(arena_leaf_t));
+    }
+  }
+
+  return &leaf->arenas[thread_id & (LEAF_SIZE - 1)];
+}
+
+static arena_t *find_or_create_arena(pid_t thread_id) {
+  _Atomic(arena_t *) *slot = get_slot(thread_id);
+  if (UNLIKELY(slot == NULL)) return NULL;
+
+  arena_t *arena = atomic_load_explicit(slot, memory_order_acquire);
+  if (arena != NULL) return arena;
+
+  arena_t *new_arena = create_arena(thread_id);
+  if (UNLIKELY(new_arena == NULL)) return NULL;
+
+  // If another thread registered `thread_id` first, use theirs, and leave the
+  // arena we got for another thread to adopt
+  if (atomic_compare_exchange_strong_explicit(slot, &arena, new_arena,
+                                              memory_order_acq_rel,
+                                              memory_order_acquire)) {
+    arena = new_arena;
+  } else {
+    new_arena->thread_id = 0;
+    push_orphan(new_arena);
+  }
+  return arena;
+}
+
+arena_t *get_arena_pointer(pid_t thread_id) {
+  if (cached_arena != NULL && cached_thread_id == thread_id) {
+    return cached_arena;
+  }
+
+  arena_t *arena = find_or_create_arena(thread_id);
+  cached_thread_id = thread_id;
+  cached_arena = arena;
+  return arena;
+}
+
+arena_t get_arena(pid_t thread_id) {
+  arena_t *arena = get_arena_pointer(thread_id);
+  if (UNLIKELY(arena == NULL)) return (arena_t){0};
+  return *arena;
+}
+
+int set_arena(pid_t thread_id, arena_t *new_value) {
+  if (UNLIKELY(thread_id != new_value->thread_id)) return -1;
+
+  arena_t *dest = get_arena_pointer(thread_id);
+  if (UNLIKELY(dest == NULL)) return -1;
+
+  memcpy(dest, new_value, sizeof(arena_t));
+  return 0;
+}
+
+// Arenas are never freed, so their storage can be walked directly. Ones not yet
+// initialized are zero, and deleted ones are visited as well
+void for_each_arena(void (*callback)(arena_t *arena, void *arg), void *arg) {
+  if (arena_storage == NULL) return;
+
+  size_t count = atomic_load_explicit(&num_arenas, memory_order_relaxed);
+  if (count > MAX_ARENAS) count = MAX_ARENAS;
+  for (size_t i = 0; i < count; i++) {
+    callback(arena_storage + i, arg);
+  }
+}
+
+void delete_arena(pid_t thread_id) {
+  if (cached_thread_id == thread_id) cached_arena = NULL;
+  _Atomic(arena_t *) *slot = get_slot(thread_id);
+  if (slot == NULL) return;
+
+  arena_t *arena = atomic_exchange_explicit(slot, NULL, memory_order_acq_rel);
+  if (arena == NULL) return;
+  arena->thread_id = 0;
+  push_orphan(arena);
+}
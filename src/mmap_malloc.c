@@ -1,114 +1,513 @@
+#define _GNU_SOURCE  // mremap
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>  // secure_getenv
+#include <string.h>
+#include <sys/auxv.h>
 #include <sys/mman.h>
+#include <time.h>
 
-#define PAGESIZE 4096
-// When mmap-ing a new region for a certain size, ensure the mapped region can
-// fit at least this many times the size requested to reduce mmap calls
-#define REDUNDANCY_MULTIPLIER 32
+#include "arena_types.h"
+#include "free_tree.h"
+#include "heap_profile.h"
+#include "naive_malloc.h"
+#include "page_map.h"
+#include "slab.h"
 
-struct mmap_region;
+#ifdef THREAD_ARENAS
+#include <sys/syscall.h>
+#include <unistd.h>
 
-typedef struct malloc_chunk malloc_chunk_t;
-typedef struct mmap_region mmap_region_t;
+#include "arena_manager.h"
+#endif
 
-struct malloc_chunk {
-  // The size of memory the user can use from this chunk. Resides right after
-  // this struct in memory
-  size_t chunk_size;
+// Environment variable read for the region size tunables, see mallopt
+#define REGION_SIZE_ENV "NAIVE_MALLOC_REGION_SIZE"
+// Largest minimum or maximum region size that can be set
+#define MAX_REGION_SIZE ((size_t)1 << 30)
 
-  // Previous free chunk in the free list. NULL if no prev free chunk or if this
-  // chunk is not free
-  malloc_chunk_t *prev_free;
-  // Next free chunk in the free list. NULL if no next free chunk or if this
-  // chunk is not free
-  malloc_chunk_t *next_free;
+// Chunk data sizes are multiples of this, so every data pointer handed out is
+// aligned to it as well
+#define ALIGNMENT 16
+#define ALIGN_UP(x, a) (((x) + (a)-1) & ~((size_t)(a)-1))
 
-  // The region this chunk resides in
-  mmap_region_t *region;
-};
+// Size classes below this one are ALIGNMENT bytes apart
+#define LINEAR_SIZE_CLASSES 4
+#define MAX_CLASS_SIZE ((size_t)1 << 21)
 
-struct mmap_region {
-  // Size of mapped region, including this header
-  size_t size;
+// Chunk sizes are multiples of ALIGNMENT, so the low bits of `chunk_size` are
+// free to hold flags. Set iff this chunk is free and sits in a bin
+#define CHUNK_FREE 1
+// Set iff the chunk physically before this one is free. A free chunk stores its
+// size in the `prev_size` of the chunk after it (a boundary tag), so its
+// address can be recovered from that chunk
+#define PREV_CHUNK_FREE 2
+// Set iff the chunk has a mapping of its own instead of living in a region
+#define CHUNK_MMAPPED 4
+// Set iff the heap profiler is tracking the chunk, see sample_malloc
+#define CHUNK_SAMPLED 8
+#define CHUNK_FLAGS ((size_t)ALIGNMENT - 1)
+
+// Chunks start after the region metadata, padded to keep data aligned
+#define REGION_HEADER_SIZE ALIGN_UP(sizeof(mmap_region_t), ALIGNMENT)
+// A free chunk is only split if the remainder can hold a header and the links
+// of a free chunk
+#define MIN_SPLIT_SIZE (sizeof(malloc_chunk_t) + sizeof(free_links_t))
+// Free chunks of at least this size are binned in trees rather than lists, so
+// the best fit within a class can be found without walking it
+#define LARGE_CHUNK_SIZE 4096
+
+// Bytes a thread allocates between checks of whether profiling was turned on
+#define PROFILE_RECHECK_BYTES (1 << 20)
+
+// Requests up to this size can be served from the per-thread cache
+#define MAX_TCACHE_SIZE 4096
+// The number of size classes up to MAX_TCACHE_SIZE
+#define MAX_TCACHE_CLASSES 28
+
+#define UNLIKELY(x) __builtin_expect(x, 0)
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// Bytes in a page of the OS, 0 until first needed. Regions and mapped chunks
+// are made of whole pages
+static size_t page_size = 0;
+
+static size_t get_page_size() {
+  if (UNLIKELY(page_size == 0)) page_size = getauxval(AT_PAGESZ);
+  return page_size;
+}
+
+#ifdef THREAD_ARENAS
+// Thread id of the calling thread, cached to save a syscall per call
+static __thread pid_t thread_id = 0;
+static pthread_once_t fork_handler_once = PTHREAD_ONCE_INIT;
+// Statistics of the calling thread's arena, cached as looking the arena up
+// costs more than updating them
+static __thread arena_stats_t *thread_stats = NULL;
+
+// The only thread of a forked child has an id of its own, but inherits the
+// cached id of the thread that forked. Forget it, so the child gets its own
+// arena instead of sharing one with whatever thread is given that id next
+static void forget_thread_id() {
+  thread_id = 0;
+  thread_stats = NULL;
+}
+
+static void register_fork_handler() {
+  pthread_atfork(NULL, NULL, forget_thread_id);
+}
+
+static void register_thread_exit();
+
+static pid_t get_thread_id() {
+  if (UNLIKELY(thread_id == 0)) {
+    // Set first, as pthread_atfork may itself allocate
+    thread_id = syscall(__NR_gettid);
+    pthread_once(&fork_handler_once, register_fork_handler);
+    register_thread_exit();
+  }
+  return thread_id;
+}
+
+// Statistics of threads the arena manager had no arena for. Such threads fail
+// every allocation that needs an arena, but still free what other threads
+// allocated. Two of them may update these at once, losing a count
+static arena_stats_t arenaless_stats;
+
+// Returns the calling thread's arena, or NULL if the arena manager has none to
+// give it
+static arena_t *current_arena() { return get_arena_pointer(get_thread_id()); }
+
+// Returns the statistics the calling thread updates, those of its arena
+static arena_stats_t *get_thread_stats() {
+  if (UNLIKELY(thread_stats == NULL)) {
+    arena_t *arena = current_arena();
+    // Not kept, so the thread counts in its own arena once it gets one
+    if (arena == NULL) return &arenaless_stats;
+    thread_stats = &arena->stats;
+  }
+  return thread_stats;
+}
+
+// Most arenas shared between threads, see M_ARENAS_PER_CPU
+#define MAX_SHARED_ARENAS 256
+// Times a thread finds its shared arena held by another before it looks for a
+// less used one
+#define MIGRATE_CONTENTIONS 64
+
+// Arenas shared between threads, made on demand up to `shared_arena_limit`,
+// which is 0 while every thread allocates from its own arena. Each is held
+// through its `lock` while a thread works on it. Threads join and leave them,
+// and arenas are made, under `shared_arenas_mutex`, which is never taken with
+// an arena's lock held. Threads still count their statistics in their own
+// arenas, so the counters of either kind of arena keep a single writer at a
+// time
+static arena_t *shared_arenas[MAX_SHARED_ARENAS];
+static _Atomic size_t num_shared_arenas = 0;
+static _Atomic size_t shared_arena_limit = 0;
+static pthread_mutex_t shared_arenas_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t shared_arenas_fork_handler_once = PTHREAD_ONCE_INIT;
+static _Atomic size_t arena_contentions = 0;
+static _Atomic size_t arena_migrations = 0;
+// The shared arena the calling thread allocates from, or NULL if it uses its
+// own, and the times it found it held since it last looked for another
+static __thread arena_t *shared_arena = NULL;
+static __thread size_t shared_arena_contentions = 0;
+
+static void lock_shared_arena(arena_t *arena) {
+  while (atomic_flag_test_and_set_explicit(&arena->lock,
+                                           memory_order_acquire)) {
+    sched_yield();
+  }
+}
+
+static void unlock_shared_arena(arena_t *arena) {
+  atomic_flag_clear_explicit(&arena->lock, memory_order_release);
+}
+
+// Map a new shared arena. Returns NULL if there is no memory for it. Requires
+// `shared_arenas_mutex` to be held
+static arena_t *create_shared_arena() {
+  size_t index = atomic_load_explicit(&num_shared_arenas, memory_order_relaxed);
+  arena_t *arena = mmap(NULL, sizeof(arena_t), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (arena == MAP_FAILED) return NULL;
+  shared_arenas[index] = arena;
+  // Published last, for visit_arenas
+  atomic_store_explicit(&num_shared_arenas, index + 1, memory_order_release);
+  return arena;
+}
+
+// Move the calling thread to the shared arena fewest threads use other than
+// `from`, its current one, or NULL if it has none yet. While under the limit, a
+// new arena is made rather than sharing one. The thread only moves if it then
+// shares with fewer threads than before. Returns the calling thread's shared
+// arena, or NULL if it still has none
+static arena_t *attach_shared_arena(arena_t *from) {
+  pthread_mutex_lock(&shared_arenas_mutex);
+  size_t count = atomic_load_explicit(&num_shared_arenas, memory_order_relaxed);
+  arena_t *best = NULL;
+  for (size_t i = 0; i < count; i++) {
+    arena_t *arena = shared_arenas[i];
+    if (arena != from &&
+        (best == NULL || arena->num_threads < best->num_threads)) {
+      best = arena;
+    }
+  }
+  size_t limit =
+      atomic_load_explicit(&shared_arena_limit, memory_order_relaxed);
+  if ((best == NULL || best->num_threads != 0) && count < limit) {
+    arena_t *created = create_shared_arena();
+    if (created != NULL) best = created;
+  }
+
+  if (best != NULL &&
+      (from == NULL || best->num_threads + 1 < from->num_threads)) {
+    if (from != NULL) {
+      from->num_threads--;
+      atomic_fetch_add_explicit(&arena_migrations, 1, memory_order_relaxed);
+    }
+    best->num_threads++;
+    shared_arena = best;
+  }
+  pthread_mutex_unlock(&shared_arenas_mutex);
+  return shared_arena;
+}
+
+// Stop the calling thread using its shared arena, if it has one
+static void detach_shared_arena() {
+  if (shared_arena == NULL) return;
+  pthread_mutex_lock(&shared_arenas_mutex);
+  shared_arena->num_threads--;
+  pthread_mutex_unlock(&shared_arenas_mutex);
+  shared_arena = NULL;
+  shared_arena_contentions = 0;
+}
+
+// Lock the calling thread's shared `arena`, which another thread holds. Every
+// MIGRATE_CONTENTIONS times this happens, the thread first tries moving to a
+// less used arena. Returns the arena locked
+static __attribute__((noinline)) arena_t *lock_contended_arena(
+    arena_t *arena) {
+  atomic_fetch_add_explicit(&arena_contentions, 1, memory_order_relaxed);
+  if (++shared_arena_contentions >= MIGRATE_CONTENTIONS) {
+    shared_arena_contentions = 0;
+    arena = attach_shared_arena(arena);
+  }
+  lock_shared_arena(arena);
+  return arena;
+}
+
+// Returns the arena the calling thread allocates from: its own, or its shared
+// arena, locked, once arenas are shared. The thread joins one on its first
+// call after that. Returns NULL if the thread has neither. Give it back with
+// unlock_arena before calling this again
+static arena_t *lock_arena() {
+  arena_t *arena = shared_arena;
+  if (arena == NULL) {
+    if (atomic_load_explicit(&shared_arena_limit, memory_order_relaxed) == 0) {
+      return current_arena();
+    }
+    arena = attach_shared_arena(NULL);
+    if (arena == NULL) return current_arena();
+  }
+  if (UNLIKELY(atomic_flag_test_and_set_explicit(&arena->lock,
+                                                 memory_order_acquire))) {
+    arena = lock_contended_arena(arena);
+  }
+  return arena;
+}
+
+static void unlock_arena(arena_t *arena) {
+  if (arena != NULL && arena == shared_arena) unlock_shared_arena(arena);
+}
+
+// Keep a fork from copying a shared arena while another thread works on it
+static void lock_shared_arenas() {
+  pthread_mutex_lock(&shared_arenas_mutex);
+  size_t count = atomic_load_explicit(&num_shared_arenas, memory_order_relaxed);
+  for (size_t i = 0; i < count; i++) lock_shared_arena(shared_arenas[i]);
+}
+
+static void unlock_shared_arenas() {
+  size_t count = atomic_load_explicit(&num_shared_arenas, memory_order_relaxed);
+  for (size_t i = 0; i < count; i++) unlock_shared_arena(shared_arenas[i]);
+  pthread_mutex_unlock(&shared_arenas_mutex);
+}
+
+static void register_shared_arenas_fork_handler() {
+  pthread_atfork(lock_shared_arenas, unlock_shared_arenas,
+                 unlock_shared_arenas);
+}
+
+// Have threads share at most `per_cpu` arenas per CPU the process may run on,
+// or give new threads arenas of their own again if 0. Threads already in a
+// shared arena stay there either way, and lowering the limit keeps the arenas
+// made so far
+static int set_arenas_per_cpu(size_t per_cpu) {
+  cpu_set_t cpus;
+  size_t num_cpus =
+      sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus) : 1;
+  pthread_once(&shared_arenas_fork_handler_once,
+               register_shared_arenas_fork_handler);
+  pthread_mutex_lock(&shared_arenas_mutex);
+  atomic_store_explicit(&shared_arena_limit,
+                        MIN(per_cpu * num_cpus, MAX_SHARED_ARENAS),
+                        memory_order_relaxed);
+  pthread_mutex_unlock(&shared_arenas_mutex);
+  return 1;
+}
+#else
+// The only arena, used by every call
+static arena_t main_arena;
+
+static arena_stats_t *get_thread_stats() { return &main_arena.stats; }
+
+static arena_t *lock_arena() { return &main_arena; }
+
+static void unlock_arena(arena_t *arena) {}
+#endif
+
+// Per-thread cache of recently freed small objects, from slabs or chunks.
+// Objects in the cache still count as occupied in their slabs or regions, so
+// moving them in and out of it needs no atomics and no metadata updates
+typedef struct tcache {
+  // Stacks of cached objects linked through their first word, one per size
+  // class
+  void *heads[MAX_TCACHE_CLASSES];
+  // Number of chunks in each stack
+  size_t counts[MAX_TCACHE_CLASSES];
+
+  // Cacheable requests served from the cache, and those that weren't
+  size_t hits;
+  size_t misses;
 
-  // Head of chunks linked list for this region
-  malloc_chunk_t *chunks_head;
-  // Tail of chunks linked list for this region
-  malloc_chunk_t *chunks_tail;
+  // Set once the thread is exiting and the cache has been flushed
+  bool disabled;
+} tcache_t;
 
-  // Free chunks in the global free list belonging to the same region are
-  // contiguous in the free list. This is the start of this region's section in
-  // the free list
-  malloc_chunk_t *local_free_head;
-  // The end of this region's section in the free list
-  malloc_chunk_t *local_free_tail;
+static __thread tcache_t tcache;
 
-  // Pointer to prev region if any
-  mmap_region_t *prev_region;
+// Tunables of the per-thread cache, see mallopt. Most objects cached per class
+static size_t tcache_count = 32;
+// Size classes below this are cached. Default covers requests up to 1024 bytes
+static size_t tcache_classes = 20;
+// Objects of this size or more don't fall in any cached class
+static size_t tcache_size_limit = 1280;
+// Objects moved between the cache and the arena at once
+static size_t tcache_batch = 16;
 
-  // Pointer to next region if any
-  mmap_region_t *next_region;
+// Requests of at least this many bytes get a mapping of their own, see mallopt
+static size_t mmap_threshold = 128 * 1024;
 
-  // Number of occupied malloc chunks in this region
-  size_t occupied_chunks;
-};
+// Mean bytes allocated between heap profile samples, or 0 if profiling is off,
+// see mallopt
+static size_t profile_sample_bytes = 0;
+// Bytes the calling thread has left to allocate until its next sample. Every
+// allocation counts down, and only the one taking it below zero goes to
+// sample_malloc, so unsampled allocations pay a subtraction and a branch
+static __thread int64_t bytes_until_sample = 0;
+// Set once the calling thread has drawn its first countdown
+static __thread bool sampler_started = false;
 
-// Head of global regions linked list
-static mmap_region_t *regions_start = NULL;
-// Tail of global regions linked list
-static mmap_region_t *regions_end = NULL;
+// Tunables of the empty region cache, see mallopt. Most empty regions kept per
+// arena
+static size_t region_cache_count = 8;
+// Milliseconds a cached region keeps its pages. It is unmapped after twice that
+static size_t region_decay_ms = 1000;
 
-static malloc_chunk_t *free_head = NULL;
-static malloc_chunk_t *free_tail = NULL;
+// Tunables of region sizing, see mallopt. Powers of two. New regions grow
+// from the minimum to the maximum size, and go back down once every decay
+// interval an arena maps none
+static size_t region_min_size = 64 * 1024;
+static size_t region_max_size = 32 << 20;
+static size_t region_size_decay_ms = 1000;
+#ifdef THREAD_ARENAS
+static pthread_once_t region_size_env_once = PTHREAD_ONCE_INIT;
+#else
+static bool region_size_env_read = false;
+#endif
+
+// How new regions are backed, one of the HUGE_PAGES_* values, see mallopt
+static int huge_pages = HUGE_PAGES_OFF;
+
+// Set iff the background reclaim thread returns freed memory to the OS, see
+// mallopt. Read without the lock on every free that could give memory back
+static atomic_bool background_reclaim = false;
+// The rest of the reclaim thread's state is guarded by `reclaim_mutex`, which
+// the thread holds during a pass. Milliseconds between passes, and set iff the
+// thread should keep running
+static pthread_mutex_t reclaim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+static size_t reclaim_interval_ms = 0;
+static bool reclaim_running = false;
+static pthread_t reclaim_thread;
+static pthread_once_t reclaim_fork_handler_once = PTHREAD_ONCE_INIT;
+// Counters of what the reclaim thread did, summed with the arenas' counters
+static arena_stats_t reclaim_stats;
+
+// Returns the number of bytes a chunk of size class `size_class` holds
+static size_t class_to_size(size_t size_class) {
+  if (size_class < LINEAR_SIZE_CLASSES) return (size_class + 1) * ALIGNMENT;
+
+  size_t group = size_class / 4;
+  size_t base = (size_t)LINEAR_SIZE_CLASSES * ALIGNMENT << (group - 1);
+  return base + (base >> 2) * (size_class % 4 + 1);
+}
+
+// Returns the smallest size class whose chunks can hold `size` bytes, or
+// NUM_SIZE_CLASSES if `size` is larger than every class. Requires `size` > 0
+static size_t size_to_class_ceil(size_t size) {
+  if (size > MAX_CLASS_SIZE) return NUM_SIZE_CLASSES;
+  if (size <= LINEAR_SIZE_CLASSES * ALIGNMENT) {
+    return (size + ALIGNMENT - 1) / ALIGNMENT - 1;
+  }
+
+  size_t x = size - 1;
+  size_t log2 = 63 - __builtin_clzl(x);
+  size_t quarter = (x - ((size_t)1 << log2)) >> (log2 - 2);
+  return 4 * (log2 - 5) + quarter;
+}
+
+// Returns the largest size class no larger than a chunk of `size` bytes, which
+// is the bin such a chunk is kept in while free. Requires `size` >= ALIGNMENT
+static size_t size_to_class_floor(size_t size) {
+  if (size >= MAX_CLASS_SIZE) return NUM_SIZE_CLASSES - 1;
+  if (size < (LINEAR_SIZE_CLASSES + 1) * ALIGNMENT) {
+    return size / ALIGNMENT - 1;
+  }
+
+  size_t log2 = 63 - __builtin_clzl(size);
+  size_t quarter = (size - ((size_t)1 << log2)) >> (log2 - 2);
+  return 4 * (log2 - 5) + quarter - 1;
+}
+
+// Returns the size of `chunk`'s data without the flag bits
+static size_t get_chunk_size(malloc_chunk_t *chunk) {
+  return chunk->chunk_size & ~CHUNK_FLAGS;
+}
+
+// Free chunks in a list bin hold their links at the start of their data
+static free_links_t *get_free_links(malloc_chunk_t *chunk) {
+  return (free_links_t *)(chunk + 1);
+}
+
+// Free chunks in a free tree hold their node at the start of their data
+static free_tree_node_t *get_tree_node(malloc_chunk_t *chunk) {
+  return (free_tree_node_t *)(chunk + 1);
+}
+
+static malloc_chunk_t *get_tree_chunk(free_tree_node_t *node) {
+  return (malloc_chunk_t *)node - 1;
+}
+
+// Removes `chunk` from its bin in `arena`
+void delete_free_list_chunk(arena_t *arena, malloc_chunk_t *chunk) {
+  stat_add(&arena->stats.free_chunks, -1);
+  size_t size = get_chunk_size(chunk);
+  size_t bin_idx = size_to_class_floor(size);
+  if (size >= LARGE_CHUNK_SIZE) {
+    free_tree_remove(&arena->tree_bins[bin_idx], get_tree_node(chunk));
+    if (arena->tree_bins[bin_idx] == NULL) {
+      arena->nonempty_bins &= ~((uint64_t)1 << bin_idx);
+    }
+    return;
+  }
 
-// Handles region local head/tail updates as well
-void delete_free_list_chunk(malloc_chunk_t *chunk) {
   // Disconnect previous if any
-  malloc_chunk_t *prev = chunk->prev_free;
+  free_links_t *links = get_free_links(chunk);
+  malloc_chunk_t *prev = links->prev_free;
   if (prev == NULL) {
-    // Removing head of free list. Change head pointer
-    free_head = chunk->next_free;
+    // Removing head of bin. Change head pointer
+    arena->bins[bin_idx] = links->next_free;
+    if (links->next_free == NULL) {
+      arena->nonempty_bins &= ~((uint64_t)1 << bin_idx);
+    }
   } else {
-    prev->next_free = chunk->next_free;
+    get_free_links(prev)->next_free = links->next_free;
   }
 
   // Disconnect from next if any
-  malloc_chunk_t *next = chunk->next_free;
-  if (next == NULL) {
-    // Removing tail of free list. Change tail pointer
-    free_tail = chunk->prev_free;
-  } else {
-    next->prev_free = chunk->prev_free;
-  }
+  malloc_chunk_t *next = links->next_free;
+  if (next != NULL) get_free_links(next)->prev_free = links->prev_free;
+}
 
-  // Update region local free head/tail if needed
-  mmap_region_t *this_region = chunk->region;
-  if (this_region->local_free_head == chunk &&
-      this_region->local_free_tail == chunk) {
-    // This region only has 1 chunk in the free list. Local list is now empty
-    this_region->local_free_head = NULL;
-    this_region->local_free_tail = NULL;
-  } else if (this_region->local_free_head == chunk) {
-    // There's at least 2 elements in the local free list, we can just move head
-    this_region->local_free_head = chunk->next_free;
-  } else if (this_region->local_free_tail == chunk) {
-    // There's at least 2 elements in the local free list, we can just move tail
-    this_region->local_free_tail = chunk->prev_free;
+// Insert `chunk` into the bin for its size in `arena`. Chunks of a page or more
+// go in the bin's tree. Smaller ones go at the head of its list, so the most
+// recently freed chunks, which are likely still cached, get reused first
+static void insert_free_list_chunk(arena_t *arena, malloc_chunk_t *chunk) {
+  stat_add(&arena->stats.free_chunks, 1);
+  size_t size = get_chunk_size(chunk);
+  size_t bin_idx = size_to_class_floor(size);
+  arena->nonempty_bins |= (uint64_t)1 << bin_idx;
+  if (size >= LARGE_CHUNK_SIZE) {
+    free_tree_insert(&arena->tree_bins[bin_idx], get_tree_node(chunk), size);
+    return;
   }
 
-  // Mark this chunk's next and prev free as NULL
-  chunk->prev_free = NULL;
-  chunk->next_free = NULL;
+  malloc_chunk_t *head = arena->bins[bin_idx];
+
+  free_links_t *links = get_free_links(chunk);
+  links->prev_free = NULL;
+  links->next_free = head;
+  if (head != NULL) get_free_links(head)->prev_free = chunk;
+  arena->bins[bin_idx] = chunk;
 }
 
-// Remove `region` from the region linked list and munmap it
-void delete_region(mmap_region_t *region) {
+// Remove `region` from the region linked list of `arena`
+static void unlink_region(arena_t *arena, mmap_region_t *region) {
   // Disconnect previous if any
   mmap_region_t *prev = region->prev_region;
   if (prev == NULL) {
     // Removing head of free list. Change head pointer
-    regions_start = region->next_region;
+    arena->regions_start = region->next_region;
   } else {
     prev->next_region = region->next_region;
   }
@@ -117,7 +516,7 @@ void delete_region(mmap_region_t *region) {
   mmap_region_t *next = region->next_region;
   if (next == NULL) {
     // Removing tail of free list. Change tail pointer
-    regions_end = region->prev_region;
+    arena->regions_end = region->prev_region;
   } else {
     next->prev_region = region->prev_region;
   }
@@ -125,11 +524,170 @@ void delete_region(mmap_region_t *region) {
   // Mark this chunk's next and prev free as NULL
   region->prev_region = NULL;
   region->next_region = NULL;
+}
+
+// Returns a coarse monotonic time in milliseconds. Cheap enough to call
+// whenever the region cache is touched
+static uint64_t get_time_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Spin until the region cache lock of `arena` is ours. It is only ever held
+// for a few list operations, or on the owner's side for the system calls of
+// decay when there is no reclaim thread
+static void lock_region_cache(arena_t *arena) {
+  while (atomic_flag_test_and_set_explicit(&arena->region_cache_lock,
+                                           memory_order_acquire)) {
+    sched_yield();
+  }
+}
+
+static void unlock_region_cache(arena_t *arena) {
+  atomic_flag_clear_explicit(&arena->region_cache_lock, memory_order_release);
+}
+
+// Remove `region` from `arena`'s region cache, counting the bytes in `stats`
+static void uncache_region(arena_t *arena, mmap_region_t *region,
+                           arena_stats_t *stats) {
+  if (region->prev_region == NULL) {
+    arena->cached_regions = region->next_region;
+  } else {
+    region->prev_region->next_region = region->next_region;
+  }
+  if (region->next_region != NULL) {
+    region->next_region->prev_region = region->prev_region;
+  }
+
+  region->prev_region = NULL;
+  region->next_region = NULL;
+  arena->num_cached_regions--;
+  stat_add(&stats->cached_region_bytes, -region->size);
+}
+
+// Returns the size of the pages backing `region`, which the OS only takes back
+// whole
+static size_t get_region_page_size(mmap_region_t *region) {
+  return region->huge_pages == HUGE_PAGES_EXPLICIT ? HUGE_PAGE_SIZE
+                                                   : get_page_size();
+}
+
+// Returns the bytes of the cached `region` that are still backed by the OS
+static size_t get_cached_resident_size(mmap_region_t *region) {
+  return region->purged ? get_region_page_size(region) : region->size;
+}
 
-  // Return to OS
+// Remove `region` from `arena`'s region cache and unmap it
+static void evict_cached_region(arena_t *arena, mmap_region_t *region) {
+  uncache_region(arena, region, &arena->stats);
+  arena->region_cache_purged_bytes += get_cached_resident_size(region);
+  stat_add(&arena->stats.munmap_calls, 1);
   munmap(region, region->size);
 }
 
+// Give the pages of the cached `region` back to the OS, but keep the mapping.
+// The first page holds the header and cache links, so it stays, which splits
+// the first huge page of a region with transparent huge pages. Returns the
+// bytes given back
+static size_t purge_cached_region(mmap_region_t *region) {
+  region->purged = true;
+  size_t first_page = get_region_page_size(region);
+  if (region->size == first_page) return 0;
+
+  madvise((char *)region + first_page, region->size - first_page,
+          MADV_DONTNEED);
+  // The pages are zero when next touched
+  region->dirty_size = first_page;
+  return region->size - first_page;
+}
+
+// Purge the cached regions of `arena` that have been empty for
+// `region_decay_ms`, and unmap those that have been empty for twice as long.
+// Requires the region cache lock
+static void decay_region_cache(arena_t *arena) {
+  uint64_t now = get_time_ms();
+  mmap_region_t *region = arena->cached_regions;
+  while (region != NULL) {
+    mmap_region_t *next = region->next_region;
+    uint64_t age = now - region->cached_at;
+    if (age >= 2 * region_decay_ms) {
+      evict_cached_region(arena, region);
+    } else if (age >= region_decay_ms && !region->purged) {
+      arena->region_cache_purged_bytes += purge_cached_region(region);
+    }
+    region = next;
+  }
+}
+
+// Take the empty `region`, which is in no region list, out of use, counting it
+// in the statistics of `arena`. It is kept in the arena's region cache,
+// evicting the oldest cached region if the cache is full, so a workload that
+// keeps emptying and refilling a region doesn't mmap and munmap it every time.
+// With background reclaim, the region is always cached and the reclaim thread
+// evicts and decays the cache instead. A NULL `arena`, for a thread without
+// one, has no cache, so the region is unmapped right away
+static void retire_region(arena_t *arena, mmap_region_t *region) {
+  arena_stats_t *stats = arena == NULL ? get_thread_stats() : &arena->stats;
+  stat_add(&stats->regions, -1);
+  stat_add(&stats->region_bytes, -region->size);
+  if (region->huge_pages != HUGE_PAGES_OFF) {
+    stat_add(&stats->huge_region_bytes, -region->size);
+  }
+  bool deferred =
+      atomic_load_explicit(&background_reclaim, memory_order_relaxed);
+  if (arena == NULL || (region_cache_count == 0 && !deferred)) {
+    stat_add(&stats->munmap_calls, 1);
+    munmap(region, region->size);
+    return;
+  }
+
+  region->cached_at = get_time_ms();
+  region->purged = false;
+  region->dirty_size = region->size;
+
+  lock_region_cache(arena);
+  if (!deferred && arena->num_cached_regions >= region_cache_count) {
+    mmap_region_t *oldest = arena->cached_regions;
+    while (oldest->next_region != NULL) oldest = oldest->next_region;
+    evict_cached_region(arena, oldest);
+  }
+
+  region->next_region = arena->cached_regions;
+  if (region->next_region != NULL) region->next_region->prev_region = region;
+  arena->cached_regions = region;
+  arena->num_cached_regions++;
+  stat_add(&arena->stats.cached_region_bytes, region->size);
+
+  if (!deferred) decay_region_cache(arena);
+  unlock_region_cache(arena);
+}
+
+// Take the empty `region` out of `arena`'s region list and out of use
+static void delete_region(arena_t *arena, mmap_region_t *region) {
+  unlink_region(arena, region);
+  retire_region(arena, region);
+}
+
+// Returns a region of at least `region_size` bytes from `arena`'s region
+// cache, removed from the cache, or NULL if there is none
+static mmap_region_t *get_cached_region(arena_t *arena, size_t region_size) {
+  lock_region_cache(arena);
+  if (!atomic_load_explicit(&background_reclaim, memory_order_relaxed)) {
+    decay_region_cache(arena);
+  }
+
+  // Most recently emptied first, as its pages are the most likely to still be
+  // resident
+  mmap_region_t *region = arena->cached_regions;
+  while (region != NULL && region->size < region_size) {
+    region = region->next_region;
+  }
+  if (region != NULL) uncache_region(arena, region, &arena->stats);
+  unlock_region_cache(arena);
+  return region;
+}
+
 // Returns a pointer to the malloc chunk which owns `ptr`, or NULL if `ptr` is
 // NULL.
 malloc_chunk_t *get_chunk_from_data_pointer(void *ptr) {
@@ -145,7 +703,90 @@ static void *get_chunk_data_address(malloc_chunk_t *chunk) {
 // Returns the address just above the end of the data region belonging to
 // `chunk`.
 static void *get_address_after_malloc_chunk(malloc_chunk_t *chunk) {
-  return (char *)chunk + chunk->chunk_size + sizeof(malloc_chunk_t);
+  return (char *)chunk + get_chunk_size(chunk) + sizeof(malloc_chunk_t);
+}
+
+// Returns the region holding `chunk`, which is not CHUNK_MMAPPED
+static mmap_region_t *get_chunk_region(malloc_chunk_t *chunk) {
+  return page_map_get(chunk);
+}
+
+// Returns the chunk physically after `chunk` in `region`, or NULL if `chunk` is
+// the region's chunks tail
+static malloc_chunk_t *get_next_chunk(mmap_region_t *region,
+                                      malloc_chunk_t *chunk) {
+  if (chunk == region->chunks_tail) return NULL;
+  return get_address_after_malloc_chunk(chunk);
+}
+
+// Returns the free chunk physically before `chunk`, using the boundary tag in
+// its header. Requires `chunk` to have PREV_CHUNK_FREE set
+static malloc_chunk_t *get_prev_free_chunk(malloc_chunk_t *chunk) {
+  return (malloc_chunk_t *)((char *)chunk - chunk->prev_size -
+                            sizeof(malloc_chunk_t));
+}
+
+// Flag `chunk` of `region` as free and tell the next chunk about it, writing
+// the boundary tag into its header
+static void mark_chunk_free(mmap_region_t *region, malloc_chunk_t *chunk) {
+  chunk->chunk_size |= CHUNK_FREE;
+
+  malloc_chunk_t *next = get_next_chunk(region, chunk);
+  if (next != NULL) {
+    next->prev_size = get_chunk_size(chunk);
+    next->chunk_size |= PREV_CHUNK_FREE;
+  }
+}
+
+// Flag `chunk` of `region` as occupied and tell the next chunk about it
+static void mark_chunk_occupied(mmap_region_t *region, malloc_chunk_t *chunk) {
+  chunk->chunk_size &= ~(size_t)CHUNK_FREE;
+
+  malloc_chunk_t *next = get_next_chunk(region, chunk);
+  if (next != NULL) next->chunk_size &= ~(size_t)PREV_CHUNK_FREE;
+}
+
+// Shrink the occupied `chunk` of `region` to `size` bytes if the leftover is
+// large enough to be a chunk of its own, and put the leftover in a bin of
+// `arena`. Requires `size` <= the size of `chunk`
+static void split_chunk(arena_t *arena, mmap_region_t *region,
+                        malloc_chunk_t *chunk, size_t size) {
+  size_t old_size = get_chunk_size(chunk);
+  if (old_size - size < MIN_SPLIT_SIZE) return;
+
+  chunk->chunk_size = size | (chunk->chunk_size & CHUNK_FLAGS);
+
+  malloc_chunk_t *remainder = get_address_after_malloc_chunk(chunk);
+  // The chunk before the remainder is `chunk`, which is occupied
+  remainder->chunk_size = old_size - size - sizeof(malloc_chunk_t);
+  if (region->chunks_tail == chunk) region->chunks_tail = remainder;
+
+  mark_chunk_free(region, remainder);
+  insert_free_list_chunk(arena, remainder);
+}
+
+// Merge `chunk` of `region` with its physical neighbours that are free,
+// removing them from their bins. Returns the chunk at the start of the merged
+// space. Adjacent chunks are never both free, so this is all the coalescing
+// ever needed
+static malloc_chunk_t *coalesce_chunk(arena_t *arena, mmap_region_t *region,
+                                      malloc_chunk_t *chunk) {
+  malloc_chunk_t *next = get_next_chunk(region, chunk);
+  if (next != NULL && (next->chunk_size & CHUNK_FREE)) {
+    delete_free_list_chunk(arena, next);
+    chunk->chunk_size += get_chunk_size(next) + sizeof(malloc_chunk_t);
+    if (region->chunks_tail == next) region->chunks_tail = chunk;
+  }
+
+  if (chunk->chunk_size & PREV_CHUNK_FREE) {
+    malloc_chunk_t *prev = get_prev_free_chunk(chunk);
+    delete_free_list_chunk(arena, prev);
+    prev->chunk_size += get_chunk_size(chunk) + sizeof(malloc_chunk_t);
+    if (region->chunks_tail == chunk) region->chunks_tail = prev;
+    chunk = prev;
+  }
+
+  return chunk;
 }
 
 // Return the number of remaining bytes for new malloc chunks in this region.
@@ -153,7 +794,7 @@ static void *get_address_after_malloc_chunk(malloc_chunk_t *chunk) {
 static size_t mmap_region_space_remaining(mmap_region_t *region) {
   if (region == NULL) return 0;
 
-  size_t region_max_capacity = region->size - sizeof(mmap_region_t);
+  size_t region_max_capacity = region->size - REGION_HEADER_SIZE;
 
   if (region->chunks_tail == NULL) {
     // No chunks allocated, region is empty except for mmap_region_t metadata
@@ -163,98 +804,360 @@ static size_t mmap_region_space_remaining(mmap_region_t *region) {
   return region->size -
          ((size_t)region->chunks_tail - (size_t)region) -  // Offset of tail
          sizeof(malloc_chunk_t) -                          // Metadata of tail
-         region->chunks_tail->chunk_size;                  // Data of tail
+         get_chunk_size(region->chunks_tail);              // Data of tail
+}
+
+// Map `region_size` bytes for a region of `arena`, a multiple of
+// HUGE_PAGE_SIZE if huge pages are on, backed as `huge_pages` asks. Falls back
+// from explicit to transparent huge pages if no explicit ones are free, and to
+// normal pages if the kernel has no transparent ones. Sets `*backing` to what
+// the mapping got. Returns NULL on failure
+static mmap_region_t *map_region(arena_t *arena, size_t region_size,
+                                 uint8_t *backing) {
+  stat_add(&arena->stats.mmap_calls, 1);
+  *backing = HUGE_PAGES_OFF;
+  if (huge_pages == HUGE_PAGES_OFF) {
+    char *ptr = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return ptr == MAP_FAILED ? NULL : (mmap_region_t *)ptr;
+  }
+
+#ifdef MAP_HUGETLB
+  if (huge_pages == HUGE_PAGES_EXPLICIT) {
+    // Fails up front, rather than on a fault, if too few pages are reserved
+    char *ptr = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+      *backing = HUGE_PAGES_EXPLICIT;
+      return (mmap_region_t *)ptr;
+    }
+    stat_add(&arena->stats.mmap_calls, 1);
+  }
+#endif
+
+  // Only a huge page aligned range can be backed by a huge page, so map a
+  // huge page more than needed and unmap what is around the aligned part
+  char *mapping = mmap(NULL, region_size + HUGE_PAGE_SIZE,
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1, 0);
+  if (mapping == MAP_FAILED) return NULL;
+  char *ptr = (char *)ALIGN_UP((uintptr_t)mapping, HUGE_PAGE_SIZE);
+  if (ptr != mapping) {
+    stat_add(&arena->stats.munmap_calls, 1);
+    munmap(mapping, ptr - mapping);
+  }
+  if (ptr != mapping + HUGE_PAGE_SIZE) {
+    stat_add(&arena->stats.munmap_calls, 1);
+    munmap(ptr + region_size, mapping + HUGE_PAGE_SIZE - ptr);
+  }
+
+#ifdef MADV_HUGEPAGE
+  if (madvise(ptr, region_size, MADV_HUGEPAGE) == 0) {
+    *backing = HUGE_PAGES_TRANSPARENT;
+  }
+#endif
+  return (mmap_region_t *)ptr;
+}
+
+// Returns the smallest power of two that is at least `value`
+static size_t round_up_pow2(size_t value) {
+  if (value <= 1) return 1;
+  return (size_t)1 << (64 - __builtin_clzl(value - 1));
+}
+
+// Set the region size tunable `param` to `value`, as mallopt does. Returns
+// false on an invalid value
+static bool set_region_size_param(int param, size_t value) {
+  switch (param) {
+    case M_REGION_MIN_SIZE:
+      if (value == 0 || value > MAX_REGION_SIZE) return false;
+      region_min_size = round_up_pow2(value);
+      return true;
+    case M_REGION_MAX_SIZE:
+      if (value == 0 || value > MAX_REGION_SIZE) return false;
+      region_max_size = round_up_pow2(value);
+      return true;
+    case M_REGION_SIZE_DECAY_MS:
+      region_size_decay_ms = value;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Parse the `length` characters at `text` as a number with an optional K, M
+// or G suffix into `*value`. Returns false if they aren't one
+static bool parse_size(const char *text, size_t length, size_t *value) {
+  size_t shift = 0;
+  if (length > 0) {
+    switch (text[length - 1]) {
+      case 'k':
+      case 'K':
+        shift = 10;
+        break;
+      case 'm':
+      case 'M':
+        shift = 20;
+        break;
+      case 'g':
+      case 'G':
+        shift = 30;
+        break;
+    }
+  }
+  if (shift != 0) length--;
+  if (length == 0 || length > 12) return false;
+
+  *value = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (text[i] < '0' || text[i] > '9') return false;
+    *value = *value * 10 + (text[i] - '0');
+  }
+  if (*value > SIZE_MAX >> shift) return false;
+  *value <<= shift;
+  return true;
+}
+
+// Set the region size tunables from the comma separated key=value pairs of
+// REGION_SIZE_ENV, if set. Runs before the first region is mapped, so must
+// not allocate. Pairs with an unknown key or an invalid value are ignored
+static void read_region_size_env() {
+  const char *text = secure_getenv(REGION_SIZE_ENV);
+  if (text == NULL) return;
+
+  while (*text != '\0') {
+    const char *end = strchrnul(text, ',');
+    const char *equals = memchr(text, '=', end - text);
+    if (equals != NULL) {
+      size_t key_length = equals - text;
+      int param = 0;
+      if (key_length == 3 && memcmp(text, "min", 3) == 0) {
+        param = M_REGION_MIN_SIZE;
+      } else if (key_length == 3 && memcmp(text, "max", 3) == 0) {
+        param = M_REGION_MAX_SIZE;
+      } else if (key_length == 8 && memcmp(text, "decay_ms", 8) == 0) {
+        param = M_REGION_SIZE_DECAY_MS;
+      }
+      size_t value;
+      if (param != 0 && parse_size(equals + 1, end - equals - 1, &value)) {
+        set_region_size_param(param, value);
+      }
+    }
+    text = *end == ',' ? end + 1 : end;
+  }
+}
+
+// Read REGION_SIZE_ENV the first time this is called
+static void configure_region_sizes() {
+#ifdef THREAD_ARENAS
+  pthread_once(&region_size_env_once, read_region_size_env);
+#else
+  if (UNLIKELY(!region_size_env_read)) {
+    region_size_env_read = true;
+    read_region_size_env();
+  }
+#endif
+}
+
+// Returns the size of the region `arena` maps next, at least `min_size`, and
+// doubles it for the one after, up to the maximum region size. The size halves
+// for every `region_size_decay_ms` since the arena last mapped a region, so a
+// burst of allocation gets large regions and few mmap calls, and an arena that
+// only needs a region now and then goes back to small ones
+static size_t grow_region_size(arena_t *arena, size_t min_size) {
+  size_t max_size = MAX(region_max_size, min_size);
+  uint64_t now = get_time_ms();
+  size_t size = 0;
+  if (region_size_decay_ms != 0) {
+    uint64_t halvings = (now - arena->region_mapped_at) / region_size_decay_ms;
+    if (halvings < 64) size = arena->next_region_size >> halvings;
+  }
+  size = MIN(MAX(size, min_size), max_size);
+
+  arena->next_region_size = MIN(2 * size, max_size);
+  arena->region_mapped_at = now;
+  return size;
 }
 
-// Create a new mmap region and initialize it to have no chunks. Will be page
-// alligned and have sufficient space for a malloc chunk with data size of
-// `size_requested`
-static void *create_mmap_region(size_t size_requested) {
-  size_requested *= REDUNDANCY_MULTIPLIER;
-  size_t region_size = PAGESIZE;
-  while (region_size - sizeof(mmap_region_t) < size_requested) {
+// Returns a new region of `arena` with no chunks, in no region list. Will be
+// page alligned and have sufficient space for a malloc chunk with data size of
+// `size_requested`. A cached region is reused if one is large enough, otherwise
+// a region of the arena's next region size is mapped, see grow_region_size.
+// With huge pages, regions are at least a huge page. Returns NULL on failure
+static mmap_region_t *take_region(arena_t *arena, size_t size_requested) {
+  configure_region_sizes();
+  size_t min_size = MAX(region_min_size, get_page_size());
+  if (huge_pages != HUGE_PAGES_OFF) min_size = MAX(min_size, HUGE_PAGE_SIZE);
+  // The smallest region that fits the request
+  size_t region_size = min_size;
+  while (region_size - REGION_HEADER_SIZE < size_requested) {
     region_size += region_size;
   }
 
-  mmap_region_t *ptr = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
-                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  mmap_region_t *ptr = get_cached_region(arena, region_size);
+  if (ptr != NULL) {
+    arena->region_cache_hits++;
+  } else {
+    arena->region_cache_misses++;
+    size_t grown_size = grow_region_size(arena, min_size);
+    region_size = MAX(region_size, grown_size);
+    uint8_t backing;
+    ptr = map_region(arena, region_size, &backing);
+    if (ptr == NULL) return NULL;
+    // Cached regions are still in the page map from when they were mapped
+    if (!page_map_set(ptr, region_size, ptr)) {
+      stat_add(&arena->stats.munmap_calls, 1);
+      munmap(ptr, region_size);
+      return NULL;
+    }
 
-  if (ptr == MAP_FAILED) return NULL;
+    ptr->size = region_size;
+    ptr->dirty_size = 0;
+    ptr->huge_pages = backing;
+  }
+  stat_add(&arena->stats.regions, 1);
+  stat_add(&arena->stats.region_bytes, ptr->size);
+  if (ptr->huge_pages != HUGE_PAGES_OFF) {
+    stat_add(&arena->stats.huge_region_bytes, ptr->size);
+  }
 
   // Initialize region
-  ptr->size = region_size;
   ptr->chunks_head = NULL;
   ptr->chunks_tail = NULL;
   ptr->next_region = NULL;
-  ptr->prev_region = regions_end;
-  ptr->local_free_head = NULL;
-  ptr->local_free_tail = NULL;
+  ptr->prev_region = NULL;
   ptr->occupied_chunks = 0;
+  ptr->arena = arena;
+  atomic_init(&ptr->remote_frees, NULL);
+  return ptr;
+}
+
+// Create a new mmap region at the end of `arena`'s region list with space for
+// a chunk of `size_requested` bytes, see take_region
+static void *create_mmap_region(arena_t *arena, size_t size_requested) {
+  mmap_region_t *ptr = take_region(arena, size_requested);
+  if (ptr == NULL) return NULL;
 
   // Maintain mapped region linked list
-  if (regions_start == NULL) {
-    regions_start = ptr;
+  ptr->prev_region = arena->regions_end;
+  if (arena->regions_start == NULL) {
+    arena->regions_start = ptr;
   } else {
-    regions_end->next_region = ptr;
+    arena->regions_end->next_region = ptr;
   }
 
-  regions_end = ptr;
+  arena->regions_end = ptr;
 
   return ptr;
 }
 
-// Traverse the free list and return any existing unoccupied chunk that is
-// sufficiently large to hold `size_requested` bytes. Returns NULL if no such
-// chunk was found. The free chunk returned, if any, is removed from the free
-// list, and its region's local free head and tail are updated if necessary
-static void *get_chunk_from_free_list(size_t size_requested) {
-  // malloc_chunk_t *prev = free_head;
-  malloc_chunk_t *ptr = free_head;
+// Returns the best fit for `size` bytes in the tree bin `bin_idx` of `arena`:
+// the smallest chunk that fits, the lowest addressed of those, or NULL if none
+// fits. Adds the chunks looked at to `steps`
+static malloc_chunk_t *get_tree_best_fit(arena_t *arena, size_t bin_idx,
+                                         size_t size, size_t *steps) {
+  free_tree_node_t *node =
+      free_tree_best_fit(arena->tree_bins[bin_idx], size, steps);
+  return node == NULL ? NULL : get_tree_chunk(node);
+}
 
-  // Find an unoccupied chunk that is sufficiently large
-  while (ptr != NULL) {
-    if (ptr->chunk_size >= size_requested) {
-      delete_free_list_chunk(ptr);
-      return ptr;
+// Return any existing unoccupied chunk that is sufficiently large to hold
+// `size_requested` bytes. Requests under a page are rounded up to a class size,
+// so every chunk in a bin at or above the request's size class fits, and the
+// first non-empty such bin is found with a single bit scan. Larger requests
+// are not rounded, so the bin of the class they fall in is searched for a fit
+// first. A list bin gives its most recently freed chunk. A tree bin gives its
+// best fit, the smallest chunk that fits with the lowest address breaking ties,
+// which for a request of a page or more is the best fit of the whole arena.
+// Returns NULL if no such chunk was found. The free chunk returned, if any, is
+// removed from its bin, marked occupied and counted in its region's occupied
+// chunks, and is split if it is much larger than the request
+static malloc_chunk_t *get_chunk_from_free_list(arena_t *arena,
+                                                size_t size_requested) {
+  stat_add(&arena->stats.free_list_searches, 1);
+
+  size_t steps = 0;
+  malloc_chunk_t *ptr = NULL;
+  size_t size_class;
+  if (size_requested < LARGE_CHUNK_SIZE) {
+    size_class = size_to_class_ceil(size_requested);
+  } else {
+    size_class = size_to_class_floor(size_requested);
+    if (arena->nonempty_bins & ((uint64_t)1 << size_class)) {
+      ptr = get_tree_best_fit(arena, size_class, size_requested, &steps);
     }
+    // Every chunk of a larger class fits
+    size_class++;
+  }
 
-    ptr = ptr->next_free;
+  if (ptr == NULL && size_class < NUM_SIZE_CLASSES) {
+    uint64_t candidates = arena->nonempty_bins & (~(uint64_t)0 << size_class);
+    if (candidates != 0) {
+      size_t bin_idx = __builtin_ctzl(candidates);
+      if (arena->bins[bin_idx] != NULL) {
+        steps++;
+        ptr = arena->bins[bin_idx];
+      } else {
+        ptr = get_tree_best_fit(arena, bin_idx, size_requested, &steps);
+      }
+    }
   }
 
-  return NULL;
+  stat_add(&arena->stats.free_list_search_steps, steps);
+  if (ptr == NULL) return NULL;
+
+  mmap_region_t *region = get_chunk_region(ptr);
+  delete_free_list_chunk(arena, ptr);
+  mark_chunk_occupied(region, ptr);
+  split_chunk(arena, region, ptr, size_requested);
+  region->occupied_chunks++;
+  return ptr;
+}
+
+// Round `size` up to the size of the smallest class that holds it, so a free
+// chunk can be reused by any request of the same class. Chunks of a page or
+// more are found by best fit instead, so those requests are only aligned, which
+// saves up to a quarter of their size
+static size_t normalize_request(size_t size) {
+  if (size >= LARGE_CHUNK_SIZE) return ALIGN_UP(size, ALIGNMENT);
+  return class_to_size(size_to_class_ceil(size));
 }
 
-// Create and initialize a new malloc chunk with space for `size_requested`
-// bytes. Handles creation of new mmap regions in the scenario where there's
-// insufficient space.
-static malloc_chunk_t *create_malloc_chunk(size_t size_requested) {
+// Create and initialize a new malloc chunk in `arena` with space for
+// `size_requested` bytes. Handles creation of new mmap regions in the scenario
+// where there's insufficient space.
+static malloc_chunk_t *create_malloc_chunk(arena_t *arena,
+                                           size_t size_requested) {
   // Go to last malloc region and see if there's enough space for user's request
   // plus chunk metadata. If not, get new region
-  if (mmap_region_space_remaining(regions_end) <
+  if (mmap_region_space_remaining(arena->regions_end) <
       size_requested + sizeof(malloc_chunk_t)) {
     // We need space for the new data and its metadata
     void *new_region =
-        create_mmap_region(sizeof(malloc_chunk_t) + size_requested);
+        create_mmap_region(arena, sizeof(malloc_chunk_t) + size_requested);
     if (new_region == NULL) return NULL;  // mmap failure
   }
 
   // Now we know that regions_end has enough space for this chunk.
+  mmap_region_t *regions_end = arena->regions_end;
   malloc_chunk_t *new_chunk;
+  size_t flags = 0;
   if (regions_end->chunks_head == NULL) {
     // Initialize the head of the chunk list at the end of the region metadata
-    new_chunk = (malloc_chunk_t *)((char *)regions_end + sizeof(mmap_region_t));
+    new_chunk = (malloc_chunk_t *)((char *)regions_end + REGION_HEADER_SIZE);
 
     regions_end->chunks_head = new_chunk;
   } else {
     new_chunk = get_address_after_malloc_chunk(regions_end->chunks_tail);
+    if (regions_end->chunks_tail->chunk_size & CHUNK_FREE) {
+      flags = PREV_CHUNK_FREE;
+      new_chunk->prev_size = get_chunk_size(regions_end->chunks_tail);
+    }
     regions_end->chunks_tail = new_chunk;
   }
 
   // Initialize the new chunk
-  new_chunk->chunk_size = size_requested;
-  new_chunk->prev_free = free_tail;
-  new_chunk->next_free = NULL;
-  new_chunk->region = regions_end;
+  new_chunk->chunk_size = size_requested | flags;
 
   // Make new chunk the chunks tail and increment its occupied chunk count
   regions_end->chunks_tail = new_chunk;
@@ -263,115 +1166,1529 @@ static malloc_chunk_t *create_malloc_chunk(size_t size_requested) {
   return new_chunk;
 }
 
-void *malloc(size_t sz) {
-  if (sz == 0) return NULL;
-
-  // If free list is empty, we must create a new chunk
-  if (free_head == NULL) {
-    return get_chunk_data_address(create_malloc_chunk(sz));
-  }
-
-  // If free list exists, try searching for a sufficiently large chunk first
-  malloc_chunk_t *free_list_chunk = get_chunk_from_free_list(sz);
-  if (free_list_chunk != NULL) {
-    free_list_chunk->region->occupied_chunks++;
-    return get_chunk_data_address(free_list_chunk);
-  }
-
-  // No suitable chunks. Create new one.
-  return get_chunk_data_address(create_malloc_chunk(sz));
+// Returns the start of the mapping holding the CHUNK_MMAPPED `chunk`. A mapped
+// chunk starts its mapping unless it was placed further in for alignment, but
+// always within the mapping's first page
+static char *get_mapping_start(malloc_chunk_t *chunk) {
+  return (char *)((uintptr_t)chunk & ~(uintptr_t)(get_page_size() - 1));
 }
 
-void free(void *ptr) {
-  malloc_chunk_t *chunk_to_free = get_chunk_from_data_pointer(ptr);
-  mmap_region_t *region = chunk_to_free->region;
+// Every mapped chunk's data runs up to the end of its mapping
+static size_t get_mapping_length(malloc_chunk_t *chunk) {
+  return (char *)get_address_after_malloc_chunk(chunk) -
+         get_mapping_start(chunk);
+}
 
-  // If region has no more occupied chunks, we can return it to OS
-  region->occupied_chunks--;
-  if (region->occupied_chunks == 0) {
-    // Remove all of this region's free chunks from the global free list
-    if (region->local_free_head != NULL) {
-      malloc_chunk_t *prev = region->local_free_head->prev_free;
-      // tail != NULL because head is not NULL
-      if (prev == NULL) {
-        free_head = region->local_free_tail->next_free;
-      } else {
-        prev->next_free = region->local_free_tail->next_free;
-      }
+// Initialize the header of a mapped chunk at `chunk`, whose mapping ends at
+// `mapping_end`
+static void init_mmap_chunk(malloc_chunk_t *chunk, char *mapping_end) {
+  // The whole mapping is usable, not just what was asked for
+  chunk->chunk_size = (size_t)(mapping_end - (char *)chunk -
+                               sizeof(malloc_chunk_t)) |
+                      CHUNK_MMAPPED;
+}
 
-      malloc_chunk_t *next = region->local_free_tail->next_free;
-      // head != NULL because tail is not NULL
-      if (next == NULL) {
-        free_tail = region->local_free_head->prev_free;
-      } else {
-        next->prev_free = region->local_free_head->prev_free;
-      }
+// Map a chunk of its own with space for `size_requested` bytes, with its data
+// aligned to `alignment`, a power of two. Its mapping is exactly as large as
+// needed, and it never enters a region or a bin
+static malloc_chunk_t *create_mmap_chunk(size_t size_requested,
+                                         size_t alignment) {
+  // Room to slide the chunk forward for alignment
+  size_t slack = alignment > ALIGNMENT ? alignment : 0;
+  size_t page = get_page_size();
+  if (size_requested > SIZE_MAX - sizeof(malloc_chunk_t) - page - slack) {
+    return NULL;
+  }
 
-      // No need to modify pointers within list as the associated memory will be
-      // returned to OS
-    }
+  arena_stats_t *stats = get_thread_stats();
+  size_t mapping_size =
+      ALIGN_UP(size_requested + sizeof(malloc_chunk_t) + slack, page);
+  stat_add(&stats->mmap_calls, 1);
+  char *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) return NULL;
 
-    delete_region(region);
+  malloc_chunk_t *chunk = (malloc_chunk_t *)mapping;
+  if (slack == 0) {
+    init_mmap_chunk(chunk, mapping + mapping_size);
   } else {
-    // Append to free list. First check if the chunk's region has free chunks
-    if (region->local_free_head == NULL) {
-      // Insert to end of the global free list
-      if (free_head == NULL) {
-        free_head = chunk_to_free;
-      } else {
-        free_tail->next_free = chunk_to_free;
-      }
-      chunk_to_free->prev_free = free_tail;
-      free_tail = chunk_to_free;
+    // Unmap the whole pages before the chunk and after its data
+    char *data = (char *)ALIGN_UP((uintptr_t)mapping + sizeof(malloc_chunk_t),
+                                  alignment);
+    chunk = get_chunk_from_data_pointer(data);
+    char *start = get_mapping_start(chunk);
+    char *end = (char *)ALIGN_UP((uintptr_t)data + size_requested, page);
+    if (start != mapping) {
+      stat_add(&stats->munmap_calls, 1);
+      munmap(mapping, start - mapping);
+    }
+    if (end != mapping + mapping_size) {
+      stat_add(&stats->munmap_calls, 1);
+      munmap(end, mapping + mapping_size - end);
+    }
+    init_mmap_chunk(chunk, end);
+  }
 
-      region->local_free_head = chunk_to_free;
-      region->local_free_tail = chunk_to_free;
-    } else {
-      // Insert into global free list after `local_free_tail`
-      malloc_chunk_t *prev = region->local_free_tail;
-      malloc_chunk_t *next = prev->next_free;
+  stat_add(&stats->mmap_chunks, 1);
+  stat_add(&stats->mmap_chunk_bytes, get_chunk_size(chunk));
+  return chunk;
+}
 
-      prev->next_free = chunk_to_free;
-      chunk_to_free->prev_free = prev;
+// Mapped chunks freed while background reclaim is on, waiting for the reclaim
+// thread to unmap them, linked through their first word of data. Only ever
+// emptied all at once, so pushes can't be confused by a pop
+static _Atomic(malloc_chunk_t *) pending_unmaps = NULL;
 
-      chunk_to_free->next_free = next;
-      if (next == NULL) {
-        // The newly free'd chunk will be the global tail
-        free_tail = chunk_to_free;
-      } else {
-        next->prev_free = chunk_to_free;
-      }
+// Unmap the CHUNK_MMAPPED `chunk`, counting the call in `stats`
+static void unmap_mmap_chunk(malloc_chunk_t *chunk, arena_stats_t *stats) {
+  stat_add(&stats->munmap_calls, 1);
+  munmap(get_mapping_start(chunk), get_mapping_length(chunk));
+}
 
-      region->local_free_tail = chunk_to_free;
-    }
+// Return the mapping of the CHUNK_MMAPPED `chunk` to the OS, or leave it to
+// the reclaim thread
+static void delete_mmap_chunk(malloc_chunk_t *chunk) {
+  arena_stats_t *stats = get_thread_stats();
+  stat_add(&stats->mmap_chunks, -1);
+  stat_add(&stats->mmap_chunk_bytes, -get_chunk_size(chunk));
+  if (!atomic_load_explicit(&background_reclaim, memory_order_relaxed)) {
+    unmap_mmap_chunk(chunk, stats);
+    return;
   }
+
+  malloc_chunk_t **link = get_chunk_data_address(chunk);
+  malloc_chunk_t *head =
+      atomic_load_explicit(&pending_unmaps, memory_order_relaxed);
+  do {
+    *link = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &pending_unmaps, &head, chunk, memory_order_release,
+      memory_order_relaxed));
 }
 
-// test fns
-void print_regions() {
-  printf("Listing out mmap regions and remaining space:\n");
-  mmap_region_t *region = regions_start;
+// Resize the mapping of the CHUNK_MMAPPED `chunk` to hold `size_requested`
+// bytes. The kernel moves the pages if the mapping can't grow where it is, so
+// the data is never copied. Returns the chunk's new address, or NULL on failure
+static malloc_chunk_t *resize_mmap_chunk(malloc_chunk_t *chunk,
+                                         size_t size_requested) {
+  size_t page = get_page_size();
+  if (size_requested > SIZE_MAX - sizeof(malloc_chunk_t) - 2 * page) {
+    return NULL;
+  }
+
+  char *start = get_mapping_start(chunk);
+  size_t offset = (char *)chunk - start;
+  size_t old_mapping_size = get_mapping_length(chunk);
+  size_t mapping_size =
+      ALIGN_UP(offset + sizeof(malloc_chunk_t) + size_requested, page);
+  if (mapping_size == old_mapping_size) return chunk;
+
+  // Pages keep their offsets when moved, so the chunk stays at `offset`
+  arena_stats_t *stats = get_thread_stats();
+  size_t old_size = get_chunk_size(chunk);
+  stat_add(&stats->mremap_calls, 1);
+  char *new_start = mremap(start, old_mapping_size, mapping_size,
+                           MREMAP_MAYMOVE);
+  if (new_start == MAP_FAILED) return NULL;
+
+  malloc_chunk_t *new_chunk = (malloc_chunk_t *)(new_start + offset);
+  init_mmap_chunk(new_chunk, new_start + mapping_size);
+  stat_add(&stats->mmap_chunk_bytes, get_chunk_size(new_chunk) - old_size);
+  return new_chunk;
+}
+
+#ifdef THREAD_ARENAS
+// Push the chunks from `first` to `last`, linked through `next_free`, which
+// belong to another thread's arena, onto their region's remote free list.
+// Lock-free, as any number of threads may free into a region
+static void push_remote_frees(mmap_region_t *region, malloc_chunk_t *first,
+                              malloc_chunk_t *last) {
+  malloc_chunk_t *head = atomic_load_explicit(&region->remote_frees,
+                                              memory_order_relaxed);
+  do {
+    get_free_links(last)->next_free = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &region->remote_frees, &head, first, memory_order_release,
+      memory_order_relaxed));
+}
+#endif
+
+static void arena_free(arena_t *arena, mmap_region_t *region,
+                       malloc_chunk_t *chunk);
+
+// Free every chunk other threads have pushed onto `region`'s remote free list
+// into `arena`, which owns `region`. Returns true if there were any. May unmap
+// `region`
+static bool drain_remote_frees(arena_t *arena, mmap_region_t *region) {
+  malloc_chunk_t *chunk =
+      atomic_exchange_explicit(&region->remote_frees, NULL,
+                               memory_order_acquire);
+  if (chunk == NULL) return false;
+
+  while (chunk != NULL) {
+    malloc_chunk_t *next = get_free_links(chunk)->next_free;
+    arena_free(arena, region, chunk);
+    chunk = next;
+  }
+
+  return true;
+}
+
+// Drain the remote free lists of every region in `arena`. Returns true if any
+// chunks were freed
+static bool collect_remote_frees(arena_t *arena) {
+  bool collected = false;
+  mmap_region_t *region = arena->regions_start;
   while (region != NULL) {
-    printf("\t%p: %lu\n", (void *)region, mmap_region_space_remaining(region));
-    region = region->next_region;
+    // Draining may unmap `region`
+    mmap_region_t *next = region->next_region;
+    if (atomic_load_explicit(&region->remote_frees, memory_order_relaxed) !=
+        NULL) {
+      collected |= drain_remote_frees(arena, region);
+    }
+    region = next;
+  }
+
+  return collected;
+}
+
+// Allocate a chunk of `sz` bytes, a normalized request, from the regions of
+// `arena`. If `zeroed` is not NULL, it is set to whether the chunk's data is
+// known to be zero
+static malloc_chunk_t *arena_malloc_chunk(arena_t *arena, size_t sz,
+                                          bool *zeroed) {
+  // If free chunks exist, try finding a sufficiently large chunk first
+  if (arena->nonempty_bins != 0) {
+    malloc_chunk_t *free_list_chunk = get_chunk_from_free_list(arena, sz);
+    if (free_list_chunk != NULL) return free_list_chunk;
+  }
+
+  // Before mapping a new region, take back what other threads have freed
+  if (mmap_region_space_remaining(arena->regions_end) <
+          sz + sizeof(malloc_chunk_t) &&
+      collect_remote_frees(arena)) {
+    malloc_chunk_t *free_list_chunk = get_chunk_from_free_list(arena, sz);
+    if (free_list_chunk != NULL) return free_list_chunk;
+  }
+
+  // No suitable chunks. Create new one, at the end of the last region. Nothing
+  // past a region's chunks tail has been written to since the region was
+  // mapped or last purged, so its data is still zero
+  malloc_chunk_t *new_chunk = create_malloc_chunk(arena, sz);
+  if (new_chunk == NULL) return NULL;
+  if (zeroed != NULL) {
+    mmap_region_t *region = arena->regions_end;
+    *zeroed = (char *)new_chunk >= (char *)region + region->dirty_size;
+  }
+  return new_chunk;
+}
+
+// Carve up to `count` chunks of `sz` bytes, a normalized request, out of the
+// space after the chunks tail of `region`, which has one, into `ptrs` as their
+// data addresses. They are counted in the region's occupied chunks at once.
+// Returns the number carved
+static size_t carve_tail_chunks(mmap_region_t *region, size_t sz, void **ptrs,
+                                size_t count) {
+  count = MIN(count, mmap_region_space_remaining(region) /
+                         (sz + sizeof(malloc_chunk_t)));
+  malloc_chunk_t *tail = region->chunks_tail;
+  for (size_t i = 0; i < count; i++) {
+    malloc_chunk_t *chunk = get_address_after_malloc_chunk(tail);
+    chunk->chunk_size = sz;
+    if (tail->chunk_size & CHUNK_FREE) {
+      chunk->chunk_size |= PREV_CHUNK_FREE;
+      chunk->prev_size = get_chunk_size(tail);
+    }
+    ptrs[i] = get_chunk_data_address(chunk);
+    tail = chunk;
+  }
+
+  region->chunks_tail = tail;
+  region->occupied_chunks += count;
+  return count;
+}
+
+// Allocate up to `count` chunks of `sz` bytes, a normalized request, from
+// `arena` into `ptrs` as their data addresses. Free chunks are taken one by
+// one, but once the bins run dry every chunk that fits in the last region is
+// carved out of it at once. Returns the number allocated, fewer than `count`
+// only if no region could be mapped
+static size_t arena_malloc_chunks(arena_t *arena, size_t sz, void **ptrs,
+                                  size_t count) {
+  size_t taken = 0;
+  while (taken < count && arena->nonempty_bins != 0) {
+    malloc_chunk_t *chunk = get_chunk_from_free_list(arena, sz);
+    if (chunk == NULL) break;
+    ptrs[taken++] = get_chunk_data_address(chunk);
+  }
+
+  while (taken < count) {
+    // Takes back remote frees or maps a new region when the last one is full
+    malloc_chunk_t *chunk = arena_malloc_chunk(arena, sz, NULL);
+    if (chunk == NULL) break;
+    ptrs[taken++] = get_chunk_data_address(chunk);
+    taken += carve_tail_chunks(arena->regions_end, sz, ptrs + taken,
+                               count - taken);
+  }
+  return taken;
+}
+
+// Allocate `sz` bytes from `arena`. Small requests are served from slabs, and
+// huge ones get a mapping of their own, outside of the arena. If `zeroed` is
+// not NULL, it is set to whether the memory is known to be zero, which is the
+// case for pages fresh from mmap that were never handed out before
+static void *arena_malloc(arena_t *arena, size_t sz, bool *zeroed) {
+  if (sz == 0) return NULL;
+  if (zeroed != NULL) *zeroed = false;
+  if (sz >= mmap_threshold) {
+    malloc_chunk_t *chunk = create_mmap_chunk(sz, ALIGNMENT);
+    if (chunk == NULL) return NULL;
+    if (zeroed != NULL) *zeroed = true;
+    return get_chunk_data_address(chunk);
+  }
+  sz = normalize_request(sz);
+
+  if (sz <= MAX_SLAB_OBJECT_SIZE) {
+    void *ptr = slab_malloc(arena, size_to_class_ceil(sz), sz);
+    if (ptr != NULL) return ptr;
+    // Out of slab address space. Fall back to chunks
+  }
+
+  malloc_chunk_t *chunk = arena_malloc_chunk(arena, sz, zeroed);
+  if (chunk == NULL) return NULL;
+  return get_chunk_data_address(chunk);
+}
+
+// Put the `chunk` of `region` in `arena`, which is no longer counted in the
+// region's occupied chunks, back in a bin, or give the region up if it is empty
+static void release_chunk(arena_t *arena, mmap_region_t *region,
+                          malloc_chunk_t *chunk_to_free) {
+  // Merging with free neighbours takes them out of their bins. Once the last
+  // occupied chunk goes, the merged chunk spans every chunk in the region, so
+  // none of the region's chunks are left in any bin
+  chunk_to_free = coalesce_chunk(arena, region, chunk_to_free);
+
+  // If region has no more occupied chunks, it can be cached or returned to OS
+  if (region->occupied_chunks == 0) {
+    delete_region(arena, region);
+  } else {
+    mark_chunk_free(region, chunk_to_free);
+    insert_free_list_chunk(arena, chunk_to_free);
+  }
+}
+
+// Free `chunk`, which belongs to `region` of `arena`
+static void arena_free(arena_t *arena, mmap_region_t *region,
+                       malloc_chunk_t *chunk_to_free) {
+  region->occupied_chunks--;
+  release_chunk(arena, region, chunk_to_free);
+}
+
+// Shrink the occupied `chunk` of `region` in `arena` to `size` bytes, if the
+// leftover is large enough to be a chunk of its own. The leftover is freed like
+// any other chunk, so it merges with the chunk after it if that one is free
+static void shrink_chunk(arena_t *arena, mmap_region_t *region,
+                         malloc_chunk_t *chunk, size_t size) {
+  size_t old_size = get_chunk_size(chunk);
+  if (old_size < size + MIN_SPLIT_SIZE) return;
+
+  chunk->chunk_size = size | (chunk->chunk_size & CHUNK_FLAGS);
+
+  // The chunk before the remainder is `chunk`, which is occupied
+  malloc_chunk_t *remainder = get_address_after_malloc_chunk(chunk);
+  remainder->chunk_size = old_size - size - sizeof(malloc_chunk_t);
+  if (region->chunks_tail == chunk) region->chunks_tail = remainder;
+
+  region->occupied_chunks++;
+  arena_free(arena, region, remainder);
+}
+
+// Resize the occupied `chunk` of `region` in `arena` to `size` bytes without
+// moving it. Grows into the chunk after it if that one is free and large
+// enough, or into the rest of the region if `chunk` is the region's tail.
+// Returns true on success
+static bool resize_chunk_in_place(arena_t *arena, mmap_region_t *region,
+                                  malloc_chunk_t *chunk, size_t size) {
+  size_t old_size = get_chunk_size(chunk);
+  if (size <= old_size) {
+    shrink_chunk(arena, region, chunk, size);
+    return true;
+  }
+
+  malloc_chunk_t *next = get_next_chunk(region, chunk);
+  if (next == NULL) {
+    if (size - old_size > mmap_region_space_remaining(region)) return false;
+    chunk->chunk_size += size - old_size;
+    return true;
+  }
+
+  if (!(next->chunk_size & CHUNK_FREE) ||
+      old_size + sizeof(malloc_chunk_t) + get_chunk_size(next) < size) {
+    return false;
+  }
+
+  delete_free_list_chunk(arena, next);
+  chunk->chunk_size += get_chunk_size(next) + sizeof(malloc_chunk_t);
+  if (region->chunks_tail == next) region->chunks_tail = chunk;
+  // The chunk after `next` was occupied, as `next` was free. Tell it its new
+  // neighbour is occupied too, then give back what `chunk` doesn't need
+  mark_chunk_occupied(region, chunk);
+  split_chunk(arena, region, chunk, size);
+  return true;
+}
+
+// Split the first `offset` bytes of the occupied `chunk` of `region` in `arena`
+// off into a chunk of their own and free it. Returns the chunk holding the
+// rest. Requires `offset` to be a multiple of ALIGNMENT, at least
+// MIN_SPLIT_SIZE and smaller than the size of `chunk`
+static malloc_chunk_t *trim_chunk_front(arena_t *arena, mmap_region_t *region,
+                                        malloc_chunk_t *chunk, size_t offset) {
+  size_t old_size = get_chunk_size(chunk);
+
+  // The chunk before the rest is the front, which is still occupied
+  malloc_chunk_t *rest = (malloc_chunk_t *)((char *)chunk + offset);
+  rest->chunk_size = old_size - offset;
+  if (region->chunks_tail == chunk) region->chunks_tail = rest;
+
+  chunk->chunk_size =
+      (offset - sizeof(malloc_chunk_t)) | (chunk->chunk_size & CHUNK_FLAGS);
+  region->occupied_chunks++;
+  arena_free(arena, region, chunk);
+  return rest;
+}
+
+// Free `ptr` into `arena`, which the calling thread allocates from and holds,
+// bypassing the cache
+#ifdef THREAD_ARENAS
+static void arena_free_object(arena_t *arena, void *ptr) {
+  if (is_slab_pointer(ptr)) {
+    slab_free(arena, ptr);
+    return;
+  }
+
+  malloc_chunk_t *chunk_to_free = get_chunk_from_data_pointer(ptr);
+  // Mapped chunks belong to no arena, so any thread can unmap them
+  if (chunk_to_free->chunk_size & CHUNK_MMAPPED) {
+    delete_mmap_chunk(chunk_to_free);
+    return;
+  }
+
+  mmap_region_t *region = get_chunk_region(chunk_to_free);
+
+  // Chunks of other threads' arenas are left for their owners to free
+  if (region->arena != arena) {
+    push_remote_frees(region, chunk_to_free, chunk_to_free);
+    return;
+  }
+
+  // Read before freeing, as freeing may unmap the region. If there are remote
+  // frees, the region can't be unmapped as they still count as occupied
+  bool has_remote_frees =
+      atomic_load_explicit(&region->remote_frees, memory_order_relaxed) !=
+      NULL;
+
+  arena_free(arena, region, chunk_to_free);
+  if (has_remote_frees) drain_remote_frees(arena, region);
+}
+#else
+static void arena_free_object(arena_t *arena, void *ptr) {
+  if (is_slab_pointer(ptr)) {
+    slab_free(arena, ptr);
+    return;
+  }
+
+  malloc_chunk_t *chunk_to_free = get_chunk_from_data_pointer(ptr);
+  if (chunk_to_free->chunk_size & CHUNK_MMAPPED) {
+    delete_mmap_chunk(chunk_to_free);
+  } else {
+    arena_free(arena, get_chunk_region(chunk_to_free), chunk_to_free);
+  }
+}
+#endif
+
+// Free `ptr` into the calling thread's arena, bypassing the cache
+static void thread_free(void *ptr) {
+  arena_t *arena = lock_arena();
+  arena_free_object(arena, ptr);
+  unlock_arena(arena);
+}
+
+// Pop an object of `size_class` off the cache. Returns NULL if there are none
+static void *tcache_get(size_t size_class) {
+  void *ptr = tcache.heads[size_class];
+  if (ptr == NULL) return NULL;
+
+  tcache.heads[size_class] = *(void **)ptr;
+  tcache.counts[size_class]--;
+  return ptr;
+}
+
+static void tcache_push(size_t size_class, void *ptr) {
+  *(void **)ptr = tcache.heads[size_class];
+  tcache.heads[size_class] = ptr;
+  tcache.counts[size_class]++;
+}
+
+// Free the `count` least recently cached objects of `size_class`
+static void tcache_flush(size_t size_class, size_t count) {
+  size_t keep =
+      tcache.counts[size_class] > count ? tcache.counts[size_class] - count : 0;
+
+  void **link = &tcache.heads[size_class];
+  for (size_t i = 0; i < keep; i++) {
+    link = (void **)*link;
+  }
+
+  void *ptr = *link;
+  *link = NULL;
+  tcache.counts[size_class] = keep;
+  if (ptr == NULL) return;
+
+  arena_t *arena = lock_arena();
+  while (ptr != NULL) {
+    void *next = *(void **)ptr;
+    arena_free_object(arena, ptr);
+    ptr = next;
+  }
+  unlock_arena(arena);
+}
+
+#ifdef THREAD_ARENAS
+static pthread_key_t thread_exit_key;
+static pthread_once_t thread_exit_key_once = PTHREAD_ONCE_INIT;
+static __thread bool thread_exit_registered = false;
+
+// Thread exit destructor. Gives every cached object back to the thread's
+// arena and leaves its shared arena, if any. Then takes back what other
+// threads freed into its own arena, unmaps its cached regions, and hands it to
+// the arena manager, which keeps it for the next new thread to adopt. Objects
+// still in use stay valid: other threads free them into the arena as they
+// would into a live thread's, and the adopter takes them back
+static void release_thread(void *unused) {
+  tcache.disabled = true;
+  for (size_t i = 0; i < MAX_TCACHE_CLASSES; i++) {
+    tcache_flush(i, tcache.counts[i]);
+  }
+  detach_shared_arena();
+  if (thread_id == 0) return;
+
+  arena_t *arena = current_arena();
+  if (arena != NULL) {
+    slab_collect_remote_frees(arena);
+    collect_remote_frees(arena);
+    lock_region_cache(arena);
+    while (arena->cached_regions != NULL) {
+      evict_cached_region(arena, arena->cached_regions);
+    }
+    unlock_region_cache(arena);
+    // The adopter starts over with small regions, rather than doubling the
+    // sizes this thread grew to
+    arena->next_region_size = 0;
+    delete_arena(thread_id);
+  }
+
+  // A later destructor that allocates gets an arena again, and registering
+  // makes this run once more after it
+  thread_id = 0;
+  thread_stats = NULL;
+  thread_exit_registered = false;
+}
+
+// Take back what was freed into the calling thread's own arena while it
+// allocates from a shared one. Its own arena still holds what it allocated
+// before joining, and any arena it adopted
+static void collect_own_arena() {
+  arena_t *arena = current_arena();
+  if (arena == NULL) return;
+  if (atomic_load_explicit(&arena->remote_slabs, memory_order_relaxed) !=
+      NULL) {
+    slab_collect_remote_frees(arena);
+  }
+  collect_remote_frees(arena);
+}
+
+static void create_thread_exit_key() {
+  pthread_key_create(&thread_exit_key, release_thread);
+}
+
+// Make sure the calling thread's cache and arena are released when it exits
+static void register_thread_exit() {
+  // Set first, as pthread_setspecific may itself allocate
+  thread_exit_registered = true;
+  pthread_once(&thread_exit_key_once, create_thread_exit_key);
+  pthread_setspecific(thread_exit_key, &tcache);
+}
+#endif
+
+// Returns the number of bytes usable at `ptr`
+static size_t get_object_size(void *ptr) {
+  if (is_slab_pointer(ptr)) return get_slab(ptr)->object_size;
+  return get_chunk_size(get_chunk_from_data_pointer(ptr));
+}
+
+// Count an object of `size` usable bytes being handed to the program, in the
+// calling thread's statistics
+static void count_malloc(size_t size) {
+  arena_stats_t *stats = get_thread_stats();
+  stat_add(&stats->mallocs[size_to_class_floor(size)], 1);
+  stat_add(&stats->malloc_bytes, size);
+}
+
+// Count the program giving back an object of `size` usable bytes
+static void count_free(size_t size) {
+  arena_stats_t *stats = get_thread_stats();
+  stat_add(&stats->frees[size_to_class_floor(size)], 1);
+  stat_add(&stats->free_bytes, size);
+}
+
+// Cache `ptr`, which has `size` usable bytes, instead of freeing it, if it is
+// small enough. Once the cache for its class is full, the oldest
+// `tcache_batch` objects are freed first. Returns true if `ptr` was cached
+static bool tcache_put(void *ptr, size_t size) {
+  if (size >= tcache_size_limit || tcache.disabled) return false;
+
+#ifdef THREAD_ARENAS
+  if (UNLIKELY(!thread_exit_registered)) register_thread_exit();
+#endif
+
+  // The floor class, as the chunk may be larger than its class if it was not
+  // worth splitting
+  size_t size_class = size_to_class_floor(size);
+  if (tcache.counts[size_class] >= tcache_count) {
+    if (tcache_count == 0) return false;
+    tcache_flush(size_class, tcache_batch);
+  }
+
+  tcache_push(size_class, ptr);
+  return true;
+}
+
+// Allocate `tcache_batch` objects of `size_class` from the calling thread's
+// arena at once. Returns one of them and caches the rest
+static void *tcache_refill(size_t size_class) {
+#ifdef THREAD_ARENAS
+  if (shared_arena != NULL) collect_own_arena();
+#endif
+  arena_t *arena = lock_arena();
+  if (UNLIKELY(arena == NULL)) return NULL;
+  size_t size = class_to_size(size_class);
+
+  void *ret = arena_malloc(arena, size, NULL);
+  if (ret != NULL && !tcache.disabled) {
+    for (size_t i = 1;
+         i < tcache_batch && tcache.counts[size_class] < tcache_count; i++) {
+      void *ptr = arena_malloc(arena, size, NULL);
+      if (ptr == NULL) break;
+      tcache_push(size_class, ptr);
+    }
+  }
+
+  unlock_arena(arena);
+  return ret;
+}
+
+// Allocate `sz` bytes as a sample for the heap profiler, once the calling
+// thread's countdown has run out, and draw the next countdown. Samples are
+// always chunks, never from slabs or the cache, so free can tell them apart by
+// their CHUNK_SAMPLED flag. Returns NULL if the allocation isn't sampled, as
+// profiling is off, leaving it to the usual path
+static __attribute__((noinline)) void *sample_malloc(size_t sz) {
+  size_t mean = profile_sample_bytes;
+  if (mean == 0 || !sampler_started) {
+    // Sampling a thread's first allocation would skew the profile towards them
+    sampler_started = mean != 0;
+    bytes_until_sample =
+        mean == 0 ? PROFILE_RECHECK_BYTES : profile_next_sample(mean);
+    return NULL;
+  }
+  bytes_until_sample = profile_next_sample(mean);
+
+  malloc_chunk_t *chunk;
+  if (sz >= mmap_threshold) {
+    chunk = create_mmap_chunk(sz, ALIGNMENT);
+  } else {
+    arena_t *arena = lock_arena();
+    if (UNLIKELY(arena == NULL)) return NULL;
+    chunk = arena_malloc_chunk(arena, normalize_request(sz), NULL);
+    unlock_arena(arena);
+  }
+  if (chunk == NULL) return NULL;
+
+  void *ptr = get_chunk_data_address(chunk);
+  if (profile_record(ptr, get_chunk_size(chunk))) {
+    chunk->chunk_size |= CHUNK_SAMPLED;
+  }
+  count_malloc(get_chunk_size(chunk));
+  return ptr;
+}
+
+// Returns a sampled allocation of `sz` bytes if the calling thread is due for a
+// sample, or NULL
+static inline void *sample_if_due(size_t sz) {
+  if (__builtin_expect((bytes_until_sample -= sz) >= 0, 1)) return NULL;
+  return sample_malloc(sz);
+}
+
+// Stop the heap profiler tracking the sampled `chunk`, which is being freed
+static void forget_sample(malloc_chunk_t *chunk) {
+  chunk->chunk_size &= ~(size_t)CHUNK_SAMPLED;
+  profile_forget(get_chunk_data_address(chunk));
+}
+
+// Allocate `sz` bytes for the calling thread, from its cache if possible.
+// malloc and calloc both go through here, as gcc turns a malloc followed by a
+// memset in calloc back into a call to calloc
+static void *thread_malloc(size_t sz) {
+  if (sz == 0) return NULL;
+
+  void *ptr = sample_if_due(sz);
+  if (UNLIKELY(ptr != NULL)) return ptr;
+  size_t size_class = size_to_class_ceil(sz);
+  if (size_class < tcache_classes) {
+    ptr = tcache_get(size_class);
+    if (ptr != NULL) {
+      tcache.hits++;
+    } else {
+      tcache.misses++;
+      ptr = tcache_refill(size_class);
+    }
+  } else {
+    arena_t *arena = lock_arena();
+    if (arena != NULL) {
+      ptr = arena_malloc(arena, sz, NULL);
+      unlock_arena(arena);
+    }
+  }
+
+  // Slab objects are exactly the size of the class they were allocated for,
+  // which saves reading their slab's header
+  if (ptr == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  count_malloc(is_slab_pointer(ptr) ? class_to_size(size_class)
+                                    : get_object_size(ptr));
+  return ptr;
+}
+
+void *malloc(size_t sz) { return thread_malloc(sz); }
+
+void free(void *ptr) {
+  if (ptr == NULL) return;
+
+  size_t size;
+  if (is_slab_pointer(ptr)) {
+    size = get_slab(ptr)->object_size;
+  } else {
+    malloc_chunk_t *chunk = get_chunk_from_data_pointer(ptr);
+    if (UNLIKELY(chunk->chunk_size & CHUNK_SAMPLED)) forget_sample(chunk);
+    size = get_chunk_size(chunk);
+  }
+  count_free(size);
+  if (tcache_put(ptr, size)) return;
+  thread_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  size_t total;
+  if (__builtin_mul_overflow(nmemb, size, &total)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (total == 0) return NULL;
+
+  // Cached objects are always dirty. Larger requests skip the cache, so
+  // memory straight from mmap can be handed out without clearing it
+  bool zeroed = false;
+  void *ptr;
+  if (size_to_class_ceil(total) < tcache_classes) {
+    ptr = thread_malloc(total);
+  } else if ((ptr = sample_if_due(total)) == NULL) {
+    arena_t *arena = lock_arena();
+    if (arena != NULL) {
+      ptr = arena_malloc(arena, total, &zeroed);
+      unlock_arena(arena);
+    }
+    if (ptr == NULL) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    count_malloc(get_object_size(ptr));
+  }
+  if (ptr != NULL && !zeroed) memset(ptr, 0, total);
+  return ptr;
+}
+
+// Move the `old_size` bytes at `ptr` to a new allocation of `size` bytes
+static void *move_allocation(void *ptr, size_t old_size, size_t size) {
+  void *new_ptr = thread_malloc(size);
+  if (new_ptr == NULL) return NULL;
+  memcpy(new_ptr, ptr, MIN(old_size, size));
+  free(ptr);
+  return new_ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (ptr == NULL) return thread_malloc(size);
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+
+  // A slab object stays put only if the new size is of its class, so its class
+  // is always that of its latest request, which free_sized relies on
+  if (is_slab_pointer(ptr)) {
+    slab_t *slab = get_slab(ptr);
+    if (size <= slab->object_size &&
+        size_to_class_ceil(size) == slab->size_class) {
+      return ptr;
+    }
+    return move_allocation(ptr, slab->object_size, size);
+  }
+
+  malloc_chunk_t *chunk = get_chunk_from_data_pointer(ptr);
+  size_t old_size = get_chunk_size(chunk);
+
+  // The profiler tracks a sample by address and size, so it is never resized
+  if (UNLIKELY(chunk->chunk_size & CHUNK_SAMPLED)) {
+    return move_allocation(ptr, old_size, size);
+  }
+
+  // Mapped chunks that stay huge are remapped rather than copied
+  if (chunk->chunk_size & CHUNK_MMAPPED) {
+    if (size < mmap_threshold) return move_allocation(ptr, old_size, size);
+
+    malloc_chunk_t *new_chunk = resize_mmap_chunk(chunk, size);
+    if (new_chunk == NULL) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    count_free(old_size);
+    count_malloc(get_chunk_size(new_chunk));
+    return get_chunk_data_address(new_chunk);
+  }
+
+  // Only the owner of a region may touch its bins
+  arena_t *arena = lock_arena();
+  mmap_region_t *region = get_chunk_region(chunk);
+  bool resized =
+      size < mmap_threshold && region->arena == arena &&
+      resize_chunk_in_place(arena, region, chunk, normalize_request(size));
+  unlock_arena(arena);
+  if (resized) {
+    count_free(old_size);
+    count_malloc(get_chunk_size(chunk));
+    return ptr;
+  }
+
+  return move_allocation(ptr, old_size, size);
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+  size_t total;
+  if (__builtin_mul_overflow(nmemb, size, &total)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(ptr, total);
+}
+
+void free_sized(void *ptr, size_t size) {
+  // A slab object is exactly the size of the class of its request, which saves
+  // reading its slab's header. Small requests may still have been given a
+  // chunk, as samples or once slabs run out
+  if (size != 0 && size <= MAX_SLAB_OBJECT_SIZE && is_slab_pointer(ptr)) {
+    size_t object_size = class_to_size(size_to_class_ceil(size));
+    count_free(object_size);
+    if (tcache_put(ptr, object_size)) return;
+    thread_free(ptr);
+    return;
+  }
+  free(ptr);
+}
+
+// Allocate up to `count` objects of `size` bytes from `arena` into `ptrs`,
+// bypassing the cache, and count them. Returns the number allocated
+static size_t arena_malloc_batch(arena_t *arena, size_t size, void **ptrs,
+                                 size_t count) {
+  size_t taken = 0;
+  if (size >= mmap_threshold) {
+    for (; taken < count; taken++) {
+      malloc_chunk_t *chunk = create_mmap_chunk(size, ALIGNMENT);
+      if (chunk == NULL) break;
+      ptrs[taken] = get_chunk_data_address(chunk);
+      count_malloc(get_chunk_size(chunk));
+    }
+    return taken;
+  }
+
+  size_t sz = normalize_request(size);
+  if (sz <= MAX_SLAB_OBJECT_SIZE) {
+    size_t size_class = size_to_class_ceil(sz);
+    taken = slab_malloc_batch(arena, size_class, sz, ptrs, count);
+    stat_add(&arena->stats.mallocs[size_class], taken);
+    stat_add(&arena->stats.malloc_bytes, taken * sz);
+    // Out of slab address space. The rest fall back to chunks
+  }
+
+  size_t first_chunk = taken;
+  taken += arena_malloc_chunks(arena, sz, ptrs + taken, count - taken);
+  for (size_t i = first_chunk; i < taken; i++) {
+    count_malloc(get_object_size(ptrs[i]));
+  }
+  return taken;
+}
+
+size_t malloc_batch(size_t size, size_t count, void **ptrs) {
+  if (size == 0) return 0;
+
+  // Allocate in runs of the objects the sampling countdown covers. The object
+  // that runs it out is allocated on its own, through the sampler
+  size_t taken = 0;
+  while (taken < count) {
+    size_t run = MIN(count - taken, (size_t)bytes_until_sample / size);
+    if (run == 0) {
+      void *ptr = sample_if_due(size);
+      if (ptr != NULL) {
+        ptrs[taken++] = ptr;
+        continue;
+      }
+      // Profiling is off, and the countdown was reset
+      run = 1;
+    } else {
+      bytes_until_sample -= run * size;
+    }
+
+    arena_t *arena = lock_arena();
+    if (UNLIKELY(arena == NULL)) break;
+    size_t run_taken = arena_malloc_batch(arena, size, ptrs + taken, run);
+    unlock_arena(arena);
+    taken += run_taken;
+    if (run_taken < run) break;
+  }
+  return taken;
+}
+
+// Free the `count` chunks at `ptrs`, given as data addresses, which all belong
+// to `region`, on behalf of the thread owning `arena`, bypassing the cache.
+// Chunks of another thread's region go onto its remote free list all at once.
+// Otherwise chunks that are physically adjacent, as those carved out together
+// by malloc_batch are, are merged into a single span first, so each span costs
+// one update of the region's occupied chunks and one bin insertion
+static void free_region_batch(arena_t *arena, mmap_region_t *region,
+                              void **ptrs, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    malloc_chunk_t *chunk = get_chunk_from_data_pointer(ptrs[i]);
+    if (UNLIKELY(chunk->chunk_size & CHUNK_SAMPLED)) forget_sample(chunk);
+    count_free(get_chunk_size(chunk));
+  }
+
+#ifdef THREAD_ARENAS
+  if (region->arena != arena) {
+    for (size_t i = 0; i + 1 < count; i++) {
+      get_free_links(get_chunk_from_data_pointer(ptrs[i]))->next_free =
+          get_chunk_from_data_pointer(ptrs[i + 1]);
+    }
+    push_remote_frees(region, get_chunk_from_data_pointer(ptrs[0]),
+                      get_chunk_from_data_pointer(ptrs[count - 1]));
+    return;
+  }
+
+  // Read before freeing, as freeing may unmap the region, see thread_free
+  bool has_remote_frees =
+      atomic_load_explicit(&region->remote_frees, memory_order_relaxed) !=
+      NULL;
+#endif
+
+  malloc_chunk_t *span = get_chunk_from_data_pointer(ptrs[0]);
+  size_t span_chunks = 1;
+  for (size_t i = 1; i <= count; i++) {
+    malloc_chunk_t *chunk =
+        i < count ? get_chunk_from_data_pointer(ptrs[i]) : NULL;
+    // Both are occupied, so the later one has no flags to keep
+    if (chunk == get_address_after_malloc_chunk(span)) {
+      span->chunk_size += get_chunk_size(chunk) + sizeof(malloc_chunk_t);
+      if (region->chunks_tail == chunk) region->chunks_tail = span;
+      span_chunks++;
+      continue;
+    }
+    if (chunk != NULL && get_address_after_malloc_chunk(chunk) == span) {
+      chunk->chunk_size += get_chunk_size(span) + sizeof(malloc_chunk_t);
+      if (region->chunks_tail == span) region->chunks_tail = chunk;
+      span = chunk;
+      span_chunks++;
+      continue;
+    }
+
+    // The region is only emptied by the last span, as the others still count
+    // as occupied until then
+    region->occupied_chunks -= span_chunks;
+    release_chunk(arena, region, span);
+    span = chunk;
+    span_chunks = 1;
+  }
+
+#ifdef THREAD_ARENAS
+  if (has_remote_frees) drain_remote_frees(arena, region);
+#endif
+}
+
+void free_batch(void **ptrs, size_t count) {
+  arena_t *arena = lock_arena();
+  // Without an arena, every object goes back to its owner as a remote free
+  arena_stats_t *stats = arena == NULL ? get_thread_stats() : &arena->stats;
+  size_t i = 0;
+  while (i < count) {
+    void *ptr = ptrs[i];
+    if (ptr == NULL) {
+      i++;
+      continue;
+    }
+
+    // Free runs of objects of the same slab or region together
+    size_t run = 1;
+    if (is_slab_pointer(ptr)) {
+      slab_t *slab = get_slab(ptr);
+      while (i + run < count && ptrs[i + run] != NULL &&
+             is_slab_pointer(ptrs[i + run]) &&
+             get_slab(ptrs[i + run]) == slab) {
+        run++;
+      }
+      stat_add(&stats->frees[slab->size_class], run);
+      stat_add(&stats->free_bytes, run * slab->object_size);
+      slab_free_batch(arena, ptrs + i, run);
+      i += run;
+      continue;
+    }
+
+    malloc_chunk_t *chunk = get_chunk_from_data_pointer(ptr);
+    if (chunk->chunk_size & CHUNK_MMAPPED) {
+      if (UNLIKELY(chunk->chunk_size & CHUNK_SAMPLED)) forget_sample(chunk);
+      count_free(get_chunk_size(chunk));
+      delete_mmap_chunk(chunk);
+      i++;
+      continue;
+    }
+
+    // Slab objects and mapped chunks are never within a region
+    mmap_region_t *region = get_chunk_region(chunk);
+    while (i + run < count && ptrs[i + run] != NULL &&
+           (size_t)((char *)ptrs[i + run] - (char *)region) < region->size) {
+      run++;
+    }
+    free_region_batch(arena, region, ptrs + i, run);
+    i += run;
+  }
+  unlock_arena(arena);
+}
+
+// Allocate `size` bytes aligned to `alignment`, a power of two, for the calling
+// thread. Slab objects and cached objects are only ALIGNMENT aligned, so larger
+// alignments take a chunk with room to spare, and free the space before the
+// first aligned address that leaves room for a header, and after the data
+static void *aligned_malloc(size_t alignment, size_t size) {
+  if (alignment <= ALIGNMENT) return thread_malloc(size);
+  if (size == 0) return NULL;
+
+  // Sizes and alignments of mmap_threshold or more always get a mapping, so
+  // the padding can't overflow. The size is normalized before padding, so at
+  // least a whole class size is left past the aligned address
+  size_t padded = 0;
+  if (size < mmap_threshold && alignment < mmap_threshold) {
+    padded = normalize_request(size) + alignment + MIN_SPLIT_SIZE;
+  }
+  if (padded == 0 || padded >= mmap_threshold) {
+    malloc_chunk_t *chunk = create_mmap_chunk(size, alignment);
+    if (chunk == NULL) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    count_malloc(get_chunk_size(chunk));
+    return get_chunk_data_address(chunk);
+  }
+
+  arena_t *arena = lock_arena();
+  if (UNLIKELY(arena == NULL)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  malloc_chunk_t *chunk =
+      arena_malloc_chunk(arena, normalize_request(padded), NULL);
+  if (chunk == NULL) {
+    unlock_arena(arena);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  mmap_region_t *region = get_chunk_region(chunk);
+  char *data = get_chunk_data_address(chunk);
+  char *aligned = (char *)ALIGN_UP((uintptr_t)data, alignment);
+  if (aligned != data) {
+    if ((size_t)(aligned - data) < MIN_SPLIT_SIZE) aligned += alignment;
+    chunk = trim_chunk_front(arena, region, chunk, aligned - data);
+  }
+
+  shrink_chunk(arena, region, chunk, normalize_request(size));
+  unlock_arena(arena);
+  count_malloc(get_object_size(aligned));
+  return aligned;
+}
+
+// Returns true iff `x` is a power of two
+static bool is_power_of_two(size_t x) { return x != 0 && (x & (x - 1)) == 0; }
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (!is_power_of_two(alignment) || alignment % sizeof(void *) != 0) {
+    return EINVAL;
+  }
+
+  // The error is returned rather than left in errno
+  int saved_errno = errno;
+  void *ptr = aligned_malloc(alignment, size);
+  errno = saved_errno;
+  if (ptr == NULL && size != 0) return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  if (!is_power_of_two(alignment)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return aligned_malloc(alignment, size);
+}
+
+// Like glibc, any alignment is taken, rounded up to a power of two
+void *memalign(size_t alignment, size_t size) {
+  if (alignment > SIZE_MAX / 2 + 1) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (alignment <= 1) return aligned_malloc(1, size);
+  if (!is_power_of_two(alignment)) {
+    alignment = (size_t)1 << (64 - __builtin_clzl(alignment));
+  }
+  return aligned_malloc(alignment, size);
+}
+
+void *valloc(size_t size) { return aligned_malloc(get_page_size(), size); }
+
+// Like glibc, rounds `size` up to whole pages, and to one page if it is 0
+void *pvalloc(size_t size) {
+  size_t page = get_page_size();
+  if (size > SIZE_MAX - page) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return aligned_malloc(page, size == 0 ? page : ALIGN_UP(size, page));
+}
+
+size_t malloc_usable_size(void *ptr) {
+  if (ptr == NULL) return 0;
+  return get_object_size(ptr);
+}
+
+// Calls `callback` with every arena and `arg`
+static void visit_arenas(void (*callback)(arena_t *arena, void *arg),
+                         void *arg) {
+#ifdef THREAD_ARENAS
+  for_each_arena(callback, arg);
+  size_t count = atomic_load_explicit(&num_shared_arenas, memory_order_acquire);
+  for (size_t i = 0; i < count; i++) callback(shared_arenas[i], arg);
+#else
+  callback(&main_arena, arg);
+#endif
+}
+
+// Unmap the mapped chunks and reclaim the slabs freed since the last pass
+static void reclaim_pending() {
+  malloc_chunk_t *chunk =
+      atomic_exchange_explicit(&pending_unmaps, NULL, memory_order_acquire);
+  while (chunk != NULL) {
+    malloc_chunk_t *next = *(malloc_chunk_t **)get_chunk_data_address(chunk);
+    unmap_mmap_chunk(chunk, &reclaim_stats);
+    chunk = next;
+  }
+  slab_reclaim();
+}
+
+// Decay the region cache of `arena` as its owner would without a reclaim
+// thread, and evict all but the `region_cache_count` most recently emptied
+// regions. Regions are taken out of the cache before their system calls, so
+// the owner is never held up by them, and purged ones are put back last
+static void reclaim_region_cache(arena_t *arena, void *unused) {
+  mmap_region_t *evicted = NULL;
+  mmap_region_t *purged = NULL;
+  size_t kept = 0;
+  size_t purged_bytes = 0;
+  uint64_t now = get_time_ms();
+
+  lock_region_cache(arena);
+  mmap_region_t *region = arena->cached_regions;
+  while (region != NULL) {
+    mmap_region_t *next = region->next_region;
+    uint64_t age = now - region->cached_at;
+    if (kept >= region_cache_count || age >= 2 * region_decay_ms) {
+      uncache_region(arena, region, &reclaim_stats);
+      purged_bytes += get_cached_resident_size(region);
+      region->next_region = evicted;
+      evicted = region;
+    } else {
+      kept++;
+      if (age >= region_decay_ms && !region->purged) {
+        uncache_region(arena, region, &reclaim_stats);
+        region->next_region = purged;
+        purged = region;
+      }
+    }
+    region = next;
+  }
+  unlock_region_cache(arena);
+
+  while (evicted != NULL) {
+    mmap_region_t *next = evicted->next_region;
+    stat_add(&reclaim_stats.munmap_calls, 1);
+    munmap(evicted, evicted->size);
+    evicted = next;
+  }
+  for (region = purged; region != NULL; region = region->next_region) {
+    purged_bytes += purge_cached_region(region);
+  }
+
+  lock_region_cache(arena);
+  arena->region_cache_purged_bytes += purged_bytes;
+  mmap_region_t *tail = arena->cached_regions;
+  while (tail != NULL && tail->next_region != NULL) tail = tail->next_region;
+  while (purged != NULL) {
+    mmap_region_t *next = purged->next_region;
+    purged->prev_region = tail;
+    purged->next_region = NULL;
+    if (tail == NULL) {
+      arena->cached_regions = purged;
+    } else {
+      tail->next_region = purged;
+    }
+    tail = purged;
+    arena->num_cached_regions++;
+    stat_add(&reclaim_stats.cached_region_bytes, purged->size);
+    purged = next;
+  }
+  unlock_region_cache(arena);
+}
+
+// Return everything waiting to go back to the OS
+static void reclaim_memory() {
+  reclaim_pending();
+  visit_arenas(reclaim_region_cache, NULL);
+}
+
+// Body of the reclaim thread, which passes over freed memory every
+// `reclaim_interval_ms` until told to stop
+static void *run_reclaim_thread(void *unused) {
+  pthread_mutex_lock(&reclaim_mutex);
+  while (reclaim_running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += reclaim_interval_ms / 1000;
+    deadline.tv_nsec += reclaim_interval_ms % 1000 * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_clockwait(&reclaim_cond, &reclaim_mutex, CLOCK_MONOTONIC,
+                           &deadline);
+    // Whoever stops the thread makes the last pass
+    if (reclaim_running) reclaim_memory();
+  }
+  pthread_mutex_unlock(&reclaim_mutex);
+  return NULL;
+}
+
+// Keep a fork from copying the reclaim thread's state mid-pass
+static void lock_reclaim_thread() { pthread_mutex_lock(&reclaim_mutex); }
+
+static void unlock_reclaim_thread() { pthread_mutex_unlock(&reclaim_mutex); }
+
+// The reclaim thread isn't copied into a forked child, so the child goes back
+// to returning memory itself. The region caches of other threads' arenas are
+// left alone, as their locks may have been copied held
+static void stop_reclaim_in_child() {
+  pthread_mutex_init(&reclaim_mutex, NULL);
+  pthread_cond_init(&reclaim_cond, NULL);
+  if (!reclaim_running) return;
+  reclaim_running = false;
+  atomic_store_explicit(&background_reclaim, false, memory_order_relaxed);
+  slab_defer_release(false);
+  reclaim_pending();
+}
+
+static void register_reclaim_fork_handler() {
+  pthread_atfork(lock_reclaim_thread, unlock_reclaim_thread,
+                 stop_reclaim_in_child);
+}
+
+// Start the reclaim thread with passes `interval_ms` apart, change the
+// interval if it is running, or stop it if `interval_ms` is 0. Returns false
+// if the thread couldn't be started
+static bool set_background_reclaim(size_t interval_ms) {
+  pthread_once(&reclaim_fork_handler_once, register_reclaim_fork_handler);
+  pthread_mutex_lock(&reclaim_mutex);
+  bool was_running = reclaim_running;
+  reclaim_interval_ms = interval_ms;
+  reclaim_running = interval_ms != 0;
+  pthread_cond_signal(&reclaim_cond);
+  pthread_mutex_unlock(&reclaim_mutex);
+  if (was_running == (interval_ms != 0)) return true;
+
+  if (interval_ms != 0) {
+    atomic_store_explicit(&background_reclaim, true, memory_order_relaxed);
+    slab_defer_release(true);
+    // Signals are for the program's threads
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    int error =
+        pthread_create(&reclaim_thread, NULL, run_reclaim_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (error == 0) return true;
+
+    pthread_mutex_lock(&reclaim_mutex);
+    reclaim_running = false;
+    pthread_mutex_unlock(&reclaim_mutex);
+  } else {
+    pthread_join(reclaim_thread, NULL);
+  }
+
+  atomic_store_explicit(&background_reclaim, false, memory_order_relaxed);
+  slab_defer_release(false);
+  reclaim_memory();
+  return interval_ms == 0;
+}
+
+int mallopt(int param, int value) {
+  if (value < 0) return 0;
+
+  switch (param) {
+    case M_TCACHE_COUNT:
+      tcache_count = value;
+      return 1;
+    case M_TCACHE_MAX_SIZE:
+      if (value > MAX_TCACHE_SIZE) return 0;
+      tcache_classes = value == 0 ? 0 : size_to_class_ceil(value) + 1;
+      tcache_size_limit = value == 0 ? 0 : class_to_size(tcache_classes);
+      return 1;
+    case M_MMAP_THRESHOLD:
+      // Larger requests than the largest size class always get a mapping
+      if ((size_t)value > MAX_CLASS_SIZE) return 0;
+      mmap_threshold = value;
+      return 1;
+    case M_REGION_CACHE_COUNT:
+      region_cache_count = value;
+      return 1;
+    case M_REGION_DECAY_MS:
+      region_decay_ms = value;
+      return 1;
+    case M_TCACHE_BATCH:
+      if (value == 0) return 0;
+      tcache_batch = value;
+      return 1;
+    case M_PROFILE_SAMPLE_BYTES:
+      // Other threads pick the new rate up at their next sample, or within
+      // PROFILE_RECHECK_BYTES of allocation if profiling was off
+      if (value != 0) profile_enable(value);
+      profile_sample_bytes = value;
+      sampler_started = value != 0;
+      bytes_until_sample =
+          value == 0 ? PROFILE_RECHECK_BYTES : profile_next_sample(value);
+      return 1;
+    case M_PROFILE_SIGNAL:
+      return profile_set_signal(value);
+    case M_HUGE_PAGES:
+      if (value > HUGE_PAGES_EXPLICIT) return 0;
+      // Slabs only get transparent huge pages, as an explicit one can't be
+      // reserved for the zone without backing all of it. Regions fall back
+      // on their own
+      slab_zone_set_huge_pages(value != HUGE_PAGES_OFF);
+      huge_pages = value;
+      return 1;
+    case M_REGION_MIN_SIZE:
+    case M_REGION_MAX_SIZE:
+    case M_REGION_SIZE_DECAY_MS:
+      // Read first, so the environment can't override this later
+      configure_region_sizes();
+      return set_region_size_param(param, value);
+    case M_BACKGROUND_RECLAIM:
+      return set_background_reclaim(value);
+    case M_ARENAS_PER_CPU:
+#ifdef THREAD_ARENAS
+      return set_arenas_per_cpu(value);
+#else
+      return 0;
+#endif
+    default:
+      return 0;
   }
 }
 
-// int main() {
-//   printf("start test\n");
-//   void *ptr = malloc(8000);
-//   void *ptr2 = malloc(8000);
-//   void *ptr3 = malloc(4000);
-//   printf("Got %p, %p, %p\n", (void *)ptr, (void *)ptr2, (void *)ptr3);
-//   print_regions();
+void *malloc_region_alloc(size_t size, size_t *capacity) {
+  if (size > MAX_REGION_SIZE) return NULL;
+  arena_t *arena = lock_arena();
+  if (arena == NULL) return NULL;
+  mmap_region_t *region = take_region(arena, size);
+  unlock_arena(arena);
+  if (region == NULL) return NULL;
+  *capacity = region->size - REGION_HEADER_SIZE;
+  return (char *)region + REGION_HEADER_SIZE;
+}
 
-//   free(ptr2);
-//   print_regions();
-//   free(ptr3);
-//   print_regions();
-//   free(ptr);
-//   print_regions();
+void malloc_region_free(void *ptr) {
+  if (ptr == NULL) return;
+  arena_t *arena = lock_arena();
+  retire_region(arena, (mmap_region_t *)((char *)ptr - REGION_HEADER_SIZE));
+  unlock_arena(arena);
+}
+
+void malloc_tcache_stats(size_t *hits, size_t *misses) {
+  *hits = tcache.hits;
+  *misses = tcache.misses;
+}
+
+void malloc_region_cache_stats(size_t *hits, size_t *misses,
+                               size_t *purged_bytes) {
+  arena_t *arena = lock_arena();
+  if (arena == NULL) {
+    *hits = *misses = *purged_bytes = 0;
+    return;
+  }
+  *hits = arena->region_cache_hits;
+  *misses = arena->region_cache_misses;
+  lock_region_cache(arena);
+  *purged_bytes = arena->region_cache_purged_bytes;
+  unlock_region_cache(arena);
+  unlock_arena(arena);
+}
+
+// Add `counters` to `stats`. Gauges of one arena, or of the reclaim thread,
+// may have wrapped below zero, but the sums come out right
+static void add_stats(malloc_stats_t *stats, arena_stats_t *counters) {
+#define READ(counter) \
+  atomic_load_explicit(&counters->counter, memory_order_relaxed)
+  stats->allocated_bytes += READ(malloc_bytes) - READ(free_bytes);
+  stats->slab_bytes += READ(slab_bytes);
+  stats->region_bytes += READ(region_bytes);
+  stats->cached_region_bytes += READ(cached_region_bytes);
+  stats->huge_region_bytes += READ(huge_region_bytes);
+  stats->mmap_chunk_bytes += READ(mmap_chunk_bytes);
+  stats->regions += READ(regions);
+  stats->mmap_chunks += READ(mmap_chunks);
+  stats->free_chunks += READ(free_chunks);
+  stats->mmap_calls += READ(mmap_calls);
+  stats->munmap_calls += READ(munmap_calls);
+  stats->mremap_calls += READ(mremap_calls);
+  stats->free_list_searches += READ(free_list_searches);
+  stats->free_list_search_steps += READ(free_list_search_steps);
+  for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+    stats->mallocs[i] += READ(mallocs[i]);
+    stats->frees[i] += READ(frees[i]);
+  }
+#undef READ
+}
+
+// Add the counters of `arena` to the malloc_stats_t at `arg`
+static void add_arena_stats(arena_t *arena, void *arg) {
+  add_stats(arg, &arena->stats);
+}
+
+void malloc_get_stats(malloc_stats_t *stats) {
+  memset(stats, 0, sizeof(malloc_stats_t));
+  visit_arenas(add_arena_stats, stats);
+  add_stats(stats, &reclaim_stats);
+#ifdef THREAD_ARENAS
+  add_stats(stats, &arenaless_stats);
+  stats->shared_arenas =
+      atomic_load_explicit(&num_shared_arenas, memory_order_relaxed);
+  stats->arena_contentions =
+      atomic_load_explicit(&arena_contentions, memory_order_relaxed);
+  stats->arena_migrations =
+      atomic_load_explicit(&arena_migrations, memory_order_relaxed);
+#endif
+
+  stats->active_bytes =
+      stats->slab_bytes + stats->region_bytes + stats->mmap_chunk_bytes;
+  stats->mapped_bytes = stats->active_bytes + stats->cached_region_bytes;
+  for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+    stats->class_sizes[i] = class_to_size(i);
+  }
+}
+
+struct mallinfo2 mallinfo2() {
+  malloc_stats_t stats;
+  malloc_get_stats(&stats);
+
+  // Mapped chunks are counted by their usable size both as allocations and as
+  // mapped chunk bytes, so the difference is what is allocated in the arenas
+  struct mallinfo2 info;
+  memset(&info, 0, sizeof(info));
+  info.arena = stats.slab_bytes + stats.region_bytes;
+  info.ordblks = stats.free_chunks;
+  info.hblks = stats.mmap_chunks;
+  info.hblkhd = stats.mmap_chunk_bytes;
+  info.uordblks = stats.allocated_bytes - stats.mmap_chunk_bytes;
+  info.fordblks = info.arena - info.uordblks;
+  info.keepcost = stats.cached_region_bytes;
+  return info;
+}
+
+// Write the formatted line to stderr. stdio may allocate, so it is formatted on
+// the stack and written directly
+__attribute__((format(printf, 1, 2))) static void print_stat(const char *fmt,
+                                                             ...) {
+  char line[256];
+  va_list args;
+  va_start(args, fmt);
+  int length = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+  if (length > 0) {
+    write(STDERR_FILENO, line, MIN((size_t)length, sizeof(line) - 1));
+  }
+}
+
+void malloc_stats() {
+  malloc_stats_t stats;
+  malloc_get_stats(&stats);
+
+  print_stat("allocated bytes:     %lu\n", stats.allocated_bytes);
+  print_stat("active bytes:        %lu\n", stats.active_bytes);
+  print_stat("mapped bytes:        %lu\n", stats.mapped_bytes);
+  print_stat("  slabs:             %lu\n", stats.slab_bytes);
+  print_stat("  regions:           %lu in %lu regions\n", stats.region_bytes,
+             stats.regions);
+  print_stat("    huge pages:      %lu\n", stats.huge_region_bytes);
+  print_stat("  cached regions:    %lu\n", stats.cached_region_bytes);
+  print_stat("  mapped chunks:     %lu in %lu chunks\n",
+             stats.mmap_chunk_bytes, stats.mmap_chunks);
+  print_stat("free chunks:         %lu\n", stats.free_chunks);
+  print_stat("mmap calls:          %lu\n", stats.mmap_calls);
+  print_stat("munmap calls:        %lu\n", stats.munmap_calls);
+  print_stat("mremap calls:        %lu\n", stats.mremap_calls);
+  print_stat("free list searches:  %lu, %.2f chunks each\n",
+             stats.free_list_searches,
+             stats.free_list_searches == 0
+                 ? 0.0
+                 : (double)stats.free_list_search_steps /
+                       stats.free_list_searches);
+  print_stat("shared arenas:       %lu, %lu contended, %lu migrations\n",
+             stats.shared_arenas, stats.arena_contentions,
+             stats.arena_migrations);
+
+  print_stat("%10s %12s %12s %12s\n", "size", "mallocs", "frees", "live");
+  for (size_t i = 0; i < MALLOC_STATS_CLASSES; i++) {
+    if (stats.mallocs[i] == 0 && stats.frees[i] == 0) continue;
+    print_stat("%10lu %12lu %12lu %12ld\n", stats.class_sizes[i],
+               stats.mallocs[i], stats.frees[i],
+               (long)(stats.mallocs[i] - stats.frees[i]));
+  }
+}
 
-//   ptr = malloc(8000);
-//   print_regions();
-// }
\ No newline at end of file
+int malloc_profile_write(const char *path) { return profile_write(path); }
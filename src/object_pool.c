@@ -0,0 +1,220 @@
+// Object pools: objects of one size are carved out of blocks mapped for the
+// pool alone, and freed objects are linked through their first word in their
+// block's free list. A block is aligned to its size, so the block an object
+// belongs to is found by masking its address, as a slab's is
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "naive_malloc.h"
+
+// Blocks are at least this size, and large enough for MIN_BLOCK_OBJECTS
+// objects
+#define MIN_BLOCK_SIZE ((size_t)64 * 1024)
+#define MIN_BLOCK_OBJECTS 16
+#define MAX_OBJECT_SIZE ((size_t)1 << 20)
+#define MAX_ALIGNMENT 4096
+#define DEFAULT_ALIGNMENT 16
+// Empty blocks a pool keeps for reuse, so a pool that keeps emptying and
+// refilling a block doesn't map and unmap it every time
+#define EMPTY_BLOCKS_KEPT 1
+
+#define ALIGN_UP(x, a) (((x) + (a)-1) & ~((size_t)(a)-1))
+#define UNLIKELY(x) __builtin_expect(x, 0)
+
+typedef struct pool_block pool_block_t;
+struct pool_block {
+  // Neighbours in the pool's list of all its blocks
+  pool_block_t *prev_block;
+  pool_block_t *next_block;
+  // Neighbours in the pool's list of blocks with free slots
+  pool_block_t *prev_available;
+  pool_block_t *next_available;
+
+  // Freed objects, linked through their first word
+  void *free_list;
+  // Slots from here on have never been handed out, so they are carved off in
+  // order without touching their pages beforehand
+  char *unused;
+  // Objects handed out and not freed
+  size_t used;
+};
+
+struct object_pool {
+  // Size of each slot, the object size rounded up to the alignment, and the
+  // size of the blocks slots are carved from
+  size_t slot_size;
+  size_t block_size;
+  // Offset of the first slot from the start of a block
+  size_t slots_offset;
+  size_t slots_per_block;
+
+  pool_block_t *blocks;
+  // Blocks with free slots, which a block with none leaves. Objects are
+  // allocated from the head
+  pool_block_t *available;
+  // Blocks in `available` with no objects in use
+  size_t empty_blocks;
+
+  pool_stats_t stats;
+};
+
+static inline pool_block_t *get_block(object_pool_t *pool, void *ptr) {
+  uintptr_t mask = pool->block_size - 1;
+  return (pool_block_t *)((uintptr_t)ptr & ~mask);
+}
+
+object_pool_t *pool_create(size_t object_size, size_t alignment) {
+  if (alignment == 0) alignment = DEFAULT_ALIGNMENT;
+  if ((alignment & (alignment - 1)) != 0 || alignment > MAX_ALIGNMENT ||
+      object_size > MAX_OBJECT_SIZE) {
+    return NULL;
+  }
+  object_pool_t *pool = malloc(sizeof(object_pool_t));
+  if (pool == NULL) return NULL;
+
+  pool->stats = (pool_stats_t){.object_size = object_size};
+  // A free slot holds its free list link
+  if (object_size < sizeof(void *)) object_size = sizeof(void *);
+  if (alignment < sizeof(void *)) alignment = sizeof(void *);
+  pool->slot_size = ALIGN_UP(object_size, alignment);
+  pool->slots_offset = ALIGN_UP(sizeof(pool_block_t), alignment);
+  pool->block_size = MIN_BLOCK_SIZE;
+  while (pool->block_size <
+         pool->slots_offset + MIN_BLOCK_OBJECTS * pool->slot_size) {
+    pool->block_size *= 2;
+  }
+  pool->slots_per_block =
+      (pool->block_size - pool->slots_offset) / pool->slot_size;
+  pool->blocks = NULL;
+  pool->available = NULL;
+  pool->empty_blocks = 0;
+  pool->stats.slot_size = pool->slot_size;
+  pool->stats.block_size = pool->block_size;
+  return pool;
+}
+
+// Map a block aligned to its size, by mapping twice as much and unmapping what
+// lies outside it. Returns NULL if there is no memory left
+static pool_block_t *map_block(object_pool_t *pool) {
+  size_t size = pool->block_size;
+  char *ptr = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  pool->stats.mmap_calls++;
+  if (ptr == MAP_FAILED) return NULL;
+  char *start = (char *)ALIGN_UP((uintptr_t)ptr, size);
+  if (start != ptr) {
+    munmap(ptr, start - ptr);
+    pool->stats.munmap_calls++;
+  }
+  if (start + size != ptr + 2 * size) {
+    munmap(start + size, ptr + 2 * size - (start + size));
+    pool->stats.munmap_calls++;
+  }
+
+  pool_block_t *block = (pool_block_t *)start;
+  block->free_list = NULL;
+  block->unused = start + pool->slots_offset;
+  block->used = 0;
+
+  block->prev_block = NULL;
+  block->next_block = pool->blocks;
+  if (pool->blocks != NULL) pool->blocks->prev_block = block;
+  pool->blocks = block;
+  pool->stats.blocks++;
+  return block;
+}
+
+static void unlink_available(object_pool_t *pool, pool_block_t *block) {
+  if (block->prev_available != NULL) {
+    block->prev_available->next_available = block->next_available;
+  } else {
+    pool->available = block->next_available;
+  }
+  if (block->next_available != NULL) {
+    block->next_available->prev_available = block->prev_available;
+  }
+}
+
+static void push_available(object_pool_t *pool, pool_block_t *block) {
+  block->prev_available = NULL;
+  block->next_available = pool->available;
+  if (pool->available != NULL) pool->available->prev_available = block;
+  pool->available = block;
+}
+
+// Unmap the empty `block`, which is in no list but the list of all blocks
+static void unmap_block(object_pool_t *pool, pool_block_t *block) {
+  if (block->prev_block != NULL) {
+    block->prev_block->next_block = block->next_block;
+  } else {
+    pool->blocks = block->next_block;
+  }
+  if (block->next_block != NULL) {
+    block->next_block->prev_block = block->prev_block;
+  }
+  pool->stats.blocks--;
+  pool->stats.munmap_calls++;
+  munmap(block, pool->block_size);
+}
+
+// Map a block to allocate from, as every block is full
+static void *pool_alloc_slow(object_pool_t *pool) {
+  pool_block_t *block = map_block(pool);
+  if (block == NULL) return NULL;
+  push_available(pool, block);
+  pool->empty_blocks++;
+  return pool_alloc(pool);
+}
+
+void *pool_alloc(object_pool_t *pool) {
+  pool_block_t *block = pool->available;
+  if (UNLIKELY(block == NULL)) return pool_alloc_slow(pool);
+  void *ptr = block->free_list;
+  if (ptr != NULL) {
+    block->free_list = *(void **)ptr;
+  } else {
+    ptr = block->unused;
+    block->unused += pool->slot_size;
+  }
+  if (block->used++ == 0) pool->empty_blocks--;
+  // A full block leaves the list until an object in it is freed
+  if (UNLIKELY(block->used == pool->slots_per_block)) {
+    unlink_available(pool, block);
+  }
+  pool->stats.allocs++;
+  return ptr;
+}
+
+void pool_free(object_pool_t *pool, void *ptr) {
+  if (ptr == NULL) return;
+  pool_block_t *block = get_block(pool, ptr);
+  *(void **)ptr = block->free_list;
+  block->free_list = ptr;
+  pool->stats.frees++;
+
+  // A full block has free slots again
+  if (block->used == pool->slots_per_block) push_available(pool, block);
+  if (--block->used == 0) {
+    if (pool->empty_blocks < EMPTY_BLOCKS_KEPT) {
+      pool->empty_blocks++;
+    } else {
+      unlink_available(pool, block);
+      unmap_block(pool, block);
+    }
+  }
+}
+
+void pool_destroy(object_pool_t *pool) {
+  if (pool == NULL) return;
+  while (pool->blocks != NULL) unmap_block(pool, pool->blocks);
+  free(pool);
+}
+
+void pool_get_stats(object_pool_t *pool, pool_stats_t *stats) {
+  *stats = pool->stats;
+  stats->objects = pool->stats.allocs - pool->stats.frees;
+  stats->block_bytes = pool->stats.blocks * pool->block_size;
+  stats->empty_blocks = pool->empty_blocks;
+}
@@ -0,0 +1,107 @@
+// C++ allocation functions on top of the malloc family, so programs that use
+// new and delete allocate from this allocator too when it is preloaded
+
+#include <cstdlib>
+#include <new>
+
+// From naive_malloc.h, whose declarations of the rest of the malloc family
+// would clash with those of <cstdlib>
+extern "C" void free_sized(void *ptr, std::size_t size) noexcept;
+
+namespace {
+
+// Allocate like the standard operator new: on failure, call the new handler
+// and retry, or throw std::bad_alloc if there is none
+void *allocate(std::size_t size, std::size_t alignment) {
+  // new must hand out a unique pointer even for zero bytes
+  if (size == 0) size = 1;
+
+  while (true) {
+    void *ptr = nullptr;
+    if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+      ptr = std::malloc(size);
+    } else if (posix_memalign(&ptr, alignment, size) != 0) {
+      ptr = nullptr;
+    }
+    if (ptr != nullptr) return ptr;
+
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) throw std::bad_alloc();
+    handler();
+  }
+}
+
+void *allocate_nothrow(std::size_t size, std::size_t alignment) noexcept {
+  try {
+    return allocate(size, alignment);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+const std::size_t DEFAULT_ALIGNMENT = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+}  // namespace
+
+void *operator new(std::size_t size) {
+  return allocate(size, DEFAULT_ALIGNMENT);
+}
+void *operator new[](std::size_t size) {
+  return allocate(size, DEFAULT_ALIGNMENT);
+}
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate_nothrow(size, DEFAULT_ALIGNMENT);
+}
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate_nothrow(size, DEFAULT_ALIGNMENT);
+}
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  return allocate(size, static_cast<std::size_t>(alignment));
+}
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return allocate(size, static_cast<std::size_t>(alignment));
+}
+void *operator new(std::size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept {
+  return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+void *operator new[](std::size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+// Every form of delete is free, as free finds the size and alignment itself.
+// Sized delete passes the size on, which saves looking it up for small objects.
+// Over-aligned objects are always chunks, whose size free reads anyway
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  std::free(ptr);
+}
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  std::free(ptr);
+}
+void operator delete(void *ptr, std::size_t size) noexcept {
+  free_sized(ptr, size);
+}
+void operator delete[](void *ptr, std::size_t size) noexcept {
+  free_sized(ptr, size);
+}
+void operator delete(void *ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+void operator delete(void *ptr, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+  std::free(ptr);
+}
+void operator delete[](void *ptr, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+  std::free(ptr);
+}
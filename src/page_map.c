@@ -0,0 +1,49 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "page_map.h"
+
+_Atomic(page_map_leaf_t *) page_map_root[(size_t)1 << PAGE_MAP_ROOT_BITS];
+
+// Returns the leaf for root entry `index`, mapping it if there is none yet, or
+// NULL if it couldn't be mapped. Threads racing to map the same leaf keep
+// whichever was installed first
+static page_map_leaf_t *get_or_create_leaf(size_t index) {
+  page_map_leaf_t *leaf =
+      atomic_load_explicit(&page_map_root[index], memory_order_acquire);
+  if (leaf != NULL) return leaf;
+
+  // Only the pages covering live regions are ever touched
+  page_map_leaf_t *new_leaf =
+      mmap(NULL, sizeof(page_map_leaf_t), PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (new_leaf == MAP_FAILED) return NULL;
+
+  if (!atomic_compare_exchange_strong_explicit(
+          &page_map_root[index], &leaf, new_leaf, memory_order_acq_rel,
+          memory_order_acquire)) {
+    munmap(new_leaf, sizeof(page_map_leaf_t));
+    return leaf;
+  }
+  return new_leaf;
+}
+
+bool page_map_set(void *start, size_t size, mmap_region_t *region) {
+  uintptr_t first = (uintptr_t)start >> PAGE_MAP_PAGE_SHIFT;
+  uintptr_t end = ((uintptr_t)start + size - 1) >> PAGE_MAP_PAGE_SHIFT;
+  if (end >> (PAGE_MAP_ROOT_BITS + PAGE_MAP_LEAF_BITS) != 0) return false;
+
+  uintptr_t leaf_mask = ((uintptr_t)1 << PAGE_MAP_LEAF_BITS) - 1;
+  page_map_leaf_t *leaf = NULL;
+  for (uintptr_t page = first; page <= end; page++) {
+    if (leaf == NULL || (page & leaf_mask) == 0) {
+      leaf = get_or_create_leaf(page >> PAGE_MAP_LEAF_BITS);
+      if (leaf == NULL) return false;
+    }
+    leaf->regions[page & leaf_mask] = region;
+  }
+  return true;
+}
@@ -0,0 +1,155 @@
+// Scoped arenas: objects that die together are bump-allocated from whole
+// regions of the calling thread's arena (see malloc_region_alloc) and freed all
+// at once. The arena's own header lives in its first region
+
+#include <stdint.h>
+
+#include "naive_malloc.h"
+
+// Regions smaller than this aren't worth taking
+#define MIN_REGION_SIZE 4096
+#define DEFAULT_ALIGNMENT 16
+
+#define UNLIKELY(x) __builtin_expect(x, 0)
+
+// The start of each region an arena holds
+typedef struct scoped_region scoped_region_t;
+struct scoped_region {
+  // The region taken after this one, if any
+  scoped_region_t *next;
+  // End of its usable bytes
+  char *end;
+};
+
+struct scoped_arena {
+  // Regions held, in the order they were taken. `first` also holds this
+  // header, right after its scoped_region_t
+  scoped_region_t *first;
+  scoped_region_t *last;
+  // The region being allocated from, and its unused bytes. Regions after it
+  // are unused since the last reset
+  scoped_region_t *current;
+  char *next;
+  char *end;
+
+  // Bytes and number of the regions held
+  size_t region_bytes;
+  size_t num_regions;
+};
+
+static inline char *align_up(char *ptr, size_t alignment) {
+  uintptr_t mask = alignment - 1;
+  return (char *)(((uintptr_t)ptr + mask) & ~mask);
+}
+
+// The first bytes of `region` free for objects
+static inline char *region_start(scoped_arena_t *arena,
+                                 scoped_region_t *region) {
+  char *start = (char *)(region + 1);
+  return region == arena->first ? start + sizeof(scoped_arena_t) : start;
+}
+
+// Take a region with room for `size` bytes after its scoped_region_t. Returns
+// NULL if there is no memory left
+static scoped_region_t *take_region(size_t size) {
+  if (size > SIZE_MAX - sizeof(scoped_region_t)) return NULL;
+  size += sizeof(scoped_region_t);
+  size_t capacity;
+  scoped_region_t *region = malloc_region_alloc(
+      size < MIN_REGION_SIZE ? MIN_REGION_SIZE : size, &capacity);
+  if (region == NULL) return NULL;
+  region->next = NULL;
+  region->end = (char *)region + capacity;
+  return region;
+}
+
+scoped_arena_t *arena_create(size_t size) {
+  if (size > SIZE_MAX - sizeof(scoped_arena_t)) return NULL;
+  scoped_region_t *region = take_region(size + sizeof(scoped_arena_t));
+  if (region == NULL) return NULL;
+
+  scoped_arena_t *arena = (scoped_arena_t *)(region + 1);
+  arena->first = region;
+  arena->last = region;
+  arena->current = region;
+  arena->next = region_start(arena, region);
+  arena->end = region->end;
+  arena->region_bytes = region->end - (char *)region;
+  arena->num_regions = 1;
+  return arena;
+}
+
+// Move on to the first region after the current one with room for `size`
+// bytes aligned to `alignment`, taking a new one if none has, and allocate
+// from it. Regions passed over stay unused until the next reset
+static void *arena_alloc_slow(scoped_arena_t *arena, size_t size,
+                              size_t alignment) {
+  for (scoped_region_t *region = arena->current->next; region != NULL;
+       region = region->next) {
+    char *ptr = align_up(region_start(arena, region), alignment);
+    if (ptr <= region->end && size <= (size_t)(region->end - ptr)) {
+      arena->current = region;
+      arena->next = ptr + size;
+      arena->end = region->end;
+      return ptr;
+    }
+  }
+
+  if (size > SIZE_MAX - alignment) return NULL;
+  scoped_region_t *region = take_region(size + alignment);
+  if (region == NULL) return NULL;
+  arena->last->next = region;
+  arena->last = region;
+  arena->region_bytes += region->end - (char *)region;
+  arena->num_regions++;
+
+  char *ptr = align_up(region_start(arena, region), alignment);
+  arena->current = region;
+  arena->next = ptr + size;
+  arena->end = region->end;
+  return ptr;
+}
+
+void *arena_alloc(scoped_arena_t *arena, size_t size, size_t alignment) {
+  if (alignment == 0) alignment = DEFAULT_ALIGNMENT;
+  if ((alignment & (alignment - 1)) != 0) return NULL;
+  // Zero bytes still get an address of their own
+  if (size == 0) size = 1;
+
+  char *ptr = align_up(arena->next, alignment);
+  if (UNLIKELY(ptr > arena->end || size > (size_t)(arena->end - ptr))) {
+    return arena_alloc_slow(arena, size, alignment);
+  }
+  arena->next = ptr + size;
+  return ptr;
+}
+
+void arena_reset(scoped_arena_t *arena) {
+  arena->current = arena->first;
+  arena->next = region_start(arena, arena->first);
+  arena->end = arena->first->end;
+}
+
+void arena_destroy(scoped_arena_t *arena) {
+  if (arena == NULL) return;
+  // The first region holds the arena, so it goes last
+  scoped_region_t *region = arena->first->next;
+  while (region != NULL) {
+    scoped_region_t *next = region->next;
+    malloc_region_free(region);
+    region = next;
+  }
+  malloc_region_free(arena->first);
+}
+
+void arena_get_stats(scoped_arena_t *arena, size_t *used_bytes,
+                     size_t *region_bytes, size_t *regions) {
+  size_t used = 0;
+  for (scoped_region_t *region = arena->first; region != arena->current;
+       region = region->next) {
+    used += region->end - region_start(arena, region);
+  }
+  *used_bytes = used + (arena->next - region_start(arena, arena->current));
+  *region_bytes = arena->region_bytes;
+  *regions = arena->num_regions;
+}
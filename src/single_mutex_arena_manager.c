@@ -5,57 +5,67 @@
 
 #include "arena_manager.h"
 
-// Store tightly packed arenas in space created with sbrk. Binary search for
-// arenas on demand. O(n) insertion. Don't bother deleting entries on deletion.
+// Store tightly packed pointers to arenas in space created with sbrk, sorted by
+// thread id. Binary search for arenas on demand. O(n) insertion. The arenas
+// themselves are never moved, so pointers to them stay valid. A deleted arena
+// leaves the array for a list of arenas waiting to be adopted, from which new
+// threads take theirs before creating one.
 
 #define MIN_ARENAS 32
 #define UNLIKELY(x) __builtin_expect(x, 0)
 
 static size_t num_arenas = 0;
 static size_t arenas_capacity = 0;
-static arena_t *arenas_head = NULL;
+static arena_t **arenas_head = NULL;
+// Deleted arenas, linked through `next_orphan`
+static arena_t *orphans = NULL;
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void init_arena_array() {
-  arenas_head = sbrk(sizeof(arena_t) * MIN_ARENAS);
+  arenas_head = sbrk(sizeof(arena_t *) * MIN_ARENAS);
   arenas_capacity = MIN_ARENAS;
 }
 
-// `addr` is where the user would like a new arena to be created.
-static void create_arena(arena_t *addr, pid_t thread_id) {
+// `addr` is where the user would like a pointer to a new arena to be inserted.
+// Returns where the pointer ended up, as the array may have to move to grow.
+static arena_t **create_arena(arena_t **addr, pid_t thread_id) {
   // First, ensure that addr is safe to write to.
   if (UNLIKELY(num_arenas >= arenas_capacity)) {
-    // Double capacity
-    sbrk(sizeof(arena_t) * num_arenas);
+    // Double capacity. Arenas are also allocated with sbrk, so the array can't
+    // be extended in place
+    arena_t **new_head = sbrk(sizeof(arena_t *) * arenas_capacity * 2);
+    memcpy(new_head, arenas_head, sizeof(arena_t *) * num_arenas);
+    addr = new_head + (addr - arenas_head);
+    arenas_head = new_head;
     arenas_capacity *= 2;
   }
 
-  // Copy arenas one by one, one slot to the right.
-  arena_t *dest = arenas_head + num_arenas;
-  while (dest > addr) {
-    arena_t *src = dest - 1;
-    memcpy(dest, src, sizeof(arena_t));
-    dest--;
-  }
+  // Shift pointers one slot to the right.
+  memmove(addr + 1, addr, sizeof(arena_t *) * (arenas_head + num_arenas - addr));
 
   num_arenas++;
-  // Initialize the arena at `addr`
-  addr->free_head = NULL;
-  addr->free_tail = NULL;
-  addr->regions_start = NULL;
-  addr->regions_end = NULL;
-  addr->thread_id = thread_id;
+  if (orphans != NULL) {
+    // Adopt a deleted arena, keeping what it holds
+    *addr = orphans;
+    orphans = orphans->next_orphan;
+  } else {
+    // Initialize the arena at `addr`. All bins start out empty
+    *addr = sbrk(sizeof(arena_t));
+    memset(*addr, 0, sizeof(arena_t));
+  }
+  (*addr)->thread_id = thread_id;
+  return addr;
 }
 
-static arena_t *binary_search_helper(arena_t *start, arena_t *end,
-                                     pid_t thread_id) {
+static arena_t **binary_search_helper(arena_t **start, arena_t **end,
+                                      pid_t thread_id) {
   if (start == end) {
     // Equivalent to return start->thread_id >= thread_id ? start : start + 1;
-    return start + (1 - (start->thread_id >= thread_id));
+    return start + (1 - ((*start)->thread_id >= thread_id));
   }
 
-  arena_t *mid = start + (end - start) / 2;
-  if (mid->thread_id < thread_id) {
+  arena_t **mid = start + (end - start) / 2;
+  if ((*mid)->thread_id < thread_id) {
     // This branch is never reached if mid + 1 > end because we know the answer
     // is in this array.
     return binary_search_helper(mid + 1, end, thread_id);
@@ -68,38 +78,47 @@ static arena_t *binary_search_helper(arena_t *start, arena_t *end,
 // `thread_id` between `start` and `end` inclusive. Requires `start` and `end`
 // not NULL and `end` > `start. If no arenas have id >= `thread_id`, returns a
 // pointer one past `end`.
-static arena_t *binary_search(arena_t *start, arena_t *end, pid_t thread_id) {
-  if (end->thread_id < thread_id) {
+static arena_t **binary_search(arena_t **start, arena_t **end,
+                               pid_t thread_id) {
+  if ((*end)->thread_id < thread_id) {
     return end + 1;
   }
 
   return binary_search_helper(start, end, thread_id);
 }
 
-static arena_t *get_arena_pointer(pid_t thread_id) {
-  if (UNLIKELY(arenas_head == NULL)) {
-    // No arenas exist yet
-    init_arena_array();
-    create_arena(arenas_head, thread_id);
-    return arenas_head;
+// Requires `lock` to be held
+static arena_t *find_or_create_arena(pid_t thread_id) {
+  if (UNLIKELY(arenas_head == NULL)) init_arena_array();
+  if (UNLIKELY(num_arenas == 0)) {
+    // No arenas exist yet, or every one has been deleted
+    return *create_arena(arenas_head, thread_id);
   }
 
-  arena_t *last_arena = arenas_head + num_arenas - 1;
-  arena_t *first_gte = binary_search(arenas_head, last_arena, thread_id);
+  arena_t **last_arena = arenas_head + num_arenas - 1;
+  arena_t **first_gte = binary_search(arenas_head, last_arena, thread_id);
 
-  if (first_gte > last_arena || first_gte->thread_id != thread_id) {
+  if (first_gte > last_arena || (*first_gte)->thread_id != thread_id) {
     // No such arena for this thread exists, and we should insert it here and
     // shift everything back.
-    create_arena(first_gte, thread_id);
+    first_gte = create_arena(first_gte, thread_id);
   }
 
-  return first_gte;
+  return *first_gte;
 }
 
 arena_t get_arena(pid_t thread_id) {
   pthread_mutex_lock(&lock);
 
-  arena_t ret = *get_arena_pointer(thread_id);
+  arena_t ret = *find_or_create_arena(thread_id);
+  pthread_mutex_unlock(&lock);
+  return ret;
+}
+
+arena_t *get_arena_pointer(pid_t thread_id) {
+  pthread_mutex_lock(&lock);
+
+  arena_t *ret = find_or_create_arena(thread_id);
   pthread_mutex_unlock(&lock);
   return ret;
 }
@@ -107,8 +126,9 @@ arena_t get_arena(pid_t thread_id) {
 int set_arena(pid_t thread_id, arena_t *new_value) {
   pthread_mutex_lock(&lock);
 
-  arena_t *dest = get_arena_pointer(thread_id);
+  arena_t *dest = find_or_create_arena(thread_id);
   if (UNLIKELY(thread_id != new_value->thread_id)) {
+    pthread_mutex_unlock(&lock);
     return -1;
   }
 
@@ -118,4 +138,35 @@ int set_arena(pid_t thread_id, arena_t *new_value) {
   return 0;
 }
 
-void delete_arena(pid_t thread_id) {}
+void for_each_arena(void (*callback)(arena_t *arena, void *arg), void *arg) {
+  pthread_mutex_lock(&lock);
+  for (size_t i = 0; i < num_arenas; i++) {
+    callback(arenas_head[i], arg);
+  }
+  for (arena_t *arena = orphans; arena != NULL; arena = arena->next_orphan) {
+    callback(arena, arg);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void delete_arena(pid_t thread_id) {
+  pthread_mutex_lock(&lock);
+  if (num_arenas == 0) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  arena_t **last_arena = arenas_head + num_arenas - 1;
+  arena_t **found = binary_search(arenas_head, last_arena, thread_id);
+  if (found <= last_arena && (*found)->thread_id == thread_id) {
+    arena_t *arena = *found;
+    // Shift pointers one slot to the left
+    memmove(found, found + 1, sizeof(arena_t *) * (last_arena - found));
+    num_arenas--;
+
+    arena->thread_id = 0;
+    arena->next_orphan = orphans;
+    orphans = arena;
+  }
+  pthread_mutex_unlock(&lock);
+}
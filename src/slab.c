@@ -0,0 +1,399 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+
+// Address space reserved for slabs. Only backed once slabs are handed out, and
+// halved until the reservation succeeds on systems that limit overcommit. It
+// starts on a huge page boundary, so slabs handed out one after another share
+// huge pages if those are turned on
+#define SLAB_ZONE_SIZE ((size_t)1 << 36)
+#define MIN_SLAB_ZONE_SIZE ((size_t)1 << 30)
+
+#define ALIGNMENT 16
+#define ALIGN_UP(x, a) (((x) + (a)-1) & ~((size_t)(a)-1))
+#define UNLIKELY(x) __builtin_expect(x, 0)
+
+char *slab_zone_start = NULL;
+_Atomic size_t slab_zone_size = 0;
+
+static pthread_once_t slab_zone_once = PTHREAD_ONCE_INIT;
+// Slabs below this offset into the zone have been handed out at some point
+static atomic_size_t slab_zone_used = 0;
+// Set iff the zone is advised to be backed by transparent huge pages, see
+// slab_zone_set_huge_pages
+static atomic_bool slab_huge_pages = false;
+
+// Empty slabs given back by arenas, linked through `next_slab`. Their pages
+// have been returned to the OS already, unless the zone has huge pages. A
+// lock-free stack, so the allocator holds no lock a fork could leave locked in
+// the child. Slabs are SLAB_SIZE aligned, so the low bits of the head hold a
+// counter that changes on every update, which keeps a pop from succeeding on a
+// head that was popped and pushed back in the meantime
+static _Atomic uintptr_t free_slabs = 0;
+#define FREE_SLABS_TAG_MASK (SLAB_SIZE - 1)
+
+// Set iff emptied slabs wait in `pending_slabs` for slab_reclaim, see
+// slab_defer_release
+static atomic_bool defer_release = false;
+// Empty slabs whose pages are yet to be returned, linked through `next_slab`.
+// Only ever emptied all at once, so pushes can't be confused by a pop
+static _Atomic(slab_t *) pending_slabs = NULL;
+
+// Set in the low bit of a slab's `remote_frees` by the push that queues the
+// slab, and cleared when its owner takes the list. Objects are at least
+// ALIGNMENT aligned, so the bit is never part of their address
+#define REMOTE_QUEUED ((uintptr_t)1)
+
+static void init_slab_zone() {
+  for (size_t size = SLAB_ZONE_SIZE; size >= MIN_SLAB_ZONE_SIZE; size /= 2) {
+    // Over-allocate by a huge page so the zone can start on a huge page
+    // boundary, which is a slab boundary as well
+    char *ptr = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) continue;
+
+    slab_zone_start = (char *)ALIGN_UP((uintptr_t)ptr, HUGE_PAGE_SIZE);
+    // Publish the size last, so a non-zero size implies a valid start
+    atomic_store_explicit(&slab_zone_size, size, memory_order_release);
+    return;
+  }
+}
+
+// Returns the offset of the first slot in a slab with `num_slots` slots
+static size_t get_slots_offset(size_t num_slots) {
+  return ALIGN_UP(sizeof(slab_t) + (num_slots + 63) / 64 * sizeof(uint64_t),
+                  ALIGNMENT);
+}
+
+// Returns an unused slab, or NULL if the zone is exhausted
+static slab_t *get_empty_slab() {
+  pthread_once(&slab_zone_once, init_slab_zone);
+
+  uintptr_t head = atomic_load_explicit(&free_slabs, memory_order_acquire);
+  while ((head & ~FREE_SLABS_TAG_MASK) != 0) {
+    // `slab` may be popped and reused meanwhile, making `next` garbage, but
+    // then the tag has changed and the exchange fails. The zone is never
+    // unmapped, so the read itself is safe
+    slab_t *slab = (slab_t *)(head & ~FREE_SLABS_TAG_MASK);
+    uintptr_t next = (uintptr_t)slab->next_slab;
+    uintptr_t new_head = next | ((head + 1) & FREE_SLABS_TAG_MASK);
+    if (atomic_compare_exchange_weak_explicit(&free_slabs, &head, new_head,
+                                              memory_order_acquire,
+                                              memory_order_acquire)) {
+      return slab;
+    }
+  }
+
+  size_t zone_size =
+      atomic_load_explicit(&slab_zone_size, memory_order_acquire);
+  size_t offset =
+      atomic_fetch_add_explicit(&slab_zone_used, SLAB_SIZE,
+                                memory_order_relaxed);
+  if (UNLIKELY(offset >= zone_size)) return NULL;
+  return (slab_t *)(slab_zone_start + offset);
+}
+
+// Return the pages of the empty `slab` to the OS and make it available to any
+// arena. With huge pages, giving back part of one would split it into normal
+// pages, so the slab keeps its pages until it is reused
+static void reclaim_slab(slab_t *slab) {
+  if (!atomic_load_explicit(&slab_huge_pages, memory_order_relaxed)) {
+    madvise(slab, SLAB_SIZE, MADV_DONTNEED);
+  }
+
+  uintptr_t head = atomic_load_explicit(&free_slabs, memory_order_relaxed);
+  uintptr_t new_head;
+  do {
+    slab->next_slab = (slab_t *)(head & ~FREE_SLABS_TAG_MASK);
+    new_head = (uintptr_t)slab | ((head + 1) & FREE_SLABS_TAG_MASK);
+  } while (!atomic_compare_exchange_weak_explicit(
+      &free_slabs, &head, new_head, memory_order_release,
+      memory_order_relaxed));
+}
+
+// Give the empty `slab` up, right away or through slab_reclaim if release is
+// deferred
+static void release_slab(slab_t *slab) {
+  if (!atomic_load_explicit(&defer_release, memory_order_relaxed)) {
+    reclaim_slab(slab);
+    return;
+  }
+
+  slab_t *head = atomic_load_explicit(&pending_slabs, memory_order_relaxed);
+  do {
+    slab->next_slab = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &pending_slabs, &head, slab, memory_order_release,
+      memory_order_relaxed));
+}
+
+size_t slab_reclaim() {
+  slab_t *slab =
+      atomic_exchange_explicit(&pending_slabs, NULL, memory_order_acquire);
+  size_t count = 0;
+  while (slab != NULL) {
+    slab_t *next = slab->next_slab;
+    reclaim_slab(slab);
+    slab = next;
+    count++;
+  }
+  return count;
+}
+
+void slab_defer_release(bool enabled) {
+  atomic_store_explicit(&defer_release, enabled, memory_order_relaxed);
+  if (!enabled) slab_reclaim();
+}
+
+bool slab_zone_set_huge_pages(bool enabled) {
+  pthread_once(&slab_zone_once, init_slab_zone);
+  size_t zone_size =
+      atomic_load_explicit(&slab_zone_size, memory_order_acquire);
+  if (zone_size == 0) return false;
+
+#ifdef MADV_HUGEPAGE
+  if (madvise(slab_zone_start, zone_size,
+              enabled ? MADV_HUGEPAGE : MADV_NOHUGEPAGE) != 0) {
+    return false;
+  }
+  atomic_store_explicit(&slab_huge_pages, enabled, memory_order_relaxed);
+  return true;
+#else
+  return !enabled;
+#endif
+}
+
+// Insert `slab` at the head of `arena`'s list for its size class
+static void insert_slab(arena_t *arena, slab_t *slab) {
+  slab_t *head = arena->slabs[slab->size_class];
+
+  slab->prev_slab = NULL;
+  slab->next_slab = head;
+  if (head != NULL) head->prev_slab = slab;
+  arena->slabs[slab->size_class] = slab;
+}
+
+// Remove `slab` from `arena`'s list for its size class
+static void delete_slab(arena_t *arena, slab_t *slab) {
+  if (slab->prev_slab == NULL) {
+    arena->slabs[slab->size_class] = slab->next_slab;
+  } else {
+    slab->prev_slab->next_slab = slab->next_slab;
+  }
+  if (slab->next_slab != NULL) slab->next_slab->prev_slab = slab->prev_slab;
+
+  slab->prev_slab = NULL;
+  slab->next_slab = NULL;
+}
+
+// Make a new slab of `size_class` for `arena` with every slot free, and put it
+// in the arena's list. Returns NULL if the zone is exhausted
+static slab_t *create_slab(arena_t *arena, size_t size_class,
+                           size_t object_size) {
+  slab_t *slab = get_empty_slab();
+  if (slab == NULL) return NULL;
+
+  // Fit as many slots as possible after the header and bitmap
+  size_t num_slots = SLAB_SIZE / object_size;
+  while (get_slots_offset(num_slots) + num_slots * object_size > SLAB_SIZE) {
+    num_slots--;
+  }
+
+  slab->arena = arena;
+  atomic_init(&slab->remote_frees, 0);
+  slab->next_remote = NULL;
+  slab->object_size = object_size;
+  slab->size_class = size_class;
+  slab->num_slots = num_slots;
+  slab->free_slots = num_slots;
+  slab->slots_offset = get_slots_offset(num_slots);
+  slab->first_free_word = 0;
+
+  size_t full_words = num_slots / 64;
+  for (size_t i = 0; i < full_words; i++) {
+    slab->free_map[i] = ~(uint64_t)0;
+  }
+  if (num_slots % 64 != 0) {
+    slab->free_map[full_words] = ((uint64_t)1 << (num_slots % 64)) - 1;
+  }
+
+  insert_slab(arena, slab);
+  stat_add(&arena->stats.slab_bytes, SLAB_SIZE);
+  return slab;
+}
+
+// Mark the slot of `ptr` free in the bitmap of `slab`
+static void clear_slot(slab_t *slab, void *ptr) {
+  size_t slot = (size_t)((char *)ptr - ((char *)slab + slab->slots_offset)) /
+                slab->object_size;
+  size_t word = slot / 64;
+  slab->free_map[word] |= (uint64_t)1 << (slot % 64);
+  if (word < slab->first_free_word) slab->first_free_word = word;
+}
+
+// Count `count` slots of `slab`, which belongs to `arena`, as freed. A slab
+// that was full goes back in the arena's list, and one that is now empty is
+// released unless it is the only one left of its class, so a single object
+// being allocated and freed doesn't map and unmap a slab every time
+static void add_free_slots(arena_t *arena, slab_t *slab, size_t count) {
+  bool was_full = slab->free_slots == 0;
+  slab->free_slots += count;
+  if (was_full) insert_slab(arena, slab);
+  if (slab->free_slots == slab->num_slots &&
+      (slab->prev_slab != NULL || slab->next_slab != NULL)) {
+    delete_slab(arena, slab);
+    release_slab(slab);
+    stat_add(&arena->stats.slab_bytes, -SLAB_SIZE);
+  }
+}
+
+// Mark the slot of `ptr` free in `slab`, which belongs to `arena`
+static void free_slot(arena_t *arena, slab_t *slab, void *ptr) {
+  clear_slot(slab, ptr);
+  add_free_slots(arena, slab, 1);
+}
+
+void slab_collect_remote_frees(arena_t *arena) {
+  slab_t *slab = atomic_exchange_explicit(&arena->remote_slabs, NULL,
+                                          memory_order_acquire);
+  while (slab != NULL) {
+    slab_t *next = slab->next_remote;
+
+    // Taking the list clears REMOTE_QUEUED, so anything pushed after this
+    // queues the slab again
+    void *ptr = (void *)(atomic_exchange_explicit(&slab->remote_frees, 0,
+                                                  memory_order_acquire) &
+                         ~REMOTE_QUEUED);
+    while (ptr != NULL) {
+      void *next_ptr = *(void **)ptr;
+      // May release `slab`, but only once its last object is drained
+      free_slot(arena, slab, ptr);
+      ptr = next_ptr;
+    }
+
+    slab = next;
+  }
+}
+
+// Push the objects from `first` to `last`, linked through their first word,
+// onto the remote free list of `slab`, which belongs to another arena, and
+// queue the slab for its owner unless it is queued already
+static void push_remote_frees(slab_t *slab, void *first, void *last) {
+  uintptr_t head =
+      atomic_load_explicit(&slab->remote_frees, memory_order_relaxed);
+  do {
+    *(void **)last = (void *)(head & ~REMOTE_QUEUED);
+  } while (!atomic_compare_exchange_weak_explicit(
+      &slab->remote_frees, &head, (uintptr_t)first | REMOTE_QUEUED,
+      memory_order_release, memory_order_relaxed));
+  if (head & REMOTE_QUEUED) return;
+
+  // The owner only drains slabs it finds queued, so until this one is, the
+  // objects just pushed keep it from being released and made over for another
+  // arena or class
+  arena_t *owner = slab->arena;
+  slab_t *queue_head =
+      atomic_load_explicit(&owner->remote_slabs, memory_order_relaxed);
+  do {
+    slab->next_remote = queue_head;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &owner->remote_slabs, &queue_head, slab, memory_order_release,
+      memory_order_relaxed));
+}
+
+// Returns a slab of `size_class` of `arena` with a free slot, or NULL if no new
+// slab can be made
+static slab_t *get_slab_with_room(arena_t *arena, size_t size_class,
+                                  size_t object_size) {
+  slab_t *slab = arena->slabs[size_class];
+  if (slab != NULL) return slab;
+
+  // Slabs other threads freed into may have room before a new one is made
+  if (atomic_load_explicit(&arena->remote_slabs, memory_order_relaxed) !=
+      NULL) {
+    slab_collect_remote_frees(arena);
+    slab = arena->slabs[size_class];
+  }
+  if (slab == NULL) slab = create_slab(arena, size_class, object_size);
+  return slab;
+}
+
+void *slab_malloc(arena_t *arena, size_t size_class, size_t object_size) {
+  slab_t *slab = get_slab_with_room(arena, size_class, object_size);
+  if (slab == NULL) return NULL;
+
+  // Every slab in the list has a free slot, and none sit before this word
+  size_t word = slab->first_free_word;
+  while (slab->free_map[word] == 0) word++;
+  size_t bit = __builtin_ctzl(slab->free_map[word]);
+  slab->free_map[word] &= slab->free_map[word] - 1;
+  slab->first_free_word = word;
+
+  // Full slabs leave the list until a slot is freed
+  if (--slab->free_slots == 0) delete_slab(arena, slab);
+
+  return (char *)slab + slab->slots_offset + (word * 64 + bit) * object_size;
+}
+
+size_t slab_malloc_batch(arena_t *arena, size_t size_class,
+                         size_t object_size, void **ptrs, size_t count) {
+  size_t taken = 0;
+  while (taken < count) {
+    slab_t *slab = get_slab_with_room(arena, size_class, object_size);
+    if (slab == NULL) break;
+
+    // Take every free slot of a word before moving on to the next one, and
+    // count them all at once
+    char *slots = (char *)slab + slab->slots_offset;
+    size_t word = slab->first_free_word;
+    size_t slab_taken = 0;
+    while (slab_taken < slab->free_slots && taken < count) {
+      while (slab->free_map[word] == 0) word++;
+      uint64_t bits = slab->free_map[word];
+      while (bits != 0 && slab_taken < slab->free_slots && taken < count) {
+        size_t bit = __builtin_ctzl(bits);
+        bits &= bits - 1;
+        ptrs[taken++] = slots + (word * 64 + bit) * object_size;
+        slab_taken++;
+      }
+      slab->free_map[word] = bits;
+    }
+    slab->first_free_word = word;
+
+    slab->free_slots -= slab_taken;
+    if (slab->free_slots == 0) delete_slab(arena, slab);
+  }
+  return taken;
+}
+
+void slab_free(arena_t *arena, void *ptr) {
+  slab_t *slab = get_slab(ptr);
+  if (slab->arena != arena) {
+    push_remote_frees(slab, ptr, ptr);
+    return;
+  }
+
+  free_slot(arena, slab, ptr);
+}
+
+void slab_free_batch(arena_t *arena, void **ptrs, size_t count) {
+  slab_t *slab = get_slab(ptrs[0]);
+  if (slab->arena != arena) {
+    // Link the objects up, and hand them over with a single exchange
+    for (size_t i = 0; i + 1 < count; i++) {
+      *(void **)ptrs[i] = ptrs[i + 1];
+    }
+    push_remote_frees(slab, ptrs[0], ptrs[count - 1]);
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    clear_slot(slab, ptrs[i]);
+  }
+  add_free_slots(arena, slab, count);
+}
@@ -0,0 +1,162 @@
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const size_t MAX_ALIGNMENT = 1 << 16;
+const size_t NUM_SLOTS = 1000;
+const size_t NUM_ITERS = 200000;
+const size_t MAX_ALLOC_SIZE = 4096 * 16;
+
+// Exit unless `ptr` is aligned to `alignment` and holds at least `size` bytes
+void check(void *ptr, size_t alignment, size_t size, const char *fn) {
+  if (ptr == NULL) {
+    fprintf(stderr, "%s(%lu, %lu) failed\n", fn, alignment, size);
+    exit(1);
+  }
+  if ((uintptr_t)ptr % alignment != 0) {
+    fprintf(stderr, "%s(%lu, %lu) returned misaligned %p\n", fn, alignment,
+            size, ptr);
+    exit(1);
+  }
+  if (malloc_usable_size(ptr) < size) {
+    fprintf(stderr, "%s(%lu, %lu) returned only %lu usable bytes\n", fn,
+            alignment, size, malloc_usable_size(ptr));
+    exit(1);
+  }
+}
+
+// Every function, every alignment, a few sizes around each alignment
+void test_each_function() {
+  for (size_t alignment = sizeof(void *); alignment <= MAX_ALIGNMENT;
+       alignment *= 2) {
+    for (size_t size = 1; size <= 4 * alignment; size = size * 2 + 1) {
+      void *ptr = NULL;
+      if (posix_memalign(&ptr, alignment, size) != 0) ptr = NULL;
+      check(ptr, alignment, size, "posix_memalign");
+      memset(ptr, 0xaa, size);
+      free(ptr);
+
+      ptr = aligned_alloc(alignment, size);
+      check(ptr, alignment, size, "aligned_alloc");
+      memset(ptr, 0xbb, size);
+      free(ptr);
+
+      ptr = memalign(alignment, size);
+      check(ptr, alignment, size, "memalign");
+      memset(ptr, 0xcc, size);
+      free(ptr);
+    }
+  }
+
+  void *ptr = valloc(100);
+  check(ptr, 4096, 100, "valloc");
+  free(ptr);
+
+  ptr = NULL;
+  if (posix_memalign(&ptr, 24, 100) == 0) {
+    fprintf(stderr, "posix_memalign accepted an alignment of 24\n");
+    exit(1);
+  }
+}
+
+// Exit unless `ptr` is NULL and errno was set to `error`
+void check_error(void *ptr, int error, const char *call) {
+  if (ptr != NULL || errno != error) {
+    fprintf(stderr, "%s returned %p with errno %d, expected NULL with %d\n",
+            call, ptr, errno, error);
+    exit(1);
+  }
+  errno = 0;
+}
+
+// Failures set errno as glibc's do, and memalign and pvalloc take what glibc's
+// take. Volatile, so the compiler doesn't reject the huge sizes itself
+void test_errors() {
+  volatile size_t huge = SIZE_MAX;
+  errno = 0;
+  check_error(malloc(huge), ENOMEM, "malloc(SIZE_MAX)");
+  check_error(calloc(huge, 2), ENOMEM, "calloc(SIZE_MAX, 2)");
+  check_error(reallocarray(NULL, huge, 2), ENOMEM,
+              "reallocarray(NULL, SIZE_MAX, 2)");
+  check_error(aligned_alloc(64, huge), ENOMEM, "aligned_alloc(64, SIZE_MAX)");
+  check_error(memalign(4096, huge - 8192), ENOMEM,
+              "memalign(4096, SIZE_MAX - 8192)");
+  check_error(pvalloc(huge), ENOMEM, "pvalloc(SIZE_MAX)");
+
+  // A failed realloc leaves the allocation untouched
+  char *ptr = malloc(100);
+  memset(ptr, 0x5a, 100);
+  check_error(realloc(ptr, huge), ENOMEM, "realloc(ptr, SIZE_MAX)");
+  if (ptr[99] != 0x5a) {
+    fprintf(stderr, "Failed realloc changed the allocation\n");
+    exit(1);
+  }
+  free(ptr);
+
+  // glibc before 2.38 treats aligned_alloc like memalign. Either way it
+  // mustn't fail without saying why
+  ptr = aligned_alloc(3, 16);
+  if (ptr == NULL) {
+    check_error(ptr, EINVAL, "aligned_alloc(3, 16)");
+  } else {
+    free(ptr);
+  }
+
+  ptr = memalign(24, 16);
+  check(ptr, 32, 16, "memalign");
+  free(ptr);
+
+  // A page here, while glibc's may have less room, but is page aligned too
+  ptr = pvalloc(0);
+  check(ptr, 4096, 1, "pvalloc");
+  free(ptr);
+}
+
+// Mix aligned allocations with plain ones and frees, so aligned chunks are
+// carved out of chunks whose neighbours are in every state
+void test_random() {
+  void **ptrs = calloc(NUM_SLOTS, sizeof(void *));
+  size_t *sizes = calloc(NUM_SLOTS, sizeof(size_t));
+
+  for (size_t i = 0; i < NUM_ITERS; i++) {
+    size_t slot = random() % NUM_SLOTS;
+    if (ptrs[slot] != NULL) {
+      unsigned char *bytes = ptrs[slot];
+      if (bytes[0] != (unsigned char)slot ||
+          bytes[sizes[slot] - 1] != (unsigned char)slot) {
+        fprintf(stderr, "Allocation in slot %lu was overwritten\n", slot);
+        exit(1);
+      }
+      free(ptrs[slot]);
+      ptrs[slot] = NULL;
+      continue;
+    }
+
+    size_t size = random() % MAX_ALLOC_SIZE + 1;
+    if (random() % 2 == 0) {
+      size_t alignment = (size_t)32 << (random() % 8);
+      ptrs[slot] = aligned_alloc(alignment, size);
+      check(ptrs[slot], alignment, size, "aligned_alloc");
+    } else {
+      ptrs[slot] = malloc(size);
+    }
+    sizes[slot] = size;
+    memset(ptrs[slot], (unsigned char)slot, size);
+  }
+
+  for (size_t i = 0; i < NUM_SLOTS; i++) {
+    free(ptrs[i]);
+  }
+  free(ptrs);
+  free(sizes);
+}
+
+int main() {
+  test_each_function();
+  test_errors();
+  test_random();
+  printf("aligned tests passed\n");
+}
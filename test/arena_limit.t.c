@@ -0,0 +1,104 @@
+// Checks a thread the arena manager has no arena for gets NULL and ENOMEM from
+// every allocation that needs one, rather than crashing, can still free what
+// other threads allocated, and that the next thread after an exit allocates
+// again. Built with MAX_ARENAS lowered so that holding threads use them all up
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "naive_malloc.h"
+#include "test_util.h"
+
+#ifndef MAX_ARENAS
+#error "build with -DMAX_ARENAS, see the Makefile"
+#endif
+
+const size_t SMALL_SIZE = 64;
+// Served from a region, past what the cache holds
+const size_t CHUNK_SIZE = 8192;
+const size_t ALIGNMENT = 256;
+
+static pthread_barrier_t holding;
+static atomic_bool release;
+// Allocations go through here, so gcc can't drop a malloc and free pair
+static void *volatile allocated;
+
+// Take an arena and keep it until released
+void *hold_arena(void *unused) {
+  allocated = malloc(SMALL_SIZE);
+  free(allocated);
+  pthread_barrier_wait(&holding);
+  while (!atomic_load(&release)) sched_yield();
+  return NULL;
+}
+
+// Allocate in a thread that adopts an arena an exited one left
+void *allocate_again(void *unused) {
+  allocated = malloc(SMALL_SIZE);
+  if (allocated == NULL) fail("malloc in an adopted arena", 1, 0);
+  free(allocated);
+  return NULL;
+}
+
+void check_enomem(void *ptr, const char *call) {
+  allocated = ptr;
+  if (allocated != NULL || errno != ENOMEM) fail(call, ENOMEM, errno);
+}
+
+// Runs in a thread no arena is left for. `arg` is an object the main thread
+// allocated
+void *run_without_arena(void *arg) {
+  errno = 0;
+  check_enomem(malloc(SMALL_SIZE), "malloc");
+  errno = 0;
+  check_enomem(malloc(CHUNK_SIZE), "malloc of a chunk");
+  errno = 0;
+  check_enomem(calloc(1, CHUNK_SIZE), "calloc");
+  errno = 0;
+  check_enomem(realloc(NULL, SMALL_SIZE), "realloc");
+  errno = 0;
+  check_enomem(aligned_alloc(ALIGNMENT, SMALL_SIZE), "aligned_alloc");
+  errno = 0;
+  check_enomem(memalign(ALIGNMENT, SMALL_SIZE), "memalign");
+  void *ptr;
+  int error = posix_memalign(&ptr, ALIGNMENT, SMALL_SIZE);
+  if (error != ENOMEM) fail("posix_memalign", ENOMEM, error);
+
+  void *ptrs[4];
+  size_t taken = malloc_batch(SMALL_SIZE, 4, ptrs);
+  if (taken != 0) fail("objects of malloc_batch", 0, taken);
+
+  // What other threads allocated goes back to them
+  free(arg);
+  return NULL;
+}
+
+int main() {
+  // The main thread takes the first arena, and the holders the rest
+  void *given = malloc(SMALL_SIZE);
+  pthread_t holders[MAX_ARENAS - 1];
+  pthread_barrier_init(&holding, NULL, MAX_ARENAS);
+  for (size_t i = 0; i < MAX_ARENAS - 1; i++) {
+    pthread_create(&holders[i], NULL, hold_arena, NULL);
+  }
+  pthread_barrier_wait(&holding);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, run_without_arena, given);
+  pthread_join(thread, NULL);
+
+  // Exited holders leave their arenas for new threads to adopt
+  atomic_store(&release, true);
+  for (size_t i = 0; i < MAX_ARENAS - 1; i++) pthread_join(holders[i], NULL);
+  pthread_create(&thread, NULL, allocate_again, NULL);
+  pthread_join(thread, NULL);
+
+  printf("arena limit tests passed\n");
+}
@@ -20,7 +20,32 @@ void *thread_func(void *_unused) {
     exit(1);
   }
 
+  arena_t *initial_pointer = get_arena_pointer(my_pid);
+  if (initial_pointer->thread_id != my_pid) {
+    fprintf(stderr,
+            "Thread with id %d got an arena pointer with pid %d on initial "
+            "call\n",
+            my_pid, initial_pointer->thread_id);
+    exit(1);
+  }
+
   for (size_t i = 0; i < 100; i++) {
+    if (get_arena_pointer(my_pid) != initial_pointer) {
+      fprintf(stderr, "Arena of thread with id %d moved on access %lu\n",
+              my_pid, i);
+      exit(1);
+    }
+
+    // Changes through set_arena must show up through the pointer
+    arena_t updated = get_arena(my_pid);
+    updated.nonempty_bins = i;
+    set_arena(my_pid, &updated);
+    if (initial_pointer->nonempty_bins != i) {
+      fprintf(stderr, "Thread with id %d lost an update on access %lu\n",
+              my_pid, i);
+      exit(1);
+    }
+
     arena_t actual_arena = get_arena(my_pid);
     pid_t actual_id = actual_arena.thread_id;
     if (my_pid != actual_id) {
@@ -41,6 +66,35 @@ void *thread_func(void *_unused) {
   return NULL;
 }
 
+// A deleted arena is adopted, contents and all, by the next thread that needs
+// one, and its old thread gets a different one
+void test_delete() {
+  // Ids no thread of the test has
+  pid_t old_id = 1 << 21;
+  pid_t new_id = old_id + 1;
+  arena_t *arena = get_arena_pointer(old_id);
+  arena->nonempty_bins = 42;
+  delete_arena(old_id);
+  delete_arena(old_id);
+
+  arena_t *adopted = get_arena_pointer(new_id);
+  if (adopted != arena || adopted->thread_id != new_id ||
+      adopted->nonempty_bins != 42) {
+    fprintf(stderr, "Thread with id %d didn't adopt the deleted arena\n",
+            new_id);
+    exit(1);
+  }
+  if (get_arena_pointer(old_id) == arena) {
+    fprintf(stderr, "Deleted arena still belongs to thread with id %d\n",
+            old_id);
+    exit(1);
+  }
+}
+
+void count_arena(arena_t *arena, void *count) {
+  if (arena->thread_id != 0) (*(size_t *)count)++;
+}
+
 int main() {
   pthread_t threads[NUM_THREADS];
   for (size_t i = 0; i < NUM_THREADS; i++) {
@@ -50,4 +104,15 @@ int main() {
   for (size_t i = 0; i < NUM_THREADS; i++) {
     pthread_join(threads[i], NULL);
   }
+
+  // Every thread's arena outlives the thread
+  size_t count = 0;
+  for_each_arena(count_arena, &count);
+  if (count < NUM_THREADS) {
+    fprintf(stderr, "for_each_arena found %lu arenas for %lu threads\n",
+            count, NUM_THREADS);
+    exit(1);
+  }
+
+  test_delete();
 }
\ No newline at end of file
@@ -0,0 +1,193 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "naive_malloc.h"
+#include "test_util.h"
+
+const size_t BATCH_SIZE = 1000;
+const size_t NUM_THREADS = 4;
+// Slab objects, chunks of both kinds of bin, and mapped chunks
+const size_t SIZES[] = {1, 100, 512, 513, 1000, 4096, 20000, 200000};
+#define NUM_SIZES (sizeof(SIZES) / sizeof(SIZES[0]))
+
+// Fill every object of a batch with its own byte, then check none of them
+// overwrote another
+void check_batch(void **ptrs, size_t count, size_t size) {
+  for (size_t i = 0; i < count; i++) {
+    if (ptrs[i] == NULL || (uintptr_t)ptrs[i] % 16 != 0) {
+      fail("aligned object", 0, (uintptr_t)ptrs[i]);
+    }
+    if (malloc_usable_size(ptrs[i]) < size) {
+      fail("usable size at least", size, malloc_usable_size(ptrs[i]));
+    }
+    memset(ptrs[i], (int)i, size);
+  }
+  for (size_t i = 0; i < count; i++) {
+    for (size_t j = 0; j < size; j++) {
+      if (((unsigned char *)ptrs[i])[j] != (unsigned char)i) {
+        fail("object contents", i, ((unsigned char *)ptrs[i])[j]);
+      }
+    }
+  }
+}
+
+// Shuffle `ptrs`, so batches are freed out of order
+void shuffle(void **ptrs, size_t count) {
+  for (size_t i = count - 1; i > 0; i--) {
+    size_t j = random() % (i + 1);
+    void *tmp = ptrs[i];
+    ptrs[i] = ptrs[j];
+    ptrs[j] = tmp;
+  }
+}
+
+// Batches hand out distinct objects of every size, and freeing them in batches
+// in any order gives back every byte and every region they took
+void test_batches() {
+  void **ptrs = malloc(BATCH_SIZE * sizeof(void *));
+  for (size_t i = 0; i < NUM_SIZES; i++) {
+    malloc_stats_t before, after;
+    malloc_get_stats(&before);
+
+    size_t count = malloc_batch(SIZES[i], BATCH_SIZE, ptrs);
+    if (count != BATCH_SIZE) fail("objects allocated", BATCH_SIZE, count);
+    check_batch(ptrs, count, SIZES[i]);
+
+    // A quarter in order, then the rest shuffled, with a NULL among them
+    void *kept = ptrs[count / 2];
+    ptrs[count / 2] = NULL;
+    free_batch(ptrs, count / 4);
+    shuffle(ptrs + count / 4, count - count / 4);
+    free_batch(ptrs + count / 4, count - count / 4);
+    // free would keep it in the per-thread cache, and its region in use
+    free_batch(&kept, 1);
+
+    malloc_get_stats(&after);
+    if (after.allocated_bytes != before.allocated_bytes) {
+      fail("allocated bytes after free_batch", before.allocated_bytes,
+           after.allocated_bytes);
+    }
+    if (after.regions != before.regions) {
+      fail("regions after free_batch", before.regions, after.regions);
+    }
+  }
+  free(ptrs);
+}
+
+// free_batch takes objects from malloc of any size, mixed together
+void test_mixed_free() {
+  malloc_stats_t before, after;
+  malloc_get_stats(&before);
+
+  void **ptrs = malloc(BATCH_SIZE * sizeof(void *));
+  for (size_t i = 0; i < BATCH_SIZE; i++) {
+    ptrs[i] = malloc(SIZES[random() % NUM_SIZES]);
+  }
+  shuffle(ptrs, BATCH_SIZE);
+  free_batch(ptrs, BATCH_SIZE);
+  free(ptrs);
+
+  malloc_get_stats(&after);
+  if (after.allocated_bytes != before.allocated_bytes) {
+    fail("allocated bytes after mixed free_batch", before.allocated_bytes,
+         after.allocated_bytes);
+  }
+}
+
+// free_sized gives back what malloc and realloc handed out, whether or not the
+// size is of a slab object
+void test_free_sized() {
+  malloc_stats_t before, after;
+  malloc_get_stats(&before);
+
+  for (size_t size = 1; size <= 2048; size++) {
+    void *ptr = malloc(size);
+    free_sized(ptr, size);
+
+    // Shrunk into a smaller class
+    ptr = realloc(malloc(size), size / 3 + 1);
+    free_sized(ptr, size / 3 + 1);
+  }
+
+  malloc_get_stats(&after);
+  if (after.allocated_bytes != before.allocated_bytes) {
+    fail("allocated bytes after free_sized", before.allocated_bytes,
+         after.allocated_bytes);
+  }
+}
+
+// Sampled objects may be part of a batch
+void test_sampled() {
+  if (!mallopt(M_PROFILE_SAMPLE_BYTES, 4096)) fail("enable profiling", 1, 0);
+  void **ptrs = malloc(BATCH_SIZE * sizeof(void *));
+  for (size_t i = 0; i < NUM_SIZES; i++) {
+    size_t count = malloc_batch(SIZES[i], BATCH_SIZE, ptrs);
+    if (count != BATCH_SIZE) {
+      fail("sampled objects allocated", BATCH_SIZE, count);
+    }
+    check_batch(ptrs, count, SIZES[i]);
+    free_batch(ptrs, count);
+  }
+  free(ptrs);
+  mallopt(M_PROFILE_SAMPLE_BYTES, 0);
+}
+
+void *allocate_batches(void *arg) {
+  void **ptrs = arg;
+  for (size_t i = 0; i < NUM_SIZES; i++) {
+    if (malloc_batch(SIZES[i], BATCH_SIZE, ptrs + i * BATCH_SIZE) !=
+        BATCH_SIZE) {
+      fail("objects allocated by thread", BATCH_SIZE, 0);
+    }
+  }
+  return NULL;
+}
+
+// Batches allocated by other threads are handed back to them
+void test_threads() {
+  malloc_stats_t before, after;
+  void **ptrs = malloc(NUM_THREADS * NUM_SIZES * BATCH_SIZE * sizeof(void *));
+#ifdef THREAD_ARENAS
+  pthread_t threads[NUM_THREADS];
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    pthread_create(&threads[i], NULL, allocate_batches,
+                   ptrs + i * NUM_SIZES * BATCH_SIZE);
+  }
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+#else
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    allocate_batches(ptrs + i * NUM_SIZES * BATCH_SIZE);
+  }
+#endif
+
+  // Exited threads may leave objects of libc's behind, so only count what the
+  // batches give back
+  size_t count = NUM_THREADS * NUM_SIZES * BATCH_SIZE;
+  size_t bytes = 0;
+  for (size_t i = 0; i < count; i++) {
+    bytes += malloc_usable_size(ptrs[i]);
+  }
+  malloc_get_stats(&before);
+  free_batch(ptrs, count);
+  malloc_get_stats(&after);
+  if (before.allocated_bytes - after.allocated_bytes != bytes) {
+    fail("bytes freed from other threads' batches", bytes,
+         before.allocated_bytes - after.allocated_bytes);
+  }
+  free(ptrs);
+}
+
+int main() {
+  srandom(1);
+  test_batches();
+  test_mixed_free();
+  test_free_sized();
+  test_sampled();
+  test_threads();
+  printf("batch tests passed\n");
+}
@@ -0,0 +1,716 @@
+// Allocator benchmark suite. Runs a set of workloads against whichever malloc
+// it is linked with, each repetition in a forked child so peak RSS is measured
+// per run, and prints one machine-readable line per run. Usage:
+//   bench [-n ops] [-t threads] [-r reps] [-s seed] [-j] [-H] [workload ...]
+// -j prints JSON lines instead of CSV, -H leaves out the CSV header. Without
+// workloads named, all of them run. Builds with -DBATCH_API use malloc_batch
+// and free_batch in the batch workload
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef BATCH_API
+#include "naive_malloc.h"
+#endif
+
+#ifndef ALLOCATOR_NAME
+#define ALLOCATOR_NAME "unknown"
+#endif
+
+// Every this many allocator calls one is timed, so the cost of reading the
+// clock doesn't swamp the calls being measured
+#define SAMPLE_INTERVAL 8
+#define MAX_THREADS 64
+#define PAGESIZE 4096
+
+// Live objects in the single threaded churn workloads, and per Larson thread
+const size_t CHURN_SLOTS = 20000;
+const size_t LARGE_SLOTS = 2000;
+const size_t LARSON_SLOTS = 10000;
+const size_t LARSON_ROUNDS = 4;
+// Objects allocated and freed at once by the batch workloads, and how many such
+// batches are live at once
+#define BATCH_OBJECTS 256
+const size_t LIVE_BATCHES = 64;
+// Objects in flight between a producer and its consumer
+#define QUEUE_SIZE 1024
+const size_t PRODUCER_BATCH = 256;
+
+typedef struct options {
+  size_t ops;
+  size_t threads;
+  size_t reps;
+  uint64_t seed;
+  bool json;
+  bool header;
+} options_t;
+
+typedef struct slot {
+  void *ptr;
+  size_t size;
+} slot_t;
+
+// State of one thread running a workload
+typedef struct worker {
+  uint64_t rng;
+  size_t calls;
+  // Latencies of every SAMPLE_INTERVAL-th call, in nanoseconds
+  uint64_t *samples;
+  size_t num_samples;
+  size_t max_samples;
+  // Another thread may free what this one allocated, see consume
+  _Atomic size_t live_bytes;
+  size_t peak_live_bytes;
+} worker_t;
+
+// What a child reports back about one run
+typedef struct result {
+  double seconds;
+  size_t calls;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+  uint64_t max_ns;
+  size_t peak_live_bytes;
+  size_t final_rss_bytes;
+} result_t;
+
+typedef void (*workload_fn)(worker_t *workers, const options_t *options);
+
+// Bookkeeping memory comes straight from mmap, so it neither goes through
+// nor disturbs the allocator being measured
+static void *map_array(size_t size) {
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return ptr;
+}
+
+static uint64_t get_time_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift, as random() takes a lock
+static uint64_t next_random(worker_t *worker) {
+  worker->rng ^= worker->rng << 13;
+  worker->rng ^= worker->rng >> 7;
+  worker->rng ^= worker->rng << 17;
+  return worker->rng;
+}
+
+static size_t uniform_size(worker_t *worker, size_t min, size_t max) {
+  return min + next_random(worker) % (max - min + 1);
+}
+
+// Sizes whose density falls off as 1 / size^2 from 16 bytes up to 1 MB: the
+// power of two is picked with probability halving at each step, and the size
+// uniformly within it
+static size_t power_law_size(worker_t *worker) {
+  size_t exponent = __builtin_ctzl(next_random(worker) | ((uint64_t)1 << 16));
+  size_t base = (size_t)16 << exponent;
+  return base + next_random(worker) % base;
+}
+
+static void record_sample(worker_t *worker, uint64_t start) {
+  if (worker->num_samples < worker->max_samples) {
+    worker->samples[worker->num_samples++] = get_time_ns() - start;
+  }
+}
+
+static void add_live_bytes(worker_t *worker, size_t size) {
+  size_t live_bytes = atomic_fetch_add_explicit(&worker->live_bytes, size,
+                                                memory_order_relaxed) +
+                      size;
+  if (live_bytes > worker->peak_live_bytes) {
+    worker->peak_live_bytes = live_bytes;
+  }
+}
+
+// malloc `size` bytes, timing the call if it is due for a sample, and touch
+// every page of the result so RSS reflects what was handed out
+static void *bench_malloc(worker_t *worker, size_t size) {
+  void *ptr;
+  if (worker->calls++ % SAMPLE_INTERVAL == 0) {
+    uint64_t start = get_time_ns();
+    ptr = malloc(size);
+    record_sample(worker, start);
+  } else {
+    ptr = malloc(size);
+  }
+
+  if (ptr == NULL) {
+    fprintf(stderr, "malloc(%lu) failed\n", size);
+    exit(1);
+  }
+  for (size_t i = 0; i < size; i += PAGESIZE) {
+    ((char *)ptr)[i] = 1;
+  }
+
+  add_live_bytes(worker, size);
+  return ptr;
+}
+
+static void bench_free(worker_t *worker, void *ptr, size_t size) {
+  if (worker->calls++ % SAMPLE_INTERVAL == 0) {
+    uint64_t start = get_time_ns();
+    free(ptr);
+    record_sample(worker, start);
+  } else {
+    free(ptr);
+  }
+  atomic_fetch_sub_explicit(&worker->live_bytes, size, memory_order_relaxed);
+}
+
+static void free_slots(worker_t *worker, slot_t *slots, size_t num_slots) {
+  for (size_t i = 0; i < num_slots; i++) {
+    if (slots[i].ptr != NULL) bench_free(worker, slots[i].ptr, slots[i].size);
+    slots[i].ptr = NULL;
+  }
+}
+
+static size_t small_size(worker_t *worker) {
+  return uniform_size(worker, 1, 8192);
+}
+
+// A page up to just under the usual threshold for a mapping of their own
+static size_t large_size(worker_t *worker) {
+  return uniform_size(worker, 4096, 120 * 1024);
+}
+
+// Each call picks a random one of `num_slots` slots, filling it with an object
+// of `pick_size` bytes if empty and emptying it if not. Slots are indexed
+// directly, so bookkeeping is O(1) per call
+static void churn(worker_t *worker, size_t calls, size_t num_slots,
+                  size_t (*pick_size)(worker_t *)) {
+  slot_t *slots = map_array(num_slots * sizeof(slot_t));
+  for (size_t i = 0; i < calls; i++) {
+    slot_t *slot = &slots[next_random(worker) % num_slots];
+    if (slot->ptr == NULL) {
+      slot->size = pick_size(worker);
+      slot->ptr = bench_malloc(worker, slot->size);
+    } else {
+      bench_free(worker, slot->ptr, slot->size);
+      slot->ptr = NULL;
+    }
+  }
+  free_slots(worker, slots, num_slots);
+  munmap(slots, num_slots * sizeof(slot_t));
+}
+
+static void uniform_workload(worker_t *workers, const options_t *options) {
+  churn(&workers[0], options->ops, CHURN_SLOTS, small_size);
+}
+
+static void power_law_workload(worker_t *workers, const options_t *options) {
+  churn(&workers[0], options->ops, CHURN_SLOTS, power_law_size);
+}
+
+// Churn of large objects, which live in chunks rather than slabs. Peak RSS
+// against peak live bytes shows how well freed space is reused. Fewer calls,
+// as every page of each object is touched
+static void large_workload(worker_t *workers, const options_t *options) {
+  churn(&workers[0], options->ops / 8, LARGE_SLOTS, large_size);
+}
+
+// malloc BATCH_OBJECTS objects of `size` bytes into `ptrs`, with one call to
+// malloc_batch if `batched` and the allocator has it, or one malloc each. Every
+// batch is timed, and recorded as its time per object
+static void bench_malloc_batch(worker_t *worker, size_t size, void **ptrs,
+                               bool batched) {
+  uint64_t start = get_time_ns();
+  size_t count = 0;
+#ifdef BATCH_API
+  if (batched) count = malloc_batch(size, BATCH_OBJECTS, ptrs);
+#endif
+  for (; count < BATCH_OBJECTS && !batched; count++) {
+    if ((ptrs[count] = malloc(size)) == NULL) break;
+  }
+  if (worker->num_samples < worker->max_samples) {
+    worker->samples[worker->num_samples++] =
+        (get_time_ns() - start) / BATCH_OBJECTS;
+  }
+
+  if (count < BATCH_OBJECTS) {
+    fprintf(stderr, "malloc batch of %lu failed\n", size);
+    exit(1);
+  }
+  for (size_t i = 0; i < BATCH_OBJECTS; i++) {
+    ((char *)ptrs[i])[0] = 1;
+  }
+  worker->calls += BATCH_OBJECTS;
+  add_live_bytes(worker, BATCH_OBJECTS * size);
+}
+
+// free the BATCH_OBJECTS objects of `size` bytes at `ptrs`, like
+// bench_malloc_batch
+static void bench_free_batch(worker_t *worker, size_t size, void **ptrs,
+                             bool batched) {
+  uint64_t start = get_time_ns();
+#ifdef BATCH_API
+  if (batched) free_batch(ptrs, BATCH_OBJECTS);
+#endif
+  for (size_t i = 0; i < BATCH_OBJECTS && !batched; i++) {
+    free(ptrs[i]);
+  }
+  if (worker->num_samples < worker->max_samples) {
+    worker->samples[worker->num_samples++] =
+        (get_time_ns() - start) / BATCH_OBJECTS;
+  }
+
+  worker->calls += BATCH_OBJECTS;
+  atomic_fetch_sub_explicit(&worker->live_bytes, BATCH_OBJECTS * size,
+                            memory_order_relaxed);
+}
+
+// Allocate batches of objects of a random size from 16 bytes to 1 KB, freeing
+// the oldest of LIVE_BATCHES batches for each new one, as containers and
+// object pools do. With `batched`, through the batch calls if the allocator
+// has them
+static void batch_churn(worker_t *worker, size_t calls, bool batched) {
+#ifndef BATCH_API
+  batched = false;
+#endif
+  void **ptrs = map_array(LIVE_BATCHES * BATCH_OBJECTS * sizeof(void *));
+  size_t *sizes = map_array(LIVE_BATCHES * sizeof(size_t));
+  size_t rounds = calls / (2 * BATCH_OBJECTS);
+  for (size_t i = 0; i < rounds; i++) {
+    size_t batch = i % LIVE_BATCHES;
+    void **batch_ptrs = ptrs + batch * BATCH_OBJECTS;
+    if (i >= LIVE_BATCHES) {
+      bench_free_batch(worker, sizes[batch], batch_ptrs, batched);
+    }
+    sizes[batch] = uniform_size(worker, 16, 1024);
+    bench_malloc_batch(worker, sizes[batch], batch_ptrs, batched);
+  }
+  for (size_t batch = 0; batch < LIVE_BATCHES && batch < rounds; batch++) {
+    bench_free_batch(worker, sizes[batch], ptrs + batch * BATCH_OBJECTS,
+                     batched);
+  }
+  munmap(ptrs, LIVE_BATCHES * BATCH_OBJECTS * sizeof(void *));
+  munmap(sizes, LIVE_BATCHES * sizeof(size_t));
+}
+
+static void batch_workload(worker_t *workers, const options_t *options) {
+  batch_churn(&workers[0], options->ops, true);
+}
+
+// The batch workload with one malloc or free per object, for comparison
+static void batch_loop_workload(worker_t *workers, const options_t *options) {
+  batch_churn(&workers[0], options->ops, false);
+}
+
+typedef struct larson_arg {
+  worker_t *worker;
+  slot_t *slots;
+  size_t calls;
+} larson_arg_t;
+
+// One round of a Larson server thread: replace random objects of its block
+static void *larson_round(void *arg) {
+  larson_arg_t *larson = arg;
+  worker_t *worker = larson->worker;
+  for (size_t i = 0; i < larson->calls; i += 2) {
+    slot_t *slot = &larson->slots[next_random(worker) % LARSON_SLOTS];
+    if (slot->ptr != NULL) bench_free(worker, slot->ptr, slot->size);
+    slot->size = uniform_size(worker, 16, 1024);
+    slot->ptr = bench_malloc(worker, slot->size);
+  }
+  return NULL;
+}
+
+// Larson-style server churn. Each thread owns a block of objects and keeps
+// replacing random ones. Every round the threads are replaced by new ones,
+// which inherit the blocks, so objects are freed by a different thread than
+// the one that allocated them
+static void larson_workload(worker_t *workers, const options_t *options) {
+  size_t threads = options->threads;
+  slot_t *slots = map_array(threads * LARSON_SLOTS * sizeof(slot_t));
+  larson_arg_t args[MAX_THREADS];
+  for (size_t i = 0; i < threads; i++) {
+    args[i].worker = &workers[i];
+    args[i].slots = slots + i * LARSON_SLOTS;
+    args[i].calls = options->ops / LARSON_ROUNDS;
+  }
+
+  for (size_t round = 0; round < LARSON_ROUNDS; round++) {
+#ifdef THREAD_SAFE
+    pthread_t handles[MAX_THREADS];
+    for (size_t i = 0; i < threads; i++) {
+      pthread_create(&handles[i], NULL, larson_round, &args[i]);
+    }
+    for (size_t i = 0; i < threads; i++) {
+      pthread_join(handles[i], NULL);
+    }
+#else
+    // Not thread safe, so the rounds run on this thread
+    for (size_t i = 0; i < threads; i++) {
+      larson_round(&args[i]);
+    }
+#endif
+  }
+
+  for (size_t i = 0; i < threads; i++) {
+    free_slots(&workers[i], args[i].slots, LARSON_SLOTS);
+  }
+  munmap(slots, threads * LARSON_SLOTS * sizeof(slot_t));
+}
+
+// Single producer, single consumer ring of allocations
+typedef struct queue {
+  slot_t items[QUEUE_SIZE];
+  _Atomic size_t head;
+  _Atomic size_t tail;
+  worker_t *producer;
+  worker_t *consumer;
+  size_t count;
+} queue_t;
+
+static bool queue_push(queue_t *queue, slot_t item) {
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  if (tail - atomic_load_explicit(&queue->head, memory_order_acquire) ==
+      QUEUE_SIZE) {
+    return false;
+  }
+  queue->items[tail % QUEUE_SIZE] = item;
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+static bool queue_pop(queue_t *queue, slot_t *item) {
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+    return false;
+  }
+  *item = queue->items[head % QUEUE_SIZE];
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return true;
+}
+
+static void produce(queue_t *queue) {
+  slot_t item;
+  item.size = uniform_size(queue->producer, 16, 2048);
+  item.ptr = bench_malloc(queue->producer, item.size);
+  while (!queue_push(queue, item)) sched_yield();
+}
+
+static void consume(queue_t *queue) {
+  slot_t item;
+  while (!queue_pop(queue, &item)) sched_yield();
+  bench_free(queue->consumer, item.ptr, item.size);
+  // The bytes were the producer's, so its live bytes stay bounded by the queue
+  atomic_fetch_add_explicit(&queue->consumer->live_bytes, item.size,
+                            memory_order_relaxed);
+  atomic_fetch_sub_explicit(&queue->producer->live_bytes, item.size,
+                            memory_order_relaxed);
+}
+
+static void *producer_thread(void *arg) {
+  queue_t *queue = arg;
+  for (size_t i = 0; i < queue->count; i++) produce(queue);
+  return NULL;
+}
+
+static void *consumer_thread(void *arg) {
+  queue_t *queue = arg;
+  for (size_t i = 0; i < queue->count; i++) consume(queue);
+  return NULL;
+}
+
+// Producers allocate objects and hand them through a queue to consumers, which
+// free them. Every object is freed by another thread, in allocation order
+static void producer_consumer_workload(worker_t *workers,
+                                       const options_t *options) {
+  size_t pairs = options->threads / 2 > 0 ? options->threads / 2 : 1;
+  queue_t *queues = map_array(pairs * sizeof(queue_t));
+  for (size_t i = 0; i < pairs; i++) {
+    queues[i].producer = &workers[2 * i];
+    queues[i].consumer = &workers[2 * i + 1];
+    queues[i].count = options->ops / 2;
+  }
+
+#ifdef THREAD_SAFE
+  pthread_t handles[MAX_THREADS];
+  for (size_t i = 0; i < pairs; i++) {
+    pthread_create(&handles[2 * i], NULL, producer_thread, &queues[i]);
+    pthread_create(&handles[2 * i + 1], NULL, consumer_thread, &queues[i]);
+  }
+  for (size_t i = 0; i < 2 * pairs; i++) {
+    pthread_join(handles[i], NULL);
+  }
+#else
+  // Not thread safe, so alternate between producing and consuming a batch
+  for (size_t i = 0; i < pairs; i++) {
+    for (size_t done = 0; done < queues[i].count; done += PRODUCER_BATCH) {
+      size_t batch = queues[i].count - done < PRODUCER_BATCH
+                         ? queues[i].count - done
+                         : PRODUCER_BATCH;
+      for (size_t j = 0; j < batch; j++) produce(&queues[i]);
+      for (size_t j = 0; j < batch; j++) consume(&queues[i]);
+    }
+  }
+  (void)producer_thread;
+  (void)consumer_thread;
+#endif
+
+  munmap(queues, pairs * sizeof(queue_t));
+}
+
+// Fill memory with small objects, free every other one, then allocate larger
+// objects that can't reuse the holes. Peak and final RSS against peak live
+// bytes show how well the allocator copes
+static void fragmentation_workload(worker_t *workers,
+                                   const options_t *options) {
+  worker_t *worker = &workers[0];
+  // Fewer calls than the other workloads, as first-fit allocators walk every
+  // hole for each large object
+  size_t num_small = options->ops / 16;
+  size_t num_large = num_small / 8;
+  slot_t *small = map_array(num_small * sizeof(slot_t));
+  slot_t *large = map_array(num_large * sizeof(slot_t));
+
+  for (size_t i = 0; i < num_small; i++) {
+    small[i].size = uniform_size(worker, 16, 128);
+    small[i].ptr = bench_malloc(worker, small[i].size);
+  }
+  for (size_t i = 0; i < num_small; i += 2) {
+    bench_free(worker, small[i].ptr, small[i].size);
+    small[i].ptr = NULL;
+  }
+  for (size_t i = 0; i < num_large; i++) {
+    large[i].size = uniform_size(worker, 1024, 4096);
+    large[i].ptr = bench_malloc(worker, large[i].size);
+  }
+  free_slots(worker, small, num_small);
+  free_slots(worker, large, num_large);
+
+  munmap(small, num_small * sizeof(slot_t));
+  munmap(large, num_large * sizeof(slot_t));
+}
+
+typedef struct workload {
+  const char *name;
+  workload_fn run;
+  bool threaded;
+} workload_t;
+
+static const workload_t WORKLOADS[] = {
+    {"uniform", uniform_workload, false},
+    {"power_law", power_law_workload, false},
+    {"larson", larson_workload, true},
+    {"producer_consumer", producer_consumer_workload, true},
+    {"fragmentation", fragmentation_workload, false},
+    {"large", large_workload, false},
+    {"batch", batch_workload, false},
+    {"batch_loop", batch_loop_workload, false},
+};
+#define NUM_WORKLOADS (sizeof(WORKLOADS) / sizeof(WORKLOADS[0]))
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static size_t get_rss_bytes() {
+  FILE *statm = fopen("/proc/self/statm", "r");
+  size_t pages = 0, resident = 0;
+  if (statm == NULL) return 0;
+  if (fscanf(statm, "%lu %lu", &pages, &resident) != 2) resident = 0;
+  fclose(statm);
+  return resident * PAGESIZE;
+}
+
+// Run `workload` with `threads` workers and fill in `result`. Called in the
+// forked child
+static void run_workload(const workload_t *workload, const options_t *options,
+                         size_t threads, uint64_t seed, result_t *result) {
+  worker_t *workers = map_array(threads * sizeof(worker_t));
+  size_t max_samples = 2 * options->ops / SAMPLE_INTERVAL + 16;
+  for (size_t i = 0; i < threads; i++) {
+    workers[i].rng = seed * 2654435761u + i + 1;
+    workers[i].max_samples = max_samples;
+    workers[i].samples = map_array(max_samples * sizeof(uint64_t));
+  }
+
+  options_t run_options = *options;
+  run_options.threads = threads;
+  uint64_t start = get_time_ns();
+  workload->run(workers, &run_options);
+  result->seconds = (double)(get_time_ns() - start) / 1e9;
+
+  size_t num_samples = 0;
+  for (size_t i = 0; i < threads; i++) {
+    num_samples += workers[i].num_samples;
+  }
+  uint64_t *samples = map_array((num_samples + 1) * sizeof(uint64_t));
+  num_samples = 0;
+  for (size_t i = 0; i < threads; i++) {
+    memcpy(samples + num_samples, workers[i].samples,
+           workers[i].num_samples * sizeof(uint64_t));
+    num_samples += workers[i].num_samples;
+    result->calls += workers[i].calls;
+    // Threads peak at different times, so this is an upper bound
+    result->peak_live_bytes += workers[i].peak_live_bytes;
+  }
+
+  qsort(samples, num_samples, sizeof(uint64_t), compare_u64);
+  if (num_samples > 0) {
+    result->p50_ns = samples[num_samples / 2];
+    result->p99_ns = samples[num_samples * 99 / 100];
+    result->p999_ns = samples[num_samples * 999 / 1000];
+    result->max_ns = samples[num_samples - 1];
+  }
+  result->final_rss_bytes = get_rss_bytes();
+}
+
+static void print_result(const workload_t *workload, const options_t *options,
+                         size_t rep, uint64_t seed, size_t threads,
+                         const result_t *result, long peak_rss_kb) {
+  double mops = (double)result->calls / result->seconds / 1e6;
+  if (options->json) {
+    printf(
+        "{\"allocator\": \"%s\", \"workload\": \"%s\", \"rep\": %lu, "
+        "\"seed\": %lu, \"threads\": %lu, \"calls\": %lu, \"seconds\": %.4f, "
+        "\"mops_per_sec\": %.3f, \"p50_ns\": %lu, \"p99_ns\": %lu, "
+        "\"p999_ns\": %lu, \"max_ns\": %lu, \"peak_live_kb\": %lu, "
+        "\"peak_rss_kb\": %ld, \"final_rss_kb\": %lu}\n",
+        ALLOCATOR_NAME, workload->name, rep, seed, threads, result->calls,
+        result->seconds, mops, result->p50_ns, result->p99_ns,
+        result->p999_ns, result->max_ns, result->peak_live_bytes / 1024,
+        peak_rss_kb, result->final_rss_bytes / 1024);
+  } else {
+    printf("%s,%s,%lu,%lu,%lu,%lu,%.4f,%.3f,%lu,%lu,%lu,%lu,%lu,%ld,%lu\n",
+           ALLOCATOR_NAME, workload->name, rep, seed, threads, result->calls,
+           result->seconds, mops, result->p50_ns, result->p99_ns,
+           result->p999_ns, result->max_ns, result->peak_live_bytes / 1024,
+           peak_rss_kb, result->final_rss_bytes / 1024);
+  }
+  fflush(stdout);
+}
+
+// Run one repetition of `workload` in a child process and print its results.
+// Returns false if the child failed
+static bool run_rep(const workload_t *workload, const options_t *options,
+                    size_t rep) {
+  uint64_t seed = options->seed + rep;
+  size_t threads = 1;
+  if (workload->threaded) {
+    threads = options->threads;
+    // A producer needs a consumer, even if they take turns on one thread
+    if (workload->run == producer_consumer_workload && threads < 2) {
+      threads = 2;
+    }
+  }
+
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    result_t result;
+    memset(&result, 0, sizeof(result));
+    run_workload(workload, options, threads, seed, &result);
+    if (write(fds[1], &result, sizeof(result)) != sizeof(result)) _exit(1);
+    _exit(0);
+  }
+  close(fds[1]);
+
+  result_t result;
+  ssize_t got = read(fds[0], &result, sizeof(result));
+  close(fds[0]);
+
+  int status;
+  struct rusage usage;
+  wait4(pid, &status, 0, &usage);
+  if (got != sizeof(result) || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "%s: %s rep %lu failed\n", ALLOCATOR_NAME,
+            workload->name, rep);
+    return false;
+  }
+
+  print_result(workload, options, rep, seed, threads, &result,
+               usage.ru_maxrss);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  options_t options = {.ops = 1000000,
+                       .threads = (size_t)sysconf(_SC_NPROCESSORS_ONLN),
+                       .reps = 3,
+                       .seed = 1,
+                       .json = false,
+                       .header = true};
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:t:r:s:jH")) != -1) {
+    switch (opt) {
+      case 'n':
+        options.ops = strtoul(optarg, NULL, 10);
+        break;
+      case 't':
+        options.threads = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        options.reps = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        options.seed = strtoul(optarg, NULL, 10);
+        break;
+      case 'j':
+        options.json = true;
+        break;
+      case 'H':
+        options.header = false;
+        break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-n ops] [-t threads] [-r reps] [-s seed] [-j] "
+                "[-H] [workload ...]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (options.threads == 0) options.threads = 1;
+  if (options.threads > MAX_THREADS) options.threads = MAX_THREADS;
+
+  if (options.header && !options.json) {
+    printf(
+        "allocator,workload,rep,seed,threads,calls,seconds,mops_per_sec,"
+        "p50_ns,p99_ns,p999_ns,max_ns,peak_live_kb,peak_rss_kb,"
+        "final_rss_kb\n");
+  }
+
+  bool ok = true;
+  for (size_t i = 0; i < NUM_WORKLOADS; i++) {
+    bool selected = optind == argc;
+    for (int j = optind; j < argc; j++) {
+      if (strcmp(argv[j], WORKLOADS[i].name) == 0) selected = true;
+    }
+    if (!selected) continue;
+
+    for (size_t rep = 0; rep < options.reps; rep++) {
+      ok &= run_rep(&WORKLOADS[i], &options, rep);
+    }
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+#include "free_tree.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+const size_t NUM_NODES = 4096;
+const size_t NUM_OPS = 100000;
+// Few distinct sizes, so many nodes tie on size
+const size_t NUM_SIZES = 64;
+
+// Returns the black height of the subtree at `node`, exiting if it breaks
+// ordering, parent links or the red-black rules
+size_t check_subtree(free_tree_node_t *node, free_tree_node_t *parent) {
+  if (node == NULL) return 1;
+  if (node->parent != parent) {
+    fprintf(stderr, "Node %p has the wrong parent\n", (void *)node);
+    exit(1);
+  }
+  if (node->red && parent != NULL && parent->red) {
+    fprintf(stderr, "Red node %p has a red parent\n", (void *)node);
+    exit(1);
+  }
+
+  free_tree_node_t *left = node->left;
+  free_tree_node_t *right = node->right;
+  if ((left != NULL && (left->size > node->size ||
+                        (left->size == node->size && left > node))) ||
+      (right != NULL && (right->size < node->size ||
+                         (right->size == node->size && right < node)))) {
+    fprintf(stderr, "Children of node %p are out of order\n", (void *)node);
+    exit(1);
+  }
+
+  size_t left_height = check_subtree(left, node);
+  if (left_height != check_subtree(right, node)) {
+    fprintf(stderr, "Subtrees of node %p differ in black height\n",
+            (void *)node);
+    exit(1);
+  }
+  return left_height + !node->red;
+}
+
+// Returns the node a linear scan picks as the best fit for `size`
+free_tree_node_t *scan_best_fit(free_tree_node_t *nodes, bool *in_tree,
+                                size_t size) {
+  free_tree_node_t *best = NULL;
+  for (size_t i = 0; i < NUM_NODES; i++) {
+    if (!in_tree[i] || nodes[i].size < size) continue;
+    if (best == NULL || nodes[i].size < best->size) best = &nodes[i];
+  }
+  return best;
+}
+
+int main() {
+  free_tree_node_t *nodes = calloc(NUM_NODES, sizeof(free_tree_node_t));
+  bool *in_tree = calloc(NUM_NODES, sizeof(bool));
+  free_tree_node_t *root = NULL;
+  srand(1);
+
+  for (size_t op = 0; op < NUM_OPS; op++) {
+    size_t i = rand() % NUM_NODES;
+    if (in_tree[i]) {
+      free_tree_remove(&root, &nodes[i]);
+    } else {
+      free_tree_insert(&root, &nodes[i], (1 + rand() % NUM_SIZES) * 4096);
+    }
+    in_tree[i] = !in_tree[i];
+
+    // Nodes are in an array, so the lowest address of a size comes first
+    size_t size = (1 + rand() % (NUM_SIZES + 1)) * 4096 - rand() % 4096;
+    size_t steps = 0;
+    free_tree_node_t *expected = scan_best_fit(nodes, in_tree, size);
+    free_tree_node_t *actual = free_tree_best_fit(root, size, &steps);
+    if (actual != expected) {
+      fprintf(stderr, "Best fit for %lu at op %lu: expected %p, got %p\n",
+              size, op, (void *)expected, (void *)actual);
+      exit(1);
+    }
+
+    if (op % 1000 == 0) {
+      if (root != NULL && root->red) {
+        fprintf(stderr, "Root is red at op %lu\n", op);
+        exit(1);
+      }
+      check_subtree(root, NULL);
+    }
+  }
+
+  printf("free tree tests passed\n");
+}
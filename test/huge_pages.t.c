@@ -0,0 +1,197 @@
+// Checks M_HUGE_PAGES backs new regions with huge pages, and measures what they
+// save on a heap much larger than the TLB covers. For each mode, a forked child
+// builds a heap of objects of 16 bytes to 2 KB, links them in random order and
+// chases the links, then prints a CSV line: the page faults taken building the
+// heap, the time per step of the chase and, where perf counters are permitted,
+// its dTLB load misses per step, and the heap's bytes in transparent huge
+// pages. Usage: huge_pages [heap MB]
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "naive_malloc.h"
+#include "test_util.h"
+
+const size_t DEFAULT_HEAP_MB = 256;
+const size_t MIN_OBJECT_SIZE = 16;
+const size_t MAX_OBJECT_SIZE = 2048;
+// Steps of the chase per object in the heap
+const size_t CHASE_ROUNDS = 16;
+
+// Regions are made of whole huge pages when they are on
+const size_t HUGE_PAGE_BYTES = (size_t)2 << 20;
+
+const char *MODE_NAMES[] = {"off", "transparent", "explicit"};
+#define NUM_MODES (sizeof(MODE_NAMES) / sizeof(MODE_NAMES[0]))
+
+double get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Open a counter of the calling thread's user space events of `type` and
+// `config`, disabled. Returns -1 where the kernel doesn't permit it, as in
+// most virtual machines for hardware events
+int open_counter(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void start_counter(int fd) {
+  if (fd < 0) return;
+  ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+  ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+// Returns the count since start_counter, or 0 if the counter isn't open
+uint64_t stop_counter(int fd) {
+  uint64_t count = 0;
+  if (fd < 0) return 0;
+  ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  if (read(fd, &count, sizeof(count)) != sizeof(count)) return 0;
+  return count;
+}
+
+// Returns the kilobytes of the process's memory in transparent huge pages
+size_t get_anon_huge_kb() {
+  FILE *file = fopen("/proc/self/smaps_rollup", "r");
+  if (file == NULL) return 0;
+  char line[256];
+  size_t kb = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) break;
+  }
+  fclose(file);
+  return kb;
+}
+
+// Returns true iff the kernel hands out transparent huge pages to regions
+// advised with MADV_HUGEPAGE
+int has_transparent_huge_pages() {
+  FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+  if (file == NULL) return 0;
+  char line[256];
+  int enabled = fgets(line, sizeof(line), file) != NULL &&
+                strstr(line, "[never]") == NULL;
+  fclose(file);
+  return enabled;
+}
+
+// Build the heap with huge pages set to `mode`, chase through it and print the
+// results. Exits non-zero if a check fails
+void run_mode(int mode, size_t heap_bytes) {
+  if (!mallopt(M_HUGE_PAGES, mode)) fail("set huge pages", 1, 0);
+  malloc_stats_t before, after;
+  malloc_get_stats(&before);
+
+  // Objects of random sizes until the heap is full, each starting with the
+  // link to the next object of the chase
+  size_t max_objects = heap_bytes / MIN_OBJECT_SIZE;
+  void ***objects = calloc(max_objects, sizeof(void **));
+  size_t num_objects = 0;
+  size_t bytes = 0;
+  int faults = open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+  double start = get_time();
+  start_counter(faults);
+  while (bytes < heap_bytes) {
+    size_t size =
+        MIN_OBJECT_SIZE + random() % (MAX_OBJECT_SIZE - MIN_OBJECT_SIZE + 1);
+    objects[num_objects] = malloc(size);
+    memset(objects[num_objects], 0, size);
+    num_objects++;
+    bytes += size;
+  }
+  uint64_t build_faults = stop_counter(faults);
+  double build_time = get_time() - start;
+
+  malloc_get_stats(&after);
+  size_t region_bytes = after.region_bytes - before.region_bytes;
+  size_t huge_bytes = after.huge_region_bytes - before.huge_region_bytes;
+  if (mode == HUGE_PAGES_OFF && huge_bytes != 0) {
+    fail("huge region bytes with huge pages off", 0, huge_bytes);
+  }
+  // Explicit huge pages fall back to transparent ones
+  if (mode != HUGE_PAGES_OFF && has_transparent_huge_pages() &&
+      huge_bytes != region_bytes) {
+    fail("huge region bytes", region_bytes, huge_bytes);
+  }
+  if (mode != HUGE_PAGES_OFF && region_bytes % HUGE_PAGE_BYTES != 0) {
+    fail("region bytes in whole huge pages", 0,
+         region_bytes % HUGE_PAGE_BYTES);
+  }
+
+  // Link the objects into one cycle in random order
+  for (size_t i = num_objects - 1; i > 0; i--) {
+    size_t j = random() % (i + 1);
+    void **tmp = objects[i];
+    objects[i] = objects[j];
+    objects[j] = tmp;
+  }
+  for (size_t i = 0; i < num_objects; i++) {
+    *objects[i] = objects[(i + 1) % num_objects];
+  }
+
+  int tlb_misses = open_counter(
+      PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  size_t steps = num_objects * CHASE_ROUNDS;
+  void **ptr = objects[0];
+  start = get_time();
+  start_counter(tlb_misses);
+  for (size_t i = 0; i < steps; i++) {
+    ptr = *ptr;
+  }
+  uint64_t misses = stop_counter(tlb_misses);
+  double chase_time = get_time() - start;
+  if (ptr != objects[0]) fail("chase back at the first object", 0, 1);
+
+  char misses_per_step[32] = "n/a";
+  if (tlb_misses >= 0) {
+    snprintf(misses_per_step, sizeof(misses_per_step), "%.3f",
+             (double)misses / steps);
+  }
+  printf("%s,%lu,%lu,%.3f,%lu,%.1f,%s,%lu\n", MODE_NAMES[mode],
+         heap_bytes >> 20, num_objects, build_time, build_faults,
+         chase_time * 1e9 / steps, misses_per_step, get_anon_huge_kb());
+  fflush(stdout);
+
+  for (size_t i = 0; i < num_objects; i++) {
+    free(objects[i]);
+  }
+  free(objects);
+}
+
+int main(int argc, char **argv) {
+  size_t heap_mb = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_HEAP_MB;
+
+  printf("mode,heap_mb,objects,build_s,build_page_faults,chase_ns_per_step,"
+         "dtlb_misses_per_step,anon_huge_kb\n");
+  fflush(stdout);
+  // Each mode in a process of its own, as the mode only affects new regions
+  for (size_t mode = 0; mode < NUM_MODES; mode++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      srandom(1);
+      run_mode(mode, heap_mb << 20);
+      exit(0);
+    }
+    if (!child_succeeded(pid)) return 1;
+  }
+}
@@ -3,6 +3,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#ifdef TCACHE_STATS
+#include "naive_malloc.h"
+#endif
+
 const size_t MAX_ALLOC_SIZE = 4096 * 16;
 const size_t MAX_ALLOCS = 1000000;
 const size_t NUM_ITERS = 10000000;
@@ -76,14 +80,10 @@ void random_test() {
 #else
       free(ptrs[idx_to_free]);
 #endif
-      // Shift everything else back
-      for (size_t j = idx_to_free; j < next_empty_alloc_slot; j++) {
-        // If there's no value to the right to copy, just put 0
-        void *new_value = j == MAX_ALLOCS ? NULL : ptrs[j + 1];
-        ptrs[j] = new_value;
-      }
-
-      next_empty_alloc_slot--;
+      // Move the last pointer into the freed slot, so every slot before
+      // `next_empty_alloc_slot` stays occupied without shifting the rest
+      ptrs[idx_to_free] = ptrs[--next_empty_alloc_slot];
+      ptrs[next_empty_alloc_slot] = NULL;
     }
 
 #ifdef VERBOSE
@@ -109,7 +109,27 @@ void random_test() {
 #endif
 }
 
+#ifdef TCACHE_STATS
+// Usage: tcache_mmap_malloc [count] [max size] [batch], each set with mallopt
+int main(int argc, char **argv) {
+  const int params[] = {M_TCACHE_COUNT, M_TCACHE_MAX_SIZE, M_TCACHE_BATCH};
+  for (int i = 1; i < argc && i <= 3; i++) {
+    if (!mallopt(params[i - 1], atoi(argv[i]))) {
+      fprintf(stderr, "Invalid value %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  random_test();
+
+  size_t hits, misses;
+  malloc_tcache_stats(&hits, &misses);
+  printf("tcache hits: %lu, misses: %lu, hit rate: %.2f%%\n", hits, misses,
+         100.0 * hits / (hits + misses));
+}
+#else
 int main() {
   // basic_test();
   random_test();
 }
+#endif
@@ -0,0 +1,158 @@
+// Tests for object pools: objects are aligned and distinct, the statistics are
+// kept and blocks are unmapped once empty. The benchmark keeps a live set of
+// fixed size nodes and replaces a random one `ops` times, with malloc and free
+// and then with a pool; its CSV output gives the time per replacement and the
+// bytes held.
+// Usage: object_pool [ops] [node_size]
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "naive_malloc.h"
+#include "test_util.h"
+
+const size_t DEFAULT_OPS = 10000000;
+const size_t DEFAULT_NODE_SIZE = 48;
+#define LIVE_NODES 100000
+// Enough objects to fill many blocks
+#define NUM_CHECKED 50000
+
+const char *MODE_NAMES[] = {"malloc_free", "object_pool"};
+#define NUM_MODES (sizeof(MODE_NAMES) / sizeof(MODE_NAMES[0]))
+
+// Returns true iff the page holding `address` is mapped
+int is_mapped(uintptr_t address) {
+  unsigned char resident;
+  void *page = (void *)(address & ~(uintptr_t)(getpagesize() - 1));
+  return mincore(page, 1, &resident) == 0 || errno != ENOMEM;
+}
+
+pool_stats_t get_stats(object_pool_t *pool) {
+  pool_stats_t stats;
+  pool_get_stats(pool, &stats);
+  return stats;
+}
+
+// Objects of `size` bytes aligned to `alignment` don't overlap, and freeing
+// them all unmaps every block but one
+void test_pool(size_t size, size_t alignment) {
+  static unsigned char *ptrs[NUM_CHECKED];
+  object_pool_t *pool = pool_create(size, alignment);
+  if (pool == NULL) fail("create", 1, 0);
+  for (size_t i = 0; i < NUM_CHECKED; i++) {
+    ptrs[i] = pool_alloc(pool);
+    if ((uintptr_t)ptrs[i] % alignment != 0) fail("alignment", alignment, 0);
+    memset(ptrs[i], i % 256, size);
+  }
+  for (size_t i = 0; i < NUM_CHECKED; i++) {
+    for (size_t j = 0; j < size; j++) {
+      if (ptrs[i][j] != i % 256) fail("byte of object", i % 256, ptrs[i][j]);
+    }
+  }
+  pool_stats_t stats = get_stats(pool);
+  if (stats.objects != NUM_CHECKED) {
+    fail("objects", NUM_CHECKED, stats.objects);
+  }
+  if (stats.object_size != size) fail("object size", size, stats.object_size);
+  if (stats.blocks * (stats.block_size / stats.slot_size) < NUM_CHECKED) {
+    fail("blocks", NUM_CHECKED / (stats.block_size / stats.slot_size),
+         stats.blocks);
+  }
+  if (stats.block_bytes != stats.blocks * stats.block_size) {
+    fail("block bytes", stats.blocks * stats.block_size, stats.block_bytes);
+  }
+
+  // Freed objects are handed out again, and no block is mapped for them
+  size_t blocks = stats.blocks;
+  for (size_t i = 0; i < NUM_CHECKED; i += 2) pool_free(pool, ptrs[i]);
+  for (size_t i = 0; i < NUM_CHECKED; i += 2) ptrs[i] = pool_alloc(pool);
+  if (get_stats(pool).blocks != blocks) {
+    fail("blocks after refill", blocks, get_stats(pool).blocks);
+  }
+
+  // Volatile, so the compiler doesn't take the checks for uses of freed
+  // memory
+  static volatile uintptr_t addresses[NUM_CHECKED];
+  for (size_t i = 0; i < NUM_CHECKED; i++) {
+    addresses[i] = (uintptr_t)ptrs[i];
+    pool_free(pool, ptrs[i]);
+  }
+  stats = get_stats(pool);
+  if (stats.objects != 0) fail("objects after free", 0, stats.objects);
+  if (stats.blocks != 1 || stats.empty_blocks != 1) {
+    fail("blocks after free", 1, stats.blocks);
+  }
+  // Only the objects of the block kept are still mapped
+  size_t mapped = 0;
+  for (size_t i = 0; i < NUM_CHECKED; i++) mapped += is_mapped(addresses[i]);
+  if (mapped == 0 || mapped > stats.block_size / stats.slot_size) {
+    fail("objects still mapped", stats.block_size / stats.slot_size, mapped);
+  }
+  if (stats.munmap_calls < blocks - 1) {
+    fail("munmap calls", blocks - 1, stats.munmap_calls);
+  }
+  pool_destroy(pool);
+}
+
+// Replace random nodes of a live set `ops` times with malloc and free or with
+// a pool, and print the time per replacement
+void run_mode(size_t mode, size_t ops, size_t node_size) {
+  static void *live[LIVE_NODES];
+  object_pool_t *pool = pool_create(node_size, 0);
+  for (size_t i = 0; i < LIVE_NODES; i++) {
+    live[i] = mode == 0 ? malloc(node_size) : pool_alloc(pool);
+    memset(live[i], 1, node_size);
+  }
+
+  uint64_t start = get_time_ns();
+  for (size_t i = 0; i < ops; i++) {
+    size_t slot = random() % LIVE_NODES;
+    if (mode == 0) {
+      free(live[slot]);
+      live[slot] = malloc(node_size);
+    } else {
+      pool_free(pool, live[slot]);
+      live[slot] = pool_alloc(pool);
+    }
+    *(char *)live[slot] = 1;
+  }
+  uint64_t elapsed = get_time_ns() - start;
+
+  pool_stats_t stats = get_stats(pool);
+  printf("%s,%lu,%lu,%.1f,%lu\n", MODE_NAMES[mode], ops, node_size,
+         (double)elapsed / ops,
+         mode == 0 ? mallinfo2().arena : stats.block_bytes);
+  fflush(stdout);
+  pool_destroy(pool);
+}
+
+int main(int argc, char **argv) {
+  size_t ops = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_OPS;
+  size_t node_size = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_NODE_SIZE;
+  if (pool_create(8, 3) != NULL) fail("alignment of 3 refused", 0, 1);
+  if (pool_create(8, 8192) != NULL) fail("alignment of 8192 refused", 0, 1);
+  test_pool(1, 1);
+  test_pool(24, 8);
+  test_pool(48, 16);
+  test_pool(100, 64);
+  test_pool(5000, 4096);
+
+  printf("mode,ops,node_size,ns_per_op,bytes\n");
+  fflush(stdout);
+  for (size_t mode = 0; mode < NUM_MODES; mode++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      srandom(1);
+      run_mode(mode, ops, node_size);
+      exit(0);
+    }
+    if (!child_succeeded(pid)) return 1;
+  }
+}
@@ -0,0 +1,314 @@
+// Checks the memory resources and allocator of naive_pmr.h, and compares
+// containers using them with containers using std::allocator, which goes
+// through operator new. For each container and allocator, fills the container
+// with `elements` elements, looks each up and destroys it, `rounds` times, and
+// prints a CSV line with the mean nanoseconds per element. Usage:
+// pmr [elements] [rounds]
+
+#include <malloc.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "naive_pmr.h"
+#include "test_util.h"
+
+using naive_malloc::get_arena_resource;
+using naive_malloc::monotonic_region_resource;
+using naive_malloc::sized_allocator;
+
+const size_t DEFAULT_ELEMENTS = 10000;
+const size_t DEFAULT_ROUNDS = 200;
+// Enough allocations of these sizes to take several regions
+const size_t MONOTONIC_ALLOCATIONS = 20000;
+const size_t MONOTONIC_MAX_SIZE = 1000;
+// Larger than the largest region, 1 GB. Only its first and last pages are
+// touched
+const size_t LARGE_ALLOCATION = (size_t)3 << 29;
+
+bool is_aligned(const void *ptr, size_t alignment) {
+  return (uintptr_t)ptr % alignment == 0;
+}
+
+// Bytes of slabs and regions in use
+size_t get_arena_bytes() { return mallinfo2().arena; }
+
+// A type aligned beyond what malloc gives
+struct alignas(64) wide {
+  int value;
+};
+
+// arena_resource hands out aligned memory of any size, deallocated by any
+// instance
+void test_arena_resource() {
+  std::pmr::memory_resource *resource = get_arena_resource();
+  naive_malloc::arena_resource other;
+  if (!resource->is_equal(other)) fail("arena resources equal", 1, 0);
+  if (resource->is_equal(*std::pmr::new_delete_resource())) {
+    fail("arena resource equals new_delete_resource", 0, 1);
+  }
+
+  const size_t sizes[] = {0, 1, 24, 500, 4000, 100000, 1 << 20};
+  const size_t alignments[] = {1, 8, 16, 64, 4096};
+  for (size_t size : sizes) {
+    for (size_t alignment : alignments) {
+      void *ptr = resource->allocate(size, alignment);
+      if (!is_aligned(ptr, alignment)) fail("alignment", alignment, 0);
+      memset(ptr, 1, size);
+      other.deallocate(ptr, size, alignment);
+    }
+  }
+
+  std::pmr::vector<int> vector(resource);
+  for (int i = 0; i < 100000; i++) vector.push_back(i);
+  for (int i = 0; i < 100000; i++) {
+    if (vector[i] != i) fail("vector element", i, vector[i]);
+  }
+}
+
+// monotonic_region_resource hands out distinct aligned memory, and gives its
+// regions back on release
+void test_monotonic_resource() {
+  std::vector<std::pair<unsigned char *, size_t>> allocations;
+  allocations.reserve(MONOTONIC_ALLOCATIONS);
+  size_t arena_bytes = get_arena_bytes();
+  {
+    monotonic_region_resource resource;
+    srandom(1);
+    for (size_t i = 0; i < MONOTONIC_ALLOCATIONS; i++) {
+      size_t size = random() % MONOTONIC_MAX_SIZE;
+      size_t alignment = (size_t)1 << (random() % 8);
+      auto ptr =
+          static_cast<unsigned char *>(resource.allocate(size, alignment));
+      if (!is_aligned(ptr, alignment)) fail("alignment", alignment, 0);
+      memset(ptr, i % 256, size);
+      allocations.emplace_back(ptr, size);
+      if (i % 2 == 0) resource.deallocate(ptr, size, alignment);
+    }
+    // Deallocation left the memory alone, so nothing was handed out twice
+    for (size_t i = 0; i < MONOTONIC_ALLOCATIONS; i++) {
+      for (size_t j = 0; j < allocations[i].second; j++) {
+        if (allocations[i].first[j] != i % 256) {
+          fail("byte of allocation", i % 256, allocations[i].first[j]);
+        }
+      }
+    }
+    if (resource.region_bytes() < MONOTONIC_ALLOCATIONS) {
+      fail("region bytes", MONOTONIC_ALLOCATIONS, resource.region_bytes());
+    }
+    size_t held_bytes = arena_bytes + resource.region_bytes();
+    if (get_arena_bytes() < held_bytes) {
+      fail("arena bytes with regions held", held_bytes, get_arena_bytes());
+    }
+
+    resource.release();
+    if (resource.region_bytes() != 0) {
+      fail("region bytes after release", 0, resource.region_bytes());
+    }
+    if (get_arena_bytes() != arena_bytes) {
+      fail("arena bytes after release", arena_bytes, get_arena_bytes());
+    }
+    // The resource can be used again after release
+    void *ptr = resource.allocate(100, 16);
+    memset(ptr, 1, 100);
+  }
+  if (get_arena_bytes() != arena_bytes) {
+    fail("arena bytes after destruction", arena_bytes, get_arena_bytes());
+  }
+}
+
+// monotonic_region_resource serves requests larger than any region with
+// allocations of their own, keeps bump-allocating from its region meanwhile,
+// and frees them on release
+void test_monotonic_large() {
+  monotonic_region_resource resource;
+  auto small = static_cast<unsigned char *>(resource.allocate(100, 16));
+  size_t region_bytes = resource.region_bytes();
+  auto large =
+      static_cast<unsigned char *>(resource.allocate(LARGE_ALLOCATION, 64));
+  if (!is_aligned(large, 64)) fail("alignment of large allocation", 64, 0);
+  large[0] = 1;
+  large[LARGE_ALLOCATION - 1] = 1;
+  if (mallinfo2().hblkhd < LARGE_ALLOCATION) {
+    fail("mapped bytes with large allocation", LARGE_ALLOCATION,
+         mallinfo2().hblkhd);
+  }
+  auto next = static_cast<unsigned char *>(resource.allocate(100, 16));
+  if (resource.region_bytes() != region_bytes || next != small + 112) {
+    fail("region bytes after large allocation", region_bytes,
+         resource.region_bytes());
+  }
+  resource.release();
+  if (mallinfo2().hblkhd >= LARGE_ALLOCATION) {
+    fail("mapped bytes after release", 0, mallinfo2().hblkhd);
+  }
+}
+
+// sized_allocator works for node based containers and over-aligned types
+void test_sized_allocator() {
+  std::map<int, int, std::less<int>, sized_allocator<std::pair<const int, int>>>
+      map;
+  for (int i = 0; i < 10000; i++) map[i * 7 % 10000] = i;
+  for (int i = 0; i < 10000; i += 2) map.erase(i);
+  if (map.size() != 5000) fail("map size", 5000, map.size());
+  for (auto &[key, value] : map) {
+    if (key % 2 == 0 || value * 7 % 10000 != key) {
+      fail("map value", key, value);
+    }
+  }
+
+  std::vector<wide, sized_allocator<wide>> vector;
+  for (int i = 0; i < 1000; i++) {
+    vector.push_back({i});
+    if (!is_aligned(vector.data(), alignof(wide))) {
+      fail("alignment", alignof(wide), 0);
+    }
+  }
+  if (sized_allocator<int>() != sized_allocator<long>()) {
+    fail("sized allocators equal", 1, 0);
+  }
+}
+
+// The containers benchmarked, for an allocator of each element type
+template <template <typename> class Allocator>
+struct containers {
+  using vector = std::vector<int, Allocator<int>>;
+  using map = std::map<int, int, std::less<int>,
+                       Allocator<std::pair<const int, int>>>;
+  using unordered_map =
+      std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+                         Allocator<std::pair<const int, int>>>;
+};
+
+template <typename T>
+using std_allocator = std::allocator<T>;
+template <typename T>
+using pmr_allocator = std::pmr::polymorphic_allocator<T>;
+
+// How each allocator is set up: the allocator a container is constructed with
+// and what to do between rounds
+struct std_setup {
+  template <typename T>
+  using allocator = std_allocator<T>;
+  static constexpr const char *name = "std_allocator";
+  std_allocator<int> get() { return {}; }
+  void end_round() {}
+};
+
+struct sized_setup {
+  template <typename T>
+  using allocator = sized_allocator<T>;
+  static constexpr const char *name = "sized_allocator";
+  sized_allocator<int> get() { return {}; }
+  void end_round() {}
+};
+
+struct arena_setup {
+  template <typename T>
+  using allocator = pmr_allocator<T>;
+  static constexpr const char *name = "arena_resource";
+  pmr_allocator<int> get() { return get_arena_resource(); }
+  void end_round() {}
+};
+
+struct monotonic_setup {
+  template <typename T>
+  using allocator = pmr_allocator<T>;
+  static constexpr const char *name = "monotonic_region_resource";
+  monotonic_region_resource resource;
+  pmr_allocator<int> get() { return &resource; }
+  void end_round() { resource.release(); }
+};
+
+// Random keys, the same for every allocator
+std::vector<int> keys;
+
+template <typename Setup>
+void run_vector(Setup &setup) {
+  typename containers<Setup::template allocator>::vector vector(setup.get());
+  for (int key : keys) vector.push_back(key);
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (vector[i] != keys[i]) fail("vector element", keys[i], vector[i]);
+  }
+}
+
+template <typename Setup>
+void run_map(Setup &setup) {
+  typename containers<Setup::template allocator>::map map(setup.get());
+  for (int key : keys) map.emplace(key, key);
+  for (int key : keys) {
+    if (map.find(key)->second != key) fail("map value", key, 0);
+  }
+  for (int key : keys) map.erase(key);
+}
+
+template <typename Setup>
+void run_unordered_map(Setup &setup) {
+  typename containers<Setup::template allocator>::unordered_map map(
+      setup.get());
+  for (int key : keys) map.emplace(key, key);
+  for (int key : keys) {
+    if (map.find(key)->second != key) fail("unordered_map value", key, 0);
+  }
+  for (int key : keys) map.erase(key);
+}
+
+// Run `run` `rounds` times with each allocator, each in a forked child so
+// none inherits the others' heap, and print the mean time per element
+template <typename Setup>
+void bench(const char *container, void (*run)(Setup &), size_t rounds) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    Setup setup;
+    // Warm up, so the arena's regions and slabs are in place
+    run(setup);
+    setup.end_round();
+    uint64_t start = get_time_ns();
+    for (size_t i = 0; i < rounds; i++) {
+      run(setup);
+      setup.end_round();
+    }
+    uint64_t elapsed = get_time_ns() - start;
+    printf("%s,%s,%lu,%lu,%.1f\n", container, Setup::name, keys.size(), rounds,
+           (double)elapsed / (rounds * keys.size()));
+    fflush(stdout);
+    exit(0);
+  }
+  if (!child_succeeded(pid)) exit(1);
+}
+
+template <typename Setup>
+void bench_containers(size_t rounds) {
+  bench<Setup>("vector", run_vector<Setup>, rounds);
+  bench<Setup>("map", run_map<Setup>, rounds);
+  bench<Setup>("unordered_map", run_unordered_map<Setup>, rounds);
+}
+
+int main(int argc, char **argv) {
+  size_t elements = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ELEMENTS;
+  size_t rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_ROUNDS;
+  test_arena_resource();
+  test_monotonic_resource();
+  test_monotonic_large();
+  test_sized_allocator();
+
+  srandom(1);
+  for (size_t i = 0; i < elements; i++) keys.push_back(random());
+  printf("container,allocator,elements,rounds,ns_per_element\n");
+  fflush(stdout);
+  bench_containers<std_setup>(rounds);
+  bench_containers<sized_setup>(rounds);
+  bench_containers<arena_setup>(rounds);
+  bench_containers<monotonic_setup>(rounds);
+}
@@ -0,0 +1,168 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "naive_malloc.h"
+#include "test_util.h"
+
+const size_t NUM_ALLOCS = 10000;
+const size_t ALLOC_SIZE = 1000;
+const size_t NUM_THREADS = 4;
+const int SAMPLE_BYTES = 16 * 1024;
+const char *PROFILE_PATH = "/tmp/naive_malloc_profile.t.heap";
+
+// Totals from a profile's header, and whether a stack ran through
+// allocate_objects
+typedef struct profile {
+  size_t in_use_count;
+  size_t in_use_bytes;
+  size_t alloc_count;
+  size_t alloc_bytes;
+  size_t rate;
+  bool has_allocate_objects;
+  bool has_mappings;
+} profile_t;
+
+// Allocate every object of `ptrs`. Never inlined, so it shows up in the stacks
+__attribute__((noinline)) void allocate_objects(void **ptrs, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    ptrs[i] = malloc(ALLOC_SIZE);
+  }
+}
+
+profile_t read_profile(const char *path) {
+  profile_t profile;
+  memset(&profile, 0, sizeof(profile));
+  FILE *file = fopen(path, "r");
+  if (file == NULL) fail("profile written", 1, 0);
+
+  char line[4096];
+  if (fgets(line, sizeof(line), file) == NULL ||
+      sscanf(line, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%lu",
+             &profile.in_use_count, &profile.in_use_bytes,
+             &profile.alloc_count, &profile.alloc_bytes, &profile.rate) != 5) {
+    fail("profile header fields", 5, 0);
+  }
+
+  // The return address into allocate_objects is within it, not far past its
+  // start
+  uintptr_t function = (uintptr_t)allocate_objects;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (strcmp(line, "MAPPED_LIBRARIES:\n") == 0) {
+      profile.has_mappings = true;
+      break;
+    }
+    char *frames = strchr(line, '@');
+    while (frames != NULL && (frames = strstr(frames, "0x")) != NULL) {
+      uintptr_t address = strtoul(frames, &frames, 16);
+      if (address > function && address < function + 256) {
+        profile.has_allocate_objects = true;
+      }
+    }
+  }
+
+  fclose(file);
+  return profile;
+}
+
+// About one object is sampled every SAMPLE_BYTES, and samples are forgotten
+// once freed
+void test_sampling() {
+  void **ptrs = malloc(NUM_ALLOCS * sizeof(void *));
+  allocate_objects(ptrs, NUM_ALLOCS);
+
+  if (malloc_profile_write(PROFILE_PATH) != 0) fail("write profile", 0, -1);
+  profile_t profile = read_profile(PROFILE_PATH);
+  size_t expected = NUM_ALLOCS * ALLOC_SIZE / SAMPLE_BYTES;
+  if (profile.in_use_count < expected / 2 ||
+      profile.in_use_count > expected * 2) {
+    fail("sampled objects in use", expected, profile.in_use_count);
+  }
+  if (profile.rate != (size_t)SAMPLE_BYTES) {
+    fail("sampling rate", SAMPLE_BYTES, profile.rate);
+  }
+  if (!profile.has_allocate_objects) fail("stack of the samples", 1, 0);
+  if (!profile.has_mappings) fail("mapped libraries", 1, 0);
+
+  // Reallocated samples are tracked at their new address
+  for (size_t i = 0; i < NUM_ALLOCS; i++) {
+    ptrs[i] = realloc(ptrs[i], 2 * ALLOC_SIZE);
+  }
+  for (size_t i = 0; i < NUM_ALLOCS; i++) {
+    free(ptrs[i]);
+  }
+  free(ptrs);
+
+  malloc_profile_write(PROFILE_PATH);
+  profile_t after = read_profile(PROFILE_PATH);
+  if (after.in_use_count != 0) {
+    fail("samples in use after free", 0, after.in_use_count);
+  }
+  if (after.alloc_count <= profile.alloc_count) {
+    fail("samples of reallocations more than", profile.alloc_count,
+         after.alloc_count);
+  }
+}
+
+void *allocate_and_free(void *unused) {
+  void **ptrs = malloc(NUM_ALLOCS * sizeof(void *));
+  allocate_objects(ptrs, NUM_ALLOCS);
+  for (size_t i = 0; i < NUM_ALLOCS; i++) {
+    free(ptrs[i]);
+  }
+  free(ptrs);
+  return NULL;
+}
+
+// Every thread samples its allocations, and a signal writes a dump
+void test_threads_and_signal() {
+  malloc_profile_write(PROFILE_PATH);
+  profile_t before = read_profile(PROFILE_PATH);
+
+#ifdef THREAD_ARENAS
+  pthread_t threads[NUM_THREADS];
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    pthread_create(&threads[i], NULL, allocate_and_free, NULL);
+  }
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+#else
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    allocate_and_free(NULL);
+  }
+#endif
+
+  if (!mallopt(M_PROFILE_SIGNAL, SIGUSR1)) fail("set profile signal", 1, 0);
+  raise(SIGUSR1);
+  char path[64];
+  snprintf(path, sizeof(path), "naive_malloc.%d.0.heap", getpid());
+  profile_t after = read_profile(path);
+  remove(path);
+  mallopt(M_PROFILE_SIGNAL, 0);
+
+  size_t expected = NUM_THREADS * NUM_ALLOCS * ALLOC_SIZE / SAMPLE_BYTES;
+  size_t sampled = after.alloc_count - before.alloc_count;
+  if (sampled < expected / 2 || sampled > expected * 2) {
+    fail("samples of threads", expected, sampled);
+  }
+  // Libc keeps a few objects of exited threads, which may have been sampled
+  if (after.in_use_count > before.in_use_count + NUM_THREADS) {
+    fail("samples in use after threads exited at most",
+         before.in_use_count + NUM_THREADS, after.in_use_count);
+  }
+}
+
+int main() {
+  if (!mallopt(M_PROFILE_SAMPLE_BYTES, SAMPLE_BYTES)) {
+    fail("enable profiling", 1, 0);
+  }
+  if (chdir("/tmp") != 0) fail("chdir", 0, 1);
+  test_sampling();
+  test_threads_and_signal();
+  printf("profile tests passed\n");
+}
@@ -0,0 +1,120 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const size_t NUM_SLOTS = 1000;
+const size_t NUM_ITERS = 200000;
+const size_t MAX_ALLOC_SIZE = 4096 * 64;
+// Times 3 overflows. Not const, so the compiler can't reject the calls using it
+size_t overflowing_count = SIZE_MAX / 2;
+
+// Bytes this far apart are filled and checked, which is enough to catch
+// contents being lost or overlapping without touching every byte
+const size_t STRIDE = 61;
+
+// Fill every STRIDE-th byte of the `size` at `ptr` with a pattern derived from
+// `seed`
+void fill(unsigned char *ptr, size_t size, size_t seed) {
+  for (size_t i = 0; i < size; i += STRIDE) {
+    ptr[i] = (unsigned char)(seed + i);
+  }
+}
+
+// Exit if the first `size` bytes at `ptr` don't match the pattern of `seed`
+void check(unsigned char *ptr, size_t size, size_t seed, size_t iter) {
+  for (size_t i = 0; i < size; i += STRIDE) {
+    if (ptr[i] != (unsigned char)(seed + i)) {
+      fprintf(stderr, "Byte %lu of %p was lost on iteration %lu\n", i,
+              (void *)ptr, iter);
+      exit(1);
+    }
+  }
+}
+
+// Dirty some memory, free it, then make sure calloc hands out zeroes
+void test_calloc() {
+  for (size_t size = 1; size <= MAX_ALLOC_SIZE; size *= 3) {
+    unsigned char *dirty = malloc(size);
+    memset(dirty, 0xff, size);
+    free(dirty);
+
+    unsigned char *ptr = calloc(size, 1);
+    for (size_t i = 0; i < size; i++) {
+      if (ptr[i] != 0) {
+        fprintf(stderr, "calloc(%lu) returned non-zero byte %lu\n", size, i);
+        exit(1);
+      }
+    }
+    free(ptr);
+  }
+
+  if (calloc(overflowing_count, 3) != NULL) {
+    fprintf(stderr, "calloc did not detect overflow\n");
+    exit(1);
+  }
+}
+
+// Randomly grow, shrink and free allocations, checking their contents survive
+void test_realloc() {
+  unsigned char **ptrs = calloc(NUM_SLOTS, sizeof(unsigned char *));
+  size_t *sizes = calloc(NUM_SLOTS, sizeof(size_t));
+  size_t in_place = 0;
+
+  for (size_t i = 0; i < NUM_ITERS; i++) {
+    size_t slot = random() % NUM_SLOTS;
+    // Mostly small steps, which can often be done in place
+    size_t new_size = random() % 4 == 0
+                          ? (size_t)random() % MAX_ALLOC_SIZE
+                          : sizes[slot] + random() % 512 - 256;
+    if (new_size > MAX_ALLOC_SIZE) new_size = random() % 512;
+
+    unsigned char *ptr = realloc(ptrs[slot], new_size);
+    if (new_size == 0) {
+      ptrs[slot] = NULL;
+      sizes[slot] = 0;
+      continue;
+    }
+
+    if (ptr == NULL) {
+      fprintf(stderr, "realloc(%lu) failed on iteration %lu\n", new_size, i);
+      exit(1);
+    }
+    if (ptr == ptrs[slot]) in_place++;
+
+    size_t kept = sizes[slot] < new_size ? sizes[slot] : new_size;
+    check(ptr, kept, slot, i);
+    fill(ptr, new_size, slot);
+    ptrs[slot] = ptr;
+    sizes[slot] = new_size;
+  }
+
+  for (size_t i = 0; i < NUM_SLOTS; i++) {
+    free(ptrs[i]);
+  }
+  free(ptrs);
+  free(sizes);
+  printf("%lu of %lu reallocs done in place\n", in_place, NUM_ITERS);
+}
+
+void test_reallocarray() {
+  void *ptr = malloc(16);
+  if (reallocarray(ptr, overflowing_count, 3) != NULL) {
+    fprintf(stderr, "reallocarray did not detect overflow\n");
+    exit(1);
+  }
+
+  ptr = reallocarray(ptr, 100, sizeof(size_t));
+  if (ptr == NULL) {
+    fprintf(stderr, "reallocarray failed\n");
+    exit(1);
+  }
+  free(ptr);
+}
+
+int main() {
+  test_calloc();
+  test_realloc();
+  test_reallocarray();
+  printf("realloc tests passed\n");
+}
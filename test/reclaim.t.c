@@ -0,0 +1,240 @@
+// With M_BACKGROUND_RECLAIM on, free leaves unmapping and purging to the
+// reclaim thread. The checks cover that, a thread that exits and a forked
+// child; the benchmark then churns a live set with objects large enough for a
+// mapping of their own, timing each free with the thread off and on, and
+// prints the latency percentiles and munmap calls as CSV.
+// Usage: reclaim [ops]
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "naive_malloc.h"
+#include "test_util.h"
+
+const size_t DEFAULT_OPS = 400000;
+const size_t LIVE_OBJECTS = 2000;
+// Objects are up to this size, and one in MAPPED_ONE_IN is a mapped chunk of
+// up to MAX_MAPPED_SIZE
+const size_t MAX_OBJECT_SIZE = 16384;
+const size_t MAPPED_ONE_IN = 16;
+const size_t MAPPED_SIZE = 256 * 1024;
+const size_t MAX_MAPPED_SIZE = 1024 * 1024;
+// Enough small objects to fill several slabs, and chunks to fill regions
+const size_t SMALL_SIZE = 64;
+#define NUM_SMALL 4096
+const size_t CHUNK_SIZE = 4000;
+#define NUM_CHUNKS 256
+// Long enough that the thread makes no pass during a check
+const int IDLE_INTERVAL_MS = 3600 * 1000;
+const int INTERVAL_MS = 10;
+const int WAIT_MS = 5000;
+
+const char *MODE_NAMES[] = {"off", "on"};
+#define NUM_MODES (sizeof(MODE_NAMES) / sizeof(MODE_NAMES[0]))
+
+void sleep_ms(long ms) {
+  struct timespec ts = {ms / 1000, ms % 1000 * 1000000};
+  nanosleep(&ts, NULL);
+}
+
+// Returns true iff the page holding `address` is mapped
+int is_mapped(uintptr_t address) {
+  unsigned char resident;
+  void *page = (void *)(address & ~(uintptr_t)(getpagesize() - 1));
+  return mincore(page, 1, &resident) == 0 || errno != ENOMEM;
+}
+
+// Returns true iff the page holding `address` is mapped and backed
+int is_resident(uintptr_t address) {
+  unsigned char resident = 0;
+  void *page = (void *)(address & ~(uintptr_t)(getpagesize() - 1));
+  return mincore(page, 1, &resident) == 0 && (resident & 1);
+}
+
+size_t get_munmap_calls() { return get_malloc_stats().munmap_calls; }
+
+size_t get_cached_region_bytes() {
+  return get_malloc_stats().cached_region_bytes;
+}
+
+// Allocate and touch `count` objects of `size` bytes into `ptrs`
+void allocate(void **ptrs, size_t count, size_t size) {
+  for (size_t i = 0; i < count; i++) {
+    ptrs[i] = malloc(size);
+    memset(ptrs[i], 1, size);
+  }
+}
+
+void free_all(void **ptrs, size_t count) {
+  for (size_t i = 0; i < count; i++) free(ptrs[i]);
+}
+
+// While the thread idles, free makes no munmap or madvise call: a mapped chunk
+// stays mapped, emptied slabs keep their pages and emptied regions are cached
+// even though the cache holds none. Stopping the thread returns all of it
+void test_deferred() {
+  static void *small[NUM_SMALL];
+  static void *chunks[NUM_CHUNKS];
+  if (!mallopt(M_BACKGROUND_RECLAIM, IDLE_INTERVAL_MS)) {
+    fail("start reclaim thread", 1, 0);
+  }
+
+  void *mapped = malloc(MAPPED_SIZE);
+  memset(mapped, 1, MAPPED_SIZE);
+  // Volatile, so the compiler doesn't take the checks for uses of freed
+  // memory
+  volatile uintptr_t mapped_address = (uintptr_t)mapped;
+  allocate(small, NUM_SMALL, SMALL_SIZE);
+  allocate(chunks, NUM_CHUNKS, CHUNK_SIZE);
+  // Past the first page of its slab, whose header is written when the slab is
+  // given back
+  uintptr_t small_address = (uintptr_t)small[NUM_SMALL / 16];
+  size_t munmap_calls = get_munmap_calls();
+  free(mapped);
+  free_all(small, NUM_SMALL);
+  free_all(chunks, NUM_CHUNKS);
+
+  if (get_munmap_calls() != munmap_calls) {
+    fail("munmap calls by free", munmap_calls, get_munmap_calls());
+  }
+  if (!is_mapped(mapped_address)) fail("freed mapped chunk still mapped", 1, 0);
+  if (!is_resident(small_address)) fail("emptied slab still resident", 1, 0);
+  if (get_cached_region_bytes() == 0) {
+    fail("emptied regions cached", 1, 0);
+  }
+
+  if (!mallopt(M_BACKGROUND_RECLAIM, 0)) fail("stop reclaim thread", 1, 0);
+  if (is_mapped(mapped_address)) fail("freed mapped chunk unmapped", 0, 1);
+  if (is_resident(small_address)) fail("emptied slab given back", 0, 1);
+  if (get_cached_region_bytes() != 0) {
+    fail("cached region bytes", 0, get_cached_region_bytes());
+  }
+  if (get_munmap_calls() <= munmap_calls + 1) {
+    fail("munmap calls by the reclaim thread", munmap_calls + 2,
+         get_munmap_calls());
+  }
+}
+
+// Frees regions in an arena of its own in builds with one per thread
+void *free_regions(void *unused) {
+  static void *chunks[NUM_CHUNKS];
+  allocate(chunks, NUM_CHUNKS, CHUNK_SIZE);
+  free_all(chunks, NUM_CHUNKS);
+  return NULL;
+}
+
+// The running thread unmaps freed mapped chunks and empties the region caches
+// of every arena on its own
+void test_thread() {
+  if (!mallopt(M_BACKGROUND_RECLAIM, INTERVAL_MS)) {
+    fail("start reclaim thread", 1, 0);
+  }
+  void *mapped = malloc(MAPPED_SIZE);
+  memset(mapped, 1, MAPPED_SIZE);
+  volatile uintptr_t mapped_address = (uintptr_t)mapped;
+  free(mapped);
+  pthread_t thread;
+  pthread_create(&thread, NULL, free_regions, NULL);
+  pthread_join(thread, NULL);
+
+  for (int waited = 0;
+       is_mapped(mapped_address) || get_cached_region_bytes() != 0;
+       waited += INTERVAL_MS) {
+    if (waited >= WAIT_MS) {
+      fail("cached region bytes after waiting", 0, get_cached_region_bytes());
+    }
+    sleep_ms(INTERVAL_MS);
+  }
+  if (!mallopt(M_BACKGROUND_RECLAIM, 0)) fail("stop reclaim thread", 1, 0);
+}
+
+// A forked child returns memory itself
+void test_fork() {
+  mallopt(M_BACKGROUND_RECLAIM, IDLE_INTERVAL_MS);
+  void *mapped = malloc(MAPPED_SIZE);
+  volatile uintptr_t mapped_address = (uintptr_t)mapped;
+  pid_t pid = fork();
+  if (pid == 0) {
+    free(mapped);
+    exit(is_mapped(mapped_address));
+  }
+  if (!child_succeeded(pid)) {
+    fail("chunk unmapped in forked child", 0, 1);
+  }
+  free(mapped);
+  mallopt(M_BACKGROUND_RECLAIM, 0);
+}
+
+int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Replace random objects of a live set `ops` times with background reclaim
+// off or on, and print the free latencies
+void run_mode(size_t mode, size_t ops) {
+  if (mode == 1 && !mallopt(M_BACKGROUND_RECLAIM, INTERVAL_MS)) {
+    fail("start reclaim thread", 1, 0);
+  }
+  void **live = calloc(LIVE_OBJECTS, sizeof(void *));
+  uint64_t *latencies = malloc(ops * sizeof(uint64_t));
+  size_t munmap_calls = get_munmap_calls();
+  for (size_t i = 0; i < ops; i++) {
+    size_t slot = random() % LIVE_OBJECTS;
+    uint64_t start = get_time_ns();
+    free(live[slot]);
+    latencies[i] = get_time_ns() - start;
+
+    size_t size = random() % MAPPED_ONE_IN == 0
+                      ? MAPPED_SIZE + random() % (MAX_MAPPED_SIZE - MAPPED_SIZE)
+                      : 1 + random() % MAX_OBJECT_SIZE;
+    live[slot] = malloc(size);
+    memset(live[slot], 1, size < 256 ? size : 256);
+  }
+  munmap_calls = get_munmap_calls() - munmap_calls;
+
+  qsort(latencies, ops, sizeof(uint64_t), compare_u64);
+  printf("%s,%lu,%lu,%lu,%lu,%lu,%lu\n", MODE_NAMES[mode], ops,
+         latencies[ops / 2], latencies[ops * 99 / 100],
+         latencies[ops * 999 / 1000], latencies[ops - 1], munmap_calls);
+  fflush(stdout);
+
+  free_all(live, LIVE_OBJECTS);
+  free(live);
+  free(latencies);
+  mallopt(M_BACKGROUND_RECLAIM, 0);
+}
+
+int main(int argc, char **argv) {
+  size_t ops = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_OPS;
+  // Every free goes to the arena, and every emptied region is unmapped once
+  // the reclaim thread gets to it
+  mallopt(M_TCACHE_COUNT, 0);
+  mallopt(M_REGION_CACHE_COUNT, 0);
+  test_deferred();
+  test_thread();
+  test_fork();
+  mallopt(M_TCACHE_COUNT, 32);
+  mallopt(M_REGION_CACHE_COUNT, 8);
+
+  printf("mode,ops,free_p50_ns,free_p99_ns,free_p999_ns,free_max_ns,"
+         "munmap_calls\n");
+  fflush(stdout);
+  for (size_t mode = 0; mode < NUM_MODES; mode++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      srandom(1);
+      run_mode(mode, ops);
+      exit(0);
+    }
+    if (!child_succeeded(pid)) return 1;
+  }
+}
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "naive_malloc.h"
+#include "test_util.h"
+
+// Too large for a slab or the per-thread cache, so every object is a chunk
+const size_t OBJECT_SIZE = 4000;
+#define MAX_OBJECTS 4096
+const size_t KB = 1024;
+const size_t MB = 1024 * 1024;
+// Long enough that no region size decays during a test
+const int NO_DECAY_MS = 3600 * 1000;
+const int DECAY_MS = 50;
+
+// Objects allocated by the current test
+void *objects[MAX_OBJECTS];
+size_t num_objects = 0;
+
+// Allocate objects of `size` bytes until the arena maps a new region, and
+// returns that region's size
+size_t map_next_region(size_t size) {
+  malloc_stats_t before, after;
+  malloc_get_stats(&before);
+  do {
+    if (num_objects == MAX_OBJECTS) fail("objects to map a region", 0, 1);
+    objects[num_objects++] = malloc(size);
+    malloc_get_stats(&after);
+  } while (after.regions == before.regions);
+  return after.region_bytes - before.region_bytes;
+}
+
+// Check the next regions mapped for objects of OBJECT_SIZE are the `count`
+// sizes at `sizes`
+void expect_regions(const char *message, const size_t *sizes, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    size_t size = map_next_region(OBJECT_SIZE);
+    if (size != sizes[i]) fail(message, sizes[i], size);
+  }
+}
+
+// Free the current test's objects, which unmaps their regions
+void free_objects() {
+  for (size_t i = 0; i < num_objects; i++) free(objects[i]);
+  num_objects = 0;
+}
+
+void sleep_ms(long ms) {
+  struct timespec ts = {ms / 1000, ms % 1000 * 1000000};
+  nanosleep(&ts, NULL);
+}
+
+// Region sizes double from the minimum up to the maximum
+void test_growth() {
+  mallopt(M_REGION_MIN_SIZE, 64 * KB);
+  mallopt(M_REGION_MAX_SIZE, MB);
+  mallopt(M_REGION_SIZE_DECAY_MS, NO_DECAY_MS);
+  size_t sizes[] = {64 * KB, 128 * KB, 256 * KB, 512 * KB, MB, MB};
+  expect_regions("grown region size", sizes, sizeof(sizes) / sizeof(*sizes));
+}
+
+// The next region size halves for every decay interval without a new region.
+// Follows test_growth, with the maximum size next
+void test_decay() {
+  mallopt(M_REGION_SIZE_DECAY_MS, DECAY_MS);
+  // Two and a half intervals, as the clock is coarse
+  sleep_ms(DECAY_MS * 5 / 2);
+  size_t sizes[] = {256 * KB, 512 * KB, MB};
+  expect_regions("decayed region size", sizes, sizeof(sizes) / sizeof(*sizes));
+  free_objects();
+
+  // Without decay there is no growth
+  mallopt(M_REGION_SIZE_DECAY_MS, 0);
+  size_t min_sizes[] = {64 * KB, 64 * KB, 64 * KB};
+  expect_regions("region size without decay", min_sizes,
+                 sizeof(min_sizes) / sizeof(*min_sizes));
+  free_objects();
+}
+
+// A request larger than the maximum region size still gets a region it fits
+// in, and invalid sizes are rejected
+void test_limits() {
+  mallopt(M_REGION_MAX_SIZE, 64 * KB);
+  mallopt(M_REGION_SIZE_DECAY_MS, NO_DECAY_MS);
+  size_t size = map_next_region(100 * KB);
+  if (size != 128 * KB) fail("region size for a large request", 128 * KB, size);
+  free_objects();
+
+  if (mallopt(M_REGION_MIN_SIZE, 0)) fail("zero minimum accepted", 0, 1);
+  if (mallopt(M_REGION_MAX_SIZE, 1 << 30 | 1)) {
+    fail("maximum over 1 GB accepted", 0, 1);
+  }
+  if (!mallopt(M_REGION_MIN_SIZE, 100 * KB)) fail("minimum accepted", 1, 0);
+  // Rounded up to a power of two
+  size = map_next_region(OBJECT_SIZE);
+  if (size != 128 * KB) fail("rounded minimum region size", 128 * KB, size);
+  free_objects();
+}
+
+// Run in a process started with the sizes set in the environment
+void test_environment() {
+  size_t sizes[] = {128 * KB, 256 * KB, 256 * KB};
+  expect_regions("region size from the environment", sizes,
+                 sizeof(sizes) / sizeof(*sizes));
+  free_objects();
+}
+
+int main(int argc, char **argv) {
+  // Every new region is mapped rather than reused
+  mallopt(M_REGION_CACHE_COUNT, 0);
+  if (argc > 1 && strcmp(argv[1], "env") == 0) {
+    test_environment();
+    return 0;
+  }
+
+  test_growth();
+  test_decay();
+  test_limits();
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    char *env[] = {
+        "NAIVE_MALLOC_REGION_SIZE=min=128k,bogus=1,max=256K,decay_ms=3600000",
+        NULL};
+    execle("/proc/self/exe", argv[0], "env", NULL, env);
+    exit(1);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fail("environment test exit status", 0, WEXITSTATUS(status));
+  }
+  printf("region size tests passed\n");
+}
@@ -0,0 +1,120 @@
+// Checks objects another thread frees come back intact while their owner keeps
+// emptying, releasing and reusing the slabs they live in, and that every slab
+// those frees queue is taken back. The owner allocates batches of small
+// objects, frees half of each itself and passes the other half to a second
+// thread to free. Usage: remote_free [rounds]
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "naive_malloc.h"
+#include "test_util.h"
+
+const size_t DEFAULT_ROUNDS = 20000;
+#define BATCH_SIZE 512
+// Batches cycle through these sizes, so slabs of several classes empty at once
+const size_t SIZES[] = {16, 48, 128, 256};
+#define NUM_SIZES (sizeof(SIZES) / sizeof(SIZES[0]))
+// Slab memory is measured after each wave, and may grow by this much from the
+// first to the last
+const size_t NUM_WAVES = 10;
+const double MAX_GROWTH = 2;
+
+// Objects passed from the owner to the freer, a single producer and single
+// consumer ring
+#define RING_SIZE 1024
+static void *ring[RING_SIZE];
+static atomic_size_t ring_head, ring_tail;
+static atomic_size_t freed;
+static atomic_bool done;
+
+// Objects start with their size, and the rest of their bytes hold its low byte
+void fill(unsigned char *ptr, size_t size) {
+  memcpy(ptr, &size, sizeof(size));
+  memset(ptr + sizeof(size), size % 256, size - sizeof(size));
+}
+
+void check_and_free(unsigned char *ptr) {
+  size_t size;
+  memcpy(&size, ptr, sizeof(size));
+  for (size_t i = sizeof(size); i < size; i++) {
+    if (ptr[i] != size % 256) fail("byte of object", size % 256, ptr[i]);
+  }
+  free(ptr);
+}
+
+void push(void *ptr) {
+  size_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+  while (tail - atomic_load_explicit(&ring_head, memory_order_acquire) ==
+         RING_SIZE) {
+    sched_yield();
+  }
+  ring[tail % RING_SIZE] = ptr;
+  atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+}
+
+void *run_freer(void *unused) {
+  for (;;) {
+    size_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&ring_tail, memory_order_acquire)) {
+      if (atomic_load(&done)) return NULL;
+      sched_yield();
+      continue;
+    }
+    void *ptr = ring[head % RING_SIZE];
+    atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+    check_and_free(ptr);
+    atomic_fetch_add(&freed, 1);
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t rounds = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ROUNDS;
+  // Every free goes straight to its slab, rather than waiting in a cache
+  mallopt(M_TCACHE_COUNT, 0);
+
+  pthread_t freer;
+  pthread_create(&freer, NULL, run_freer, NULL);
+
+  size_t passed = 0;
+  size_t first_bytes = 0, last_bytes = 0;
+  void *ptrs[BATCH_SIZE];
+  for (size_t wave = 0; wave < NUM_WAVES; wave++) {
+    for (size_t round = 0; round < rounds / NUM_WAVES; round++) {
+      size_t size = SIZES[round % NUM_SIZES];
+      for (size_t i = 0; i < BATCH_SIZE; i++) {
+        ptrs[i] = malloc(size);
+        fill(ptrs[i], size);
+      }
+      for (size_t i = 0; i < BATCH_SIZE; i++) {
+        if (i % 2 == 0) {
+          check_and_free(ptrs[i]);
+        } else {
+          push(ptrs[i]);
+          passed++;
+        }
+      }
+    }
+
+    // Wait for the freer to catch up before measuring
+    while (atomic_load(&freed) != passed) sched_yield();
+    last_bytes = get_malloc_stats().slab_bytes;
+    if (wave == 0) first_bytes = last_bytes;
+  }
+
+  atomic_store(&done, true);
+  pthread_join(freer, NULL);
+
+  if (last_bytes > first_bytes * MAX_GROWTH) {
+    fail("slab bytes after all waves", first_bytes, last_bytes);
+  }
+  printf("remote free tests passed, %lu objects freed remotely, %lu KB of "
+         "slabs after the first wave, %lu KB after all\n",
+         passed, first_bytes / 1024, last_bytes / 1024);
+}
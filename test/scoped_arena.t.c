@@ -0,0 +1,154 @@
+// Tests for scoped arenas: allocations are aligned and distinct, a reset
+// reuses the arena's regions and destroying it gives them back. Then times
+// `requests` requests, each allocating `objects` small objects that all die at
+// its end, served by malloc and free and then by a scoped arena, and prints the
+// nanoseconds per object and the mmap calls of each as CSV.
+// Usage: scoped_arena [requests] [objects]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "naive_malloc.h"
+#include "test_util.h"
+
+const size_t DEFAULT_REQUESTS = 2000;
+const size_t DEFAULT_OBJECTS = 5000;
+// Objects of a request are up to this size
+const size_t MAX_OBJECT_SIZE = 256;
+// Enough to take several regions
+#define NUM_CHECKED 20000
+const size_t LARGE_SIZE = 4 << 20;
+
+const char *MODE_NAMES[] = {"malloc_free", "scoped_arena"};
+#define NUM_MODES (sizeof(MODE_NAMES) / sizeof(MODE_NAMES[0]))
+
+// Bytes of slabs and regions in use
+size_t get_arena_bytes() { return mallinfo2().arena; }
+
+size_t get_mmap_calls() { return get_malloc_stats().mmap_calls; }
+
+size_t get_regions(scoped_arena_t *arena) {
+  size_t used_bytes, region_bytes, regions;
+  arena_get_stats(arena, &used_bytes, &region_bytes, &regions);
+  return regions;
+}
+
+// Allocate NUM_CHECKED objects of random sizes and alignments, each filled
+// with its index, into `ptrs`, and check none was overwritten by another
+void fill_and_check(scoped_arena_t *arena, unsigned char **ptrs,
+                    size_t *sizes) {
+  srandom(1);
+  for (size_t i = 0; i < NUM_CHECKED; i++) {
+    sizes[i] = random() % 1000;
+    size_t alignment = (size_t)1 << (random() % 10);
+    ptrs[i] = arena_alloc(arena, sizes[i], alignment);
+    if (ptrs[i] == NULL) fail("allocation", 1, 0);
+    if ((uintptr_t)ptrs[i] % alignment != 0) fail("alignment", alignment, 0);
+    memset(ptrs[i], i % 256, sizes[i]);
+  }
+  for (size_t i = 0; i < NUM_CHECKED; i++) {
+    for (size_t j = 0; j < sizes[i]; j++) {
+      if (ptrs[i][j] != i % 256) fail("byte of object", i % 256, ptrs[i][j]);
+    }
+  }
+}
+
+void test_arena() {
+  static unsigned char *ptrs[NUM_CHECKED];
+  static size_t sizes[NUM_CHECKED];
+  size_t arena_bytes = get_arena_bytes();
+  scoped_arena_t *arena = arena_create(0);
+  if (arena == NULL) fail("create", 1, 0);
+  if (arena_alloc(arena, 8, 3) != NULL) fail("alignment of 3 refused", 0, 1);
+
+  fill_and_check(arena, ptrs, sizes);
+  size_t regions = get_regions(arena);
+  if (regions < 2) fail("regions", 2, regions);
+  unsigned char *first = ptrs[0];
+
+  // The same objects again fit in the regions already held
+  size_t mmap_calls = get_mmap_calls();
+  arena_reset(arena);
+  size_t used_bytes, region_bytes;
+  arena_get_stats(arena, &used_bytes, &region_bytes, &regions);
+  if (used_bytes != 0) fail("used bytes after reset", 0, used_bytes);
+  fill_and_check(arena, ptrs, sizes);
+  if (ptrs[0] != first) fail("first object reused", 1, 0);
+  if (get_regions(arena) != regions) {
+    fail("regions after reset", regions, get_regions(arena));
+  }
+  if (get_mmap_calls() != mmap_calls) {
+    fail("mmap calls after reset", mmap_calls, get_mmap_calls());
+  }
+
+  // Larger than any region so far
+  unsigned char *large = arena_alloc(arena, LARGE_SIZE, 4096);
+  if (large == NULL) fail("large allocation", 1, 0);
+  memset(large, 1, LARGE_SIZE);
+
+  arena_destroy(arena);
+  if (get_arena_bytes() != arena_bytes) {
+    fail("arena bytes after destroy", arena_bytes, get_arena_bytes());
+  }
+}
+
+// Serve `requests` requests of `objects` objects each with malloc and free
+// or with a scoped arena, and print the time per object
+void run_mode(size_t mode, size_t requests, size_t objects) {
+  void **ptrs = malloc(objects * sizeof(void *));
+  size_t *sizes = malloc(objects * sizeof(size_t));
+  for (size_t i = 0; i < objects; i++) {
+    sizes[i] = 16 + random() % (MAX_OBJECT_SIZE - 16);
+  }
+  scoped_arena_t *arena = arena_create(0);
+
+  size_t mmap_calls = get_mmap_calls();
+  uint64_t start = get_time_ns();
+  for (size_t r = 0; r < requests; r++) {
+    if (mode == 0) {
+      for (size_t i = 0; i < objects; i++) {
+        ptrs[i] = malloc(sizes[i]);
+        *(char *)ptrs[i] = 1;
+      }
+      for (size_t i = 0; i < objects; i++) free(ptrs[i]);
+    } else {
+      for (size_t i = 0; i < objects; i++) {
+        ptrs[i] = arena_alloc(arena, sizes[i], 0);
+        *(char *)ptrs[i] = 1;
+      }
+      arena_reset(arena);
+    }
+  }
+  uint64_t elapsed = get_time_ns() - start;
+  mmap_calls = get_mmap_calls() - mmap_calls;
+
+  printf("%s,%lu,%lu,%.1f,%lu\n", MODE_NAMES[mode], requests, objects,
+         (double)elapsed / (requests * objects), mmap_calls);
+  fflush(stdout);
+  arena_destroy(arena);
+  free(ptrs);
+  free(sizes);
+}
+
+int main(int argc, char **argv) {
+  size_t requests = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_REQUESTS;
+  size_t objects = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_OBJECTS;
+  test_arena();
+
+  printf("mode,requests,objects,ns_per_object,mmap_calls\n");
+  fflush(stdout);
+  for (size_t mode = 0; mode < NUM_MODES; mode++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      srandom(1);
+      run_mode(mode, requests, objects);
+      exit(0);
+    }
+    if (!child_succeeded(pid)) return 1;
+  }
+}
@@ -0,0 +1,177 @@
+// Runs waves of threads that allocate, check and free objects of up to 1 KB,
+// passing some to a neighbour to free, first with an arena per thread and then
+// with M_ARENAS_PER_CPU. Objects must come back intact, the shared arenas must
+// stay within the limit across waves and the statistics must add up. The CSV
+// output has the time per operation, the arenas shared, the bytes mapped, and
+// how often threads found their arena held or moved to another.
+// Usage: shared_arenas [threads] [ops_per_thread]
+
+#define _GNU_SOURCE  // sched_getaffinity
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "naive_malloc.h"
+#include "test_util.h"
+
+const size_t DEFAULT_THREADS = 16;
+const size_t DEFAULT_OPS = 200000;
+const size_t MAX_ALLOC_SIZE = 1024;
+#define SLOTS_PER_THREAD 1024
+#define MAX_THREADS 256
+// Every this many operations, a thread hands one of its objects to the next
+// thread, which checks and frees it
+const size_t HANDOFF_INTERVAL = 64;
+const size_t NUM_WAVES = 3;
+const int ARENAS_PER_CPU = 1;
+
+const char *MODE_NAMES[] = {"thread_arenas", "shared_arenas"};
+#define NUM_MODES (sizeof(MODE_NAMES) / sizeof(MODE_NAMES[0]))
+
+typedef struct object {
+  unsigned char *ptr;
+  size_t size;
+} object_t;
+
+static size_t num_threads;
+static size_t ops_per_thread;
+static _Atomic(object_t *) handoff_slots[MAX_THREADS];
+
+// Objects are filled with the low byte of their size, so any thread can check
+// them
+void fill(object_t *object, size_t size) {
+  object->size = size;
+  object->ptr = malloc(size);
+  memset(object->ptr, size % 256, size);
+}
+
+void check_and_free(object_t *object) {
+  for (size_t i = 0; i < object->size; i++) {
+    if (object->ptr[i] != object->size % 256) {
+      fail("byte of object", object->size % 256, object->ptr[i]);
+    }
+  }
+  free(object->ptr);
+  object->ptr = NULL;
+}
+
+void *run_thread(void *arg) {
+  size_t id = (uintptr_t)arg;
+  size_t rng = id * 2654435761u + 1;
+  static __thread object_t slots[SLOTS_PER_THREAD];
+
+  for (size_t i = 0; i < ops_per_thread; i++) {
+    object_t *object = &slots[next_random(&rng) % SLOTS_PER_THREAD];
+    if (object->ptr == NULL) {
+      fill(object, next_random(&rng) % MAX_ALLOC_SIZE + 1);
+    } else {
+      check_and_free(object);
+    }
+
+    if (i % HANDOFF_INTERVAL == 0) {
+      // Check and free whatever the previous thread left for us
+      object_t *given = malloc(sizeof(object_t));
+      fill(given, next_random(&rng) % MAX_ALLOC_SIZE + 1);
+      object_t *taken =
+          atomic_exchange(&handoff_slots[(id + 1) % num_threads], given);
+      if (taken != NULL) {
+        check_and_free(taken);
+        free(taken);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < SLOTS_PER_THREAD; i++) {
+    if (slots[i].ptr != NULL) check_and_free(&slots[i]);
+  }
+  return NULL;
+}
+
+// Run waves of `num_threads` threads with or without shared arenas, and print
+// the time per operation
+void run_mode(size_t mode) {
+  size_t num_cpus = 1;
+  cpu_set_t cpus;
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+    num_cpus = CPU_COUNT(&cpus);
+  }
+  size_t max_arenas = ARENAS_PER_CPU * num_cpus;
+  if (mode == 1 && mallopt(M_ARENAS_PER_CPU, ARENAS_PER_CPU) != 1) {
+    fail("mallopt", 1, 0);
+  }
+
+  size_t allocated_bytes = 0;
+  uint64_t elapsed = 0;
+  for (size_t wave = 0; wave < NUM_WAVES; wave++) {
+    pthread_t threads[MAX_THREADS];
+    uint64_t start = get_time_ns();
+    for (size_t i = 0; i < num_threads; i++) {
+      pthread_create(&threads[i], NULL, run_thread, (void *)(uintptr_t)i);
+    }
+    for (size_t i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+    elapsed += get_time_ns() - start;
+
+    for (size_t i = 0; i < num_threads; i++) {
+      object_t *left = atomic_exchange(&handoff_slots[i], NULL);
+      if (left != NULL) {
+        check_and_free(left);
+        free(left);
+      }
+    }
+
+    // Counters of shared arenas and of the threads' own arenas still add up.
+    // The first wave leaves what libc keeps for reusing threads allocated
+    malloc_stats_t stats = get_malloc_stats();
+    if (wave == 0) allocated_bytes = stats.allocated_bytes;
+    if (stats.allocated_bytes != allocated_bytes) {
+      fail("allocated bytes after freeing everything", allocated_bytes,
+           stats.allocated_bytes);
+    }
+    // New waves join the arenas the last one left, rather than making more
+    if (mode == 1 &&
+        (stats.shared_arenas == 0 || stats.shared_arenas > max_arenas)) {
+      fail("shared arenas", max_arenas, stats.shared_arenas);
+    }
+    if (mode == 0 && stats.shared_arenas != 0) {
+      fail("shared arenas", 0, stats.shared_arenas);
+    }
+  }
+
+  malloc_stats_t stats = get_malloc_stats();
+
+  printf("%s,%lu,%lu,%.1f,%lu,%lu,%lu,%lu\n", MODE_NAMES[mode], num_threads,
+         ops_per_thread, (double)elapsed / (NUM_WAVES * num_threads *
+                                            ops_per_thread),
+         stats.shared_arenas, stats.mapped_bytes, stats.arena_contentions,
+         stats.arena_migrations);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  num_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_THREADS;
+  ops_per_thread = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_OPS;
+  if (num_threads == 0 || num_threads > MAX_THREADS) {
+    fprintf(stderr, "threads must be between 1 and %d\n", MAX_THREADS);
+    return 1;
+  }
+
+  printf("mode,threads,ops_per_thread,ns_per_op,shared_arenas,mapped_bytes,"
+         "contentions,migrations\n");
+  fflush(stdout);
+  for (size_t mode = 0; mode < NUM_MODES; mode++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      run_mode(mode);
+      exit(0);
+    }
+    if (!child_succeeded(pid)) return 1;
+  }
+}
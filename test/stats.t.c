@@ -0,0 +1,146 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "naive_malloc.h"
+#include "test_util.h"
+
+const size_t NUM_ALLOCS = 10000;
+const size_t NUM_THREADS = 8;
+const size_t HUGE_SIZE = 1 << 20;
+
+// Allocations show up in the allocated bytes and their class's counts, and go
+// away once freed
+void test_counts() {
+  malloc_stats_t before, during, after;
+  void **ptrs = malloc(NUM_ALLOCS * sizeof(void *));
+  malloc_get_stats(&before);
+
+  size_t bytes = 0;
+  for (size_t i = 0; i < NUM_ALLOCS; i++) {
+    ptrs[i] = malloc(100);
+    bytes += malloc_usable_size(ptrs[i]);
+  }
+  malloc_get_stats(&during);
+
+  if (during.allocated_bytes - before.allocated_bytes != bytes) {
+    fail("allocated bytes", bytes,
+         during.allocated_bytes - before.allocated_bytes);
+  }
+  size_t mallocs = 0;
+  for (size_t i = 0; i < MALLOC_STATS_CLASSES; i++) {
+    mallocs += during.mallocs[i] - before.mallocs[i];
+  }
+  if (mallocs != NUM_ALLOCS) fail("mallocs", NUM_ALLOCS, mallocs);
+  if (during.active_bytes < during.allocated_bytes) {
+    fail("active bytes at least", during.allocated_bytes, during.active_bytes);
+  }
+
+  for (size_t i = 0; i < NUM_ALLOCS; i++) {
+    free(ptrs[i]);
+  }
+  malloc_get_stats(&after);
+  if (after.allocated_bytes != before.allocated_bytes) {
+    fail("allocated bytes after free", before.allocated_bytes,
+         after.allocated_bytes);
+  }
+  free(ptrs);
+}
+
+// Huge allocations are mapped chunks, and realloc keeps the counts right
+void test_mapped_chunks() {
+  malloc_stats_t before, during, after;
+  malloc_get_stats(&before);
+
+  void *ptr = malloc(HUGE_SIZE);
+  ptr = realloc(ptr, 2 * HUGE_SIZE);
+  malloc_get_stats(&during);
+  if (during.mmap_chunks != before.mmap_chunks + 1) {
+    fail("mapped chunks", before.mmap_chunks + 1, during.mmap_chunks);
+  }
+  if (during.mmap_chunk_bytes - before.mmap_chunk_bytes !=
+      malloc_usable_size(ptr)) {
+    fail("mapped chunk bytes", malloc_usable_size(ptr),
+         during.mmap_chunk_bytes - before.mmap_chunk_bytes);
+  }
+  if (during.allocated_bytes - before.allocated_bytes !=
+      malloc_usable_size(ptr)) {
+    fail("allocated bytes of a mapped chunk", malloc_usable_size(ptr),
+         during.allocated_bytes - before.allocated_bytes);
+  }
+
+  struct mallinfo2 info = mallinfo2();
+  if (info.hblkhd != during.mmap_chunk_bytes) {
+    fail("mallinfo2 hblkhd", during.mmap_chunk_bytes, info.hblkhd);
+  }
+
+  free(ptr);
+  malloc_get_stats(&after);
+  if (after.mmap_chunks != before.mmap_chunks ||
+      after.allocated_bytes != before.allocated_bytes) {
+    fail("mapped chunks after free", before.mmap_chunks, after.mmap_chunks);
+  }
+  if (after.munmap_calls <= before.munmap_calls) {
+    fail("munmap calls more than", before.munmap_calls, after.munmap_calls);
+  }
+}
+
+void *allocate_and_exit(void *ptrs) {
+  for (size_t i = 0; i < NUM_ALLOCS; i++) {
+    ((void **)ptrs)[i] = malloc(i % 1000 + 1);
+  }
+  return NULL;
+}
+
+// Counters of threads that have exited are still merged in, and objects they
+// allocated can be freed by another thread
+void test_threads() {
+  malloc_stats_t before, during, after;
+  void **ptrs = malloc(NUM_THREADS * NUM_ALLOCS * sizeof(void *));
+  malloc_get_stats(&before);
+
+#ifdef THREAD_ARENAS
+  pthread_t threads[NUM_THREADS];
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    pthread_create(&threads[i], NULL, allocate_and_exit,
+                   ptrs + i * NUM_ALLOCS);
+  }
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+#else
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    allocate_and_exit(ptrs + i * NUM_ALLOCS);
+  }
+#endif
+
+  // Thread creation allocates too, and libc keeps some of that around, so
+  // only a lower bound holds until the objects are freed
+  size_t bytes = 0;
+  for (size_t i = 0; i < NUM_THREADS * NUM_ALLOCS; i++) {
+    bytes += malloc_usable_size(ptrs[i]);
+  }
+  malloc_get_stats(&during);
+  if (during.allocated_bytes - before.allocated_bytes < bytes) {
+    fail("allocated bytes of exited threads at least", bytes,
+         during.allocated_bytes - before.allocated_bytes);
+  }
+
+  for (size_t i = 0; i < NUM_THREADS * NUM_ALLOCS; i++) {
+    free(ptrs[i]);
+  }
+  malloc_get_stats(&after);
+  if (during.allocated_bytes - after.allocated_bytes != bytes) {
+    fail("bytes freed from other threads' objects", bytes,
+         during.allocated_bytes - after.allocated_bytes);
+  }
+  free(ptrs);
+}
+
+int main() {
+  test_counts();
+  test_mapped_chunks();
+  test_threads();
+  malloc_stats();
+  printf("stats tests passed\n");
+}
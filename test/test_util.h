@@ -0,0 +1,48 @@
+// Helpers shared by the tests. Include naive_malloc.h first for
+// get_malloc_stats
+
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+
+// Report a check that failed and exit
+static inline void fail(const char *message, size_t expected, size_t actual) {
+  fprintf(stderr, "%s: expected %lu, got %lu\n", message, expected, actual);
+  exit(1);
+}
+
+static inline uint64_t get_time_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift, as random() takes a lock and would serialize the threads itself
+static inline size_t next_random(size_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// Wait for the forked child `pid`. Returns true iff it exited with status 0
+static inline int child_succeeded(pid_t pid) {
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+#ifdef NAIVE_MALLOC_H
+static inline malloc_stats_t get_malloc_stats() {
+  malloc_stats_t stats;
+  malloc_get_stats(&stats);
+  return stats;
+}
+#endif
+
+#endif
@@ -0,0 +1,90 @@
+// Checks the arena of an exited thread is released and adopted by the next new
+// thread: objects it left behind stay valid and can be freed from any thread,
+// and memory doesn't grow with the number of threads that have come and gone
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "naive_malloc.h"
+#include "test_util.h"
+
+// Objects each thread allocates, of up to MAX_OBJECT_SIZE bytes, and how many
+// of them it leaves behind
+#define NUM_OBJECTS 500
+#define NUM_LEFT 50
+const size_t MAX_OBJECT_SIZE = 8192;
+const size_t NUM_ROUNDS = 1000;
+#define THREADS_PER_ROUND 4
+// Rounds after which memory is measured, and by how much it may grow by the
+// end
+const size_t WARMUP_ROUNDS = 100;
+const double MAX_GROWTH = 2;
+
+typedef struct object {
+  unsigned char *ptr;
+  size_t size;
+} object_t;
+
+// Objects left behind by each thread of a round
+static object_t left[THREADS_PER_ROUND][NUM_LEFT];
+
+size_t get_mapped_bytes() { return get_malloc_stats().mapped_bytes; }
+
+void fill(object_t *object, size_t seed) {
+  object->size = 1 + random() % MAX_OBJECT_SIZE;
+  object->ptr = malloc(object->size);
+  memset(object->ptr, seed % 256, object->size);
+}
+
+void check(object_t *object, size_t seed) {
+  for (size_t i = 0; i < object->size; i++) {
+    if (object->ptr[i] != seed % 256) {
+      fail("byte of object left behind", seed % 256, object->ptr[i]);
+    }
+  }
+}
+
+// Allocate objects and free all but NUM_LEFT, which are left for the main
+// thread to check and free after this thread has exited
+void *run_thread(void *arg) {
+  size_t index = (uintptr_t)arg;
+  static __thread object_t objects[NUM_OBJECTS];
+  for (size_t i = 0; i < NUM_OBJECTS; i++) fill(&objects[i], index + i);
+  for (size_t i = NUM_LEFT; i < NUM_OBJECTS; i++) free(objects[i].ptr);
+  memcpy(left[index], objects, sizeof(left[index]));
+  return NULL;
+}
+
+int main() {
+  size_t warm_bytes = 0;
+  for (size_t round = 0; round < NUM_ROUNDS; round++) {
+    pthread_t threads[THREADS_PER_ROUND];
+    for (size_t i = 0; i < THREADS_PER_ROUND; i++) {
+      pthread_create(&threads[i], NULL, run_thread, (void *)(uintptr_t)i);
+    }
+    for (size_t i = 0; i < THREADS_PER_ROUND; i++) {
+      pthread_join(threads[i], NULL);
+    }
+
+    // Every thread has exited, so these are freed into arenas no thread owns
+    for (size_t i = 0; i < THREADS_PER_ROUND; i++) {
+      for (size_t j = 0; j < NUM_LEFT; j++) {
+        check(&left[i][j], i + j);
+        free(left[i][j].ptr);
+      }
+    }
+    if (round == WARMUP_ROUNDS) warm_bytes = get_mapped_bytes();
+  }
+
+  size_t mapped_bytes = get_mapped_bytes();
+  if (mapped_bytes > warm_bytes * MAX_GROWTH) {
+    fail("mapped bytes after all rounds", warm_bytes, mapped_bytes);
+  }
+  printf("thread exit tests passed, %lu threads, %lu KB mapped after %lu, "
+         "%lu KB after all\n",
+         NUM_ROUNDS * THREADS_PER_ROUND, warm_bytes / 1024,
+         WARMUP_ROUNDS * THREADS_PER_ROUND, mapped_bytes / 1024);
+}
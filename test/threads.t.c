@@ -0,0 +1,86 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "test_util.h"
+
+const size_t MAX_ALLOC_SIZE = 1024;
+const size_t SLOTS_PER_THREAD = 4096;
+const size_t OPS_PER_THREAD = 2000000;
+// Every this many operations, a thread hands one of its allocations to the next
+// thread, which frees it
+const size_t HANDOFF_INTERVAL = 64;
+#define MAX_THREADS 256
+
+static size_t num_threads;
+static _Atomic(void *) handoff_slots[MAX_THREADS];
+
+void *thread_func(void *arg) {
+  size_t id = (size_t)arg;
+  size_t rng = id * 2654435761u + 1;
+  void **slots = calloc(SLOTS_PER_THREAD, sizeof(void *));
+
+  for (size_t i = 0; i < OPS_PER_THREAD; i++) {
+    size_t slot = next_random(&rng) % SLOTS_PER_THREAD;
+    if (slots[slot] == NULL) {
+      char *ptr = malloc(next_random(&rng) % MAX_ALLOC_SIZE + 1);
+      ptr[0] = (char)i;
+      slots[slot] = ptr;
+    } else {
+      free(slots[slot]);
+      slots[slot] = NULL;
+    }
+
+    if (i % HANDOFF_INTERVAL == 0) {
+      // Free whatever the previous thread left for us
+      void *given = malloc(next_random(&rng) % MAX_ALLOC_SIZE + 1);
+      free(atomic_exchange(&handoff_slots[(id + 1) % num_threads], given));
+    }
+  }
+
+  for (size_t i = 0; i < SLOTS_PER_THREAD; i++) {
+    free(slots[i]);
+  }
+  free(slots);
+  return NULL;
+}
+
+// Run the workload on `n` threads at once and return the wall time taken
+double run_threads(size_t n) {
+  pthread_t threads[MAX_THREADS];
+  struct timespec start, end;
+
+  num_threads = n;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < n; i++) {
+    pthread_create(&threads[i], NULL, thread_func, (void *)i);
+  }
+  for (size_t i = 0; i < n; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (size_t i = 0; i < n; i++) {
+    free(atomic_exchange(&handoff_slots[i], NULL));
+  }
+
+  return (double)(end.tv_sec - start.tv_sec) +
+         (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Usage: threads [max threads]. Defaults to the number of online cores
+int main(int argc, char **argv) {
+  size_t max_threads = argc > 1 ? strtoul(argv[1], NULL, 10)
+                                : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+  if (max_threads == 0 || max_threads > MAX_THREADS) max_threads = MAX_THREADS;
+
+  printf("threads,seconds,mops_per_sec\n");
+  for (size_t n = 1; n <= max_threads; n++) {
+    double seconds = run_threads(n);
+    printf("%lu,%.3f,%.2f\n", n, seconds,
+           (double)(n * OPS_PER_THREAD) / seconds / 1e6);
+  }
+}
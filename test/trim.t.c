@@ -0,0 +1,121 @@
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_util.h"
+
+const size_t TOP_PAD = 64 * 1024;
+const size_t TRIM_THRESHOLD = 128 * 1024;
+const size_t STACK_DEPTH = 8;
+const size_t STACK_OPS = 100000;
+const size_t MAX_STACK_SIZE = 4096;
+const size_t NUM_PIECES = 256;
+const size_t PIECE_SIZE = 4096;
+// Chunk data is aligned to this, and so is the first chunk
+const size_t ALIGNMENT = 16;
+// At least the size of a chunk header
+const size_t HEADER_SIZE = 64;
+
+// Freed neighbours merge, whichever order they are freed in, and a heap that
+// is all free is given back to the OS whole without a top pad
+void test_coalesce() {
+  mallopt(M_TOP_PAD, 0);
+  mallopt(M_TRIM_THRESHOLD, 0);
+  char *start = sbrk(0);
+
+  char *a = malloc(1000);
+  // Compared after a is freed
+  uintptr_t a_address = (uintptr_t)a;
+  char *b = malloc(1000);
+  char *c = malloc(1000);
+  char *guard = malloc(16);
+  free(a);
+  free(c);
+  // Merges with both neighbours at once
+  free(b);
+  char *merged = malloc(3000);
+  if ((uintptr_t)merged != a_address) {
+    fail("merged chunk address", a_address, (uintptr_t)merged);
+  }
+
+  free(merged);
+  free(guard);
+  size_t left = (char *)sbrk(0) - start;
+  if (left >= ALIGNMENT) fail("bytes left after freeing all", 0, left);
+}
+
+// A stack of allocations and frees at the top of the heap stays within the top
+// pad, and never moves the program break
+void test_hysteresis() {
+  mallopt(M_TOP_PAD, TOP_PAD);
+  mallopt(M_TRIM_THRESHOLD, TRIM_THRESHOLD);
+
+  // The first allocation grows the heap by the top pad
+  void *stack[STACK_DEPTH];
+  stack[0] = malloc(1);
+  size_t depth = 1;
+  char *program_break = sbrk(0);
+  size_t moves = 0;
+  for (size_t i = 0; i < STACK_OPS; i++) {
+    if (depth < STACK_DEPTH && (depth == 0 || random() % 2 == 0)) {
+      stack[depth++] = malloc(random() % MAX_STACK_SIZE + 1);
+    } else {
+      free(stack[--depth]);
+    }
+    if (sbrk(0) != program_break) {
+      moves++;
+      program_break = sbrk(0);
+    }
+  }
+  while (depth > 0) free(stack[--depth]);
+  if (moves != 0) fail("program break moves", 0, moves);
+}
+
+// Freeing memory at the top lowers the break once the free top is past the
+// trim threshold, down to the top pad, so at most the threshold is kept.
+// malloc_trim gives back the rest
+void test_trim() {
+  char *pieces[NUM_PIECES];
+  // Start without a top chunk
+  malloc_trim(0);
+  char *start = sbrk(0);
+  for (size_t i = 0; i < NUM_PIECES; i++) {
+    pieces[i] = malloc(PIECE_SIZE);
+    if ((uintptr_t)pieces[i] % ALIGNMENT != 0) {
+      fail("aligned piece", 0, (uintptr_t)pieces[i] % ALIGNMENT);
+    }
+    memset(pieces[i], (int)i, PIECE_SIZE);
+  }
+  // Out of order, so merges go both ways
+  for (size_t i = NUM_PIECES - 1; i > 0; i--) {
+    size_t j = random() % (i + 1);
+    char *tmp = pieces[i];
+    pieces[i] = pieces[j];
+    pieces[j] = tmp;
+  }
+  for (size_t i = 0; i < NUM_PIECES; i++) {
+    for (size_t j = 0; j < PIECE_SIZE; j++) {
+      if (pieces[i][j] != pieces[i][0]) fail("piece contents", 0, j);
+    }
+    free(pieces[i]);
+  }
+
+  size_t kept = (char *)sbrk(0) - start;
+  if (kept < TOP_PAD || kept > TRIM_THRESHOLD + HEADER_SIZE) {
+    fail("bytes kept after trimming", TOP_PAD, kept);
+  }
+  if (!malloc_trim(0)) fail("malloc_trim gave back memory", 1, 0);
+  kept = (char *)sbrk(0) - start;
+  if (kept >= ALIGNMENT) fail("bytes kept after malloc_trim", 0, kept);
+}
+
+int main() {
+  srandom(1);
+  test_coalesce();
+  test_hysteresis();
+  test_trim();
+  printf("trim tests passed\n");
+}